@@ -0,0 +1,97 @@
+#ifndef KTHOOK_BENCH_COMMON_HPP_
+#define KTHOOK_BENCH_COMMON_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+// Counts one hardware event of the calling thread with perf_event_open, or nothing where that's not available
+// (other OSes, perf_event_paranoid, virtual machines without a PMU), results then fall back to wall time only.
+class perf_counter {
+public:
+    perf_counter(std::uint32_t type, std::uint64_t config) {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~perf_counter() {
+#ifdef __linux__
+        if (fd != -1) close(fd);
+#endif
+    }
+
+    perf_counter(const perf_counter&) = delete;
+    perf_counter& operator=(const perf_counter&) = delete;
+
+    static perf_counter itlb_misses() {
+#ifdef __linux__
+        return {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+#else
+        return {0, 0};
+#endif
+    }
+
+    bool available() const { return fd != -1; }
+
+    void start() {
+#ifdef __linux__
+        if (fd == -1) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    std::uint64_t stop() {
+        std::uint64_t value = 0;
+#ifdef __linux__
+        if (fd == -1) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &value, sizeof(value)) != sizeof(value)) value = 0;
+#endif
+        return value;
+    }
+
+private:
+    int fd = -1;
+};
+
+inline std::uint64_t now_ns() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+// time stamp counter, reference cycles rather than core cycles when frequency scaling is on
+inline std::uint64_t read_cycles() { return __rdtsc(); }
+
+#endif  // KTHOOK_BENCH_COMMON_HPP_
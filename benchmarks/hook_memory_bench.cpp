@@ -0,0 +1,74 @@
+// Heap and object memory a hook keeps after install(). Hooks used to keep a Xbyak code generator for the
+// relay stub and one for the trampoline alive, "generator" shows what each of those cost on top.
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr std::size_t kHookCount = 256;
+
+static std::atomic<std::int64_t> heap_bytes{0};
+
+void* operator new(std::size_t size) {
+    auto block = static_cast<std::size_t*>(std::malloc(size + sizeof(std::max_align_t)));
+    if (block == nullptr) throw std::bad_alloc{};
+    *block = size;
+    heap_bytes += static_cast<std::int64_t>(size);
+    return reinterpret_cast<std::uint8_t*>(block) + sizeof(std::max_align_t);
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr) return;
+    auto block = reinterpret_cast<std::size_t*>(static_cast<std::uint8_t*>(ptr) - sizeof(std::max_align_t));
+    heap_bytes -= static_cast<std::int64_t>(*block);
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept { operator delete(ptr); }
+
+template <std::size_t N>
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + static_cast<int>(N);
+}
+
+using target_type = int (*)(int);
+using hook_type = kthook::kthook_simple<target_type>;
+
+template <std::size_t... I>
+std::array<target_type, sizeof...(I)> make_targets(std::index_sequence<I...>) {
+    return {&target<I>...};
+}
+
+int main() {
+    auto targets = make_targets(std::make_index_sequence<kHookCount>{});
+
+    std::vector<std::unique_ptr<hook_type>> hooks;
+    hooks.reserve(kHookCount);
+    for (auto func : targets) hooks.emplace_back(std::make_unique<hook_type>(func));
+
+    auto before = heap_bytes.load();
+    for (auto& hook : hooks) hook->install();
+    auto installed = heap_bytes.load() - before;
+
+    // a generator holding a trampoline, as hooks kept them before
+    auto scratch = std::make_unique<std::uint8_t[]>(Xbyak::DEFAULT_MAX_CODE_SIZE);
+    before = heap_bytes.load();
+    auto gen = std::make_unique<kthook::detail::stub_generator>(Xbyak::DEFAULT_MAX_CODE_SIZE, scratch.get(),
+                                                                 scratch.get());
+    kthook::detail::create_trampoline(reinterpret_cast<std::uintptr_t>(targets[0]), *gen);
+    auto generator = heap_bytes.load() - before;
+
+    auto stats = kthook::get_code_memory_stats();
+    std::printf("hook object                  %zu bytes\n", sizeof(hook_type));
+    std::printf("heap per hook after install  %.1f bytes\n", static_cast<double>(installed) / kHookCount);
+    std::printf("generator                    %lld bytes (object %zu)\n", static_cast<long long>(generator),
+                sizeof(kthook::detail::stub_generator));
+    std::printf("code per hook                %.1f bytes\n", static_cast<double>(stats.used_bytes) / kHookCount);
+}
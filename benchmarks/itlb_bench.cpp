@@ -0,0 +1,98 @@
+// Calls many hooked functions in a random order and counts iTLB misses on the hooked call path for
+// three stub layouts:
+//   scattered - every relay stub and trampoline forced onto a page of its own, like allocating per hook
+//   arena     - the default, stubs packed into the module's arena
+//   arena+thp - the same with set_huge_code_pages(true)
+// Without perf_event_open only the time per call is reported.
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr std::size_t kTargetCount = 512;
+constexpr std::size_t kRounds = 2000;
+
+template <std::size_t N>
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + static_cast<int>(N);
+}
+
+using target_type = int (*)(int);
+using hook_type = kthook::kthook_simple<target_type>;
+
+template <std::size_t... I>
+std::array<target_type, sizeof...(I)> make_targets(std::index_sequence<I...>) {
+    return {&target<I>...};
+}
+
+// Takes the rest of the current page of every size class, the next stub of any size starts a new page
+void start_new_pages(std::uintptr_t near_address, std::vector<kthook::detail::code_block>& padding) {
+    auto& allocator = kthook::detail::code_allocator::instance();
+    auto page_size = Xbyak::inner::getPageSize();
+    for (std::size_t size = 32; size <= 4096; size *= 2) {
+        while (true) {
+            auto block = allocator.alloc(near_address, size);
+            if (!block) return;
+            if (reinterpret_cast<std::uintptr_t>(block.code) % page_size == 0) {
+                allocator.free(block.code);
+                break;
+            }
+            padding.push_back(block);
+        }
+    }
+}
+
+void run(const char* name, const std::array<target_type, kTargetCount>& targets, bool scattered) {
+    std::vector<std::unique_ptr<hook_type>> hooks;
+    std::vector<kthook::detail::code_block> padding;
+    for (auto func : targets) {
+        if (scattered) start_new_pages(reinterpret_cast<std::uintptr_t>(func), padding);
+        auto& hook = hooks.emplace_back(std::make_unique<hook_type>(func));
+        hook->set_cb([](const auto& hook, int& value) { return hook.get_trampoline()(value); });
+        hook->install();
+    }
+
+    std::vector<target_type> order;
+    for (std::size_t i = 0; i < 8; ++i) order.insert(order.end(), targets.begin(), targets.end());
+    std::shuffle(order.begin(), order.end(), std::mt19937{42});
+
+    auto itlb_misses = perf_counter::itlb_misses();
+    int sink = 0;
+    for (auto func : order) sink += func(1);  // warm up
+
+    itlb_misses.start();
+    auto start = now_ns();
+    for (std::size_t round = 0; round < kRounds; ++round) {
+        for (auto func : order) sink += func(1);
+    }
+    auto elapsed = now_ns() - start;
+    auto misses = itlb_misses.stop();
+
+    auto calls = static_cast<double>(kRounds * order.size());
+    auto stats = kthook::get_code_memory_stats();
+    std::printf("%-10s pages %5zu  %6.2f ns/call", name, stats.pages, static_cast<double>(elapsed) / calls);
+    if (itlb_misses.available()) {
+        std::printf("  %8.4f itlb misses/call", static_cast<double>(misses) / calls);
+    }
+    std::printf("  (%d)\n", sink & 1);
+
+    hooks.clear();
+    auto& allocator = kthook::detail::code_allocator::instance();
+    for (auto& block : padding) allocator.free(block.code);
+    kthook::collect_code_memory();
+}
+
+int main() {
+    auto targets = make_targets(std::make_index_sequence<kTargetCount>{});
+    std::printf("%zu hooked functions, %zu calls per layout\n", kTargetCount, kRounds * kTargetCount * 8);
+    run("scattered", targets, true);
+    run("arena", targets, false);
+    kthook::set_huge_code_pages(true);
+    run("arena+thp", targets, false);
+}
@@ -0,0 +1,69 @@
+// Nanoseconds per call through a kthook_naked stub with an empty callback
+//   fxsave   - kthook_naked, x87/SSE state only
+//   xsave    - kthook_naked_extended with the upper YMM/ZMM halves in their initial state (after vzeroupper),
+//              xsavec writes nothing but the header then
+//   dirty    - kthook_naked_extended after an AVX instruction left ymm8 in use, the AVX component gets saved
+#include <cstdio>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr int kCalls = 2'000'000;
+
+BENCH_NOINLINE int legacy_target(int value) {
+    volatile int result = value;
+    return result;
+}
+
+BENCH_NOINLINE int extended_target(int value) {
+    volatile int result = value;
+    return result;
+}
+
+using target_type = int (*)(int);
+
+#ifdef KTHOOK_64
+void measure(const char* name, target_type func) {
+    target_type volatile call = func;
+    int sum = 0;
+    auto start_ns = now_ns();
+    auto start_cycles = read_cycles();
+    for (int i = 0; i < kCalls; ++i) sum += call(i);
+    auto cycles = read_cycles() - start_cycles;
+    auto elapsed = now_ns() - start_ns;
+    volatile int sink = sum;
+    (void)sink;
+    std::printf("%-7s %.2f ns/call  %.1f cycles/call\n", name, static_cast<double>(elapsed) / kCalls,
+                static_cast<double>(cycles) / kCalls);
+}
+
+int main() {
+    auto& layout = kthook::detail::get_xsave_layout();
+    std::printf("xsave components 0x%llx, %u byte image, %s\n", static_cast<unsigned long long>(layout.components),
+                layout.size, layout.compacted ? "xsavec" : "xsave");
+
+    kthook::kthook_naked legacy{reinterpret_cast<std::uintptr_t>(&legacy_target),
+                                [](const kthook::kthook_naked&) {}};
+    kthook::kthook_naked_extended extended{reinterpret_cast<std::uintptr_t>(&extended_target),
+                                           [](const kthook::kthook_naked_extended&) {}};
+
+    measure("fxsave", &legacy_target);
+#ifndef _MSC_VER
+    if ((layout.components & (1 << 2)) != 0) asm volatile("vzeroupper");
+#endif
+    measure("xsave", &extended_target);
+#ifndef _MSC_VER
+    // xrstor on the way out of every call keeps ymm8 in use for the whole loop
+    if ((layout.components & (1 << 2)) != 0) {
+        asm volatile("vpcmpeqd %%ymm8, %%ymm8, %%ymm8" ::: "xmm8");
+        measure("dirty", &extended_target);
+        asm volatile("vzeroupper");
+    }
+#endif
+}
+#else
+int main() {
+    // x86 naked hooks only save the fxsave image
+    std::printf("x64 only\n");
+}
+#endif
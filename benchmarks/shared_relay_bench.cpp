@@ -0,0 +1,45 @@
+// Installs a kthook_simple on 64 functions of the same signature and reports the code memory each hook adds.
+// On x64 System V every hook of one type jumps into one shared relay entry, its own stub is the trampoline copy,
+// a lea and a jump, so the slots stay in the smallest size classes.
+#include <array>
+#include <memory>
+#include <utility>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr std::size_t kHookCount = 64;
+
+template <std::size_t N>
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + static_cast<int>(N);
+}
+
+using hook_type = kthook::kthook_simple<int (*)(int)>;
+
+template <std::size_t... Ns>
+std::array<std::unique_ptr<hook_type>, kHookCount> install_all(std::index_sequence<Ns...>) {
+    std::array<std::unique_ptr<hook_type>, kHookCount> hooks{std::make_unique<hook_type>(&target<Ns>)...};
+    for (auto& hook : hooks) {
+        hook->set_cb([](const auto& hook, int& value) { return hook.get_trampoline()(value); });
+        hook->install();
+    }
+    return hooks;
+}
+
+int main() {
+    auto before = kthook::get_code_memory_stats();
+    auto hooks = install_all(std::make_index_sequence<kHookCount>{});
+    auto after = kthook::get_code_memory_stats();
+
+    int sum = 0;
+    sum += target<0>(1);
+    sum += target<kHookCount - 1>(1);
+    volatile int sink = sum;
+    (void)sink;
+
+    std::printf("%zu hooks  %zu slots  %.1f bytes of code memory per hook  %zu pages\n", kHookCount,
+                after.slots - before.slots, static_cast<double>(after.used_bytes - before.used_bytes) / kHookCount,
+                after.pages - before.pages);
+}
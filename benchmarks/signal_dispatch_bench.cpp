@@ -0,0 +1,37 @@
+// Calls a kthook_signal-hooked function with 1 to 16 connected before slots, once with the slots called in a
+// loop and once through the dispatcher hook.compile() generates, and reports the time per call.
+#include <vector>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr int kCalls = 5'000'000;
+
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + 1;
+}
+
+double measure() {
+    int (*volatile call)(int) = &target;
+    int sum = 0;
+    auto start = now_ns();
+    for (int n = 0; n < kCalls; ++n) sum += call(n);
+    auto elapsed = now_ns() - start;
+    volatile int sink = sum;
+    (void)sink;
+    return static_cast<double>(elapsed) / kCalls;
+}
+
+int main() {
+    for (int slots : {1, 4, 16}) {
+        kthook::kthook_signal<decltype(&target)> hook{&target};
+        for (int i = 0; i < slots; ++i) hook.before += [](const auto&, int& value) { return std::nullopt; };
+
+        auto loop = measure();
+        hook.compile();
+        auto compiled = measure();
+        std::printf("%2d slots  loop %6.2f ns  compiled %6.2f ns%s\n", slots, loop, compiled,
+                    hook.before.is_compiled() ? "" : "  (generation failed)");
+    }
+}
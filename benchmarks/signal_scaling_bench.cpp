@@ -0,0 +1,59 @@
+// Calls one kthook_signal-hooked function with a connected before slot from 1 to N threads at once and reports
+// the total throughput. Emitting walks the slot list without locks, throughput should grow with the thread count
+// instead of flattening out on a lock shared by all callers.
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr int kCallsPerThread = 2'000'000;
+
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + 1;
+}
+
+double run(unsigned thread_count) {
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < thread_count; ++i) {
+        threads.emplace_back([&] {
+            int (*volatile call)(int) = &target;
+            ++ready;
+            while (!go.load(std::memory_order_acquire)) {
+            }
+            int sum = 0;
+            for (int n = 0; n < kCallsPerThread; ++n) sum += call(n);
+            volatile int sink = sum;
+            (void)sink;
+        });
+    }
+    while (ready.load() != thread_count) {
+    }
+    auto start = now_ns();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads) thread.join();
+    auto elapsed = now_ns() - start;
+    return static_cast<double>(kCallsPerThread) * thread_count / (static_cast<double>(elapsed) / 1e9);
+}
+
+int main() {
+    kthook::kthook_signal<decltype(&target)> hook{&target};
+    hook.before += [](const auto&, int& value) { return std::nullopt; };
+
+    auto max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> counts;
+    for (unsigned count = 1; count < max_threads; count *= 2) counts.push_back(count);
+    counts.push_back(max_threads);
+
+    double single = 0;
+    for (auto count : counts) {
+        auto calls_per_second = run(count);
+        if (count == 1) single = calls_per_second;
+        std::printf("%3u threads  %8.2f Mcalls/s  x%.2f\n", count, calls_per_second / 1e6, calls_per_second / single);
+    }
+}
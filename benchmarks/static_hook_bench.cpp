@@ -0,0 +1,49 @@
+// Time per call of a hooked function whose callback skips the original:
+//   unhooked      - the plain function, for reference
+//   kthook_simple - callback held in std::function, called through it from the relay
+//   kthook_static - callback is a template argument and called directly, so it can be inlined into the relay
+#include <cstdio>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr int kCalls = 20'000'000;
+
+template <std::size_t N>
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + static_cast<int>(N);
+}
+
+using target_type = int (*)(int);
+
+constexpr auto add_one = [](const auto&, int& value) { return value + 1; };
+
+double measure(target_type func) {
+    // call through a volatile pointer so the call isn't folded away
+    target_type volatile call = func;
+    int sum = 0;
+    auto start = now_ns();
+    for (int i = 0; i < kCalls; ++i) sum += call(i);
+    auto elapsed = now_ns() - start;
+    volatile int sink = sum;
+    (void)sink;
+    return static_cast<double>(elapsed) / kCalls;
+}
+
+int main() {
+    auto unhooked = measure(&target<0>);
+
+    kthook::kthook_simple<target_type> simple{&target<1>};
+    simple.set_cb(add_one);
+    simple.install();
+    auto simple_ns = measure(&target<1>);
+
+    kthook::kthook_static<target_type, &add_one> fixed{&target<2>};
+    fixed.install();
+    auto static_ns = measure(&target<2>);
+
+    std::printf("unhooked       %.2f ns/call\n", unhooked);
+    std::printf("kthook_simple  %.2f ns/call\n", simple_ns);
+    std::printf("kthook_static  %.2f ns/call (%.2f ns/call saved)\n", static_ns, simple_ns - static_ns);
+}
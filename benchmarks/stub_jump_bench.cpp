@@ -0,0 +1,88 @@
+// Calls many functions through one stub each, in a random order, with the stub jumping on to the function
+//   indirect - FF25 jmp [rip] with the address inline, how stubs always reached relays and continuations before
+//   direct   - E9 rel32, what detail::emit_jump emits when the function is within reach
+// Many distinct indirect jumps compete for the BTB, the direct ones are predicted from their encoding.
+#include <algorithm>
+#include <array>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr std::size_t kTargetCount = 2048;
+constexpr std::size_t kRounds = 500;
+
+template <std::size_t N>
+BENCH_NOINLINE int target(int value) {
+    volatile int result = value;
+    return result + static_cast<int>(N);
+}
+
+using target_type = int (*)(int);
+
+template <std::size_t... I>
+std::array<target_type, sizeof...(I)> make_targets(std::index_sequence<I...>) {
+    return {&target<I>...};
+}
+
+#ifdef KTHOOK_64
+template <typename Emit>
+std::vector<kthook::detail::code_block> make_stubs(const std::array<target_type, kTargetCount>& targets, Emit emit) {
+    std::vector<kthook::detail::code_block> stubs;
+    for (auto func : targets) {
+        auto address = reinterpret_cast<std::uintptr_t>(func);
+        stubs.push_back(kthook::detail::generate_near(address, [&](kthook::detail::stub_generator& gen) {
+            emit(gen, address);
+            return true;
+        }));
+    }
+    return stubs;
+}
+
+void measure(const char* name, const std::vector<kthook::detail::code_block>& stubs,
+             const std::vector<std::size_t>& order) {
+    int sum = 0;
+    auto start_ns = now_ns();
+    auto start_cycles = read_cycles();
+    for (std::size_t round = 0; round < kRounds; ++round) {
+        for (auto index : order) sum += reinterpret_cast<target_type>(stubs[index].code)(static_cast<int>(round));
+    }
+    auto cycles = read_cycles() - start_cycles;
+    auto elapsed = now_ns() - start_ns;
+    volatile int sink = sum;
+    (void)sink;
+    double calls = static_cast<double>(kRounds) * order.size();
+    std::printf("%-9s %.2f ns/call  %.1f cycles/call\n", name, elapsed / calls, cycles / calls);
+}
+
+int main() {
+    auto targets = make_targets(std::make_index_sequence<kTargetCount>{});
+
+    auto indirect = make_stubs(targets, [](kthook::detail::stub_generator& gen, std::uintptr_t destination) {
+        using namespace Xbyak::util;
+        gen.jmp(ptr[rip]);
+        gen.db(destination, 8);
+    });
+    auto direct = make_stubs(targets, [](kthook::detail::stub_generator& gen, std::uintptr_t destination) {
+        kthook::detail::emit_jump(gen, destination);
+    });
+
+    std::vector<std::size_t> order(kTargetCount);
+    for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937{42});
+
+    measure("indirect", indirect, order);
+    measure("direct", direct, order);
+
+    for (auto& stubs : {indirect, direct}) {
+        for (auto& stub : stubs) kthook::detail::code_allocator::instance().free(stub.code);
+    }
+}
+#else
+int main() {
+    // x86 stubs always reach relays and continuations with rel32
+    std::printf("x64 only\n");
+}
+#endif
@@ -0,0 +1,50 @@
+// Cycles per call through a kthook_simple relay for the signatures of tests/lots_of_arguments_test.cpp:
+// 16 mixed integer/floating point arguments, most of them passed on the stack, once with the callback only
+// and once with the callback calling the original function.
+#include <cstdio>
+
+#include "bench_common.hpp"
+#include "kthook/kthook.hpp"
+
+constexpr int kCalls = 5'000'000;
+
+BENCH_NOINLINE void lots_of_arguments(int v1, float v2, long long v3, double v4, short v5, char v6, int v7,
+                                      long double v8, float v9, int v10, int v11, long v12, long long v13, int v14,
+                                      int v15, int v16) {
+    volatile int sink = v1 + v16;
+    (void)sink;
+}
+
+BENCH_NOINLINE void lots_of_arguments_original(int v1, float v2, long long v3, double v4, short v5, char v6, int v7,
+                                               long double v8, float v9, int v10, int v11, long v12, long long v13,
+                                               int v14, int v15, int v16) {
+    volatile int sink = v1 + v16;
+    (void)sink;
+}
+
+using function_type = decltype(&lots_of_arguments);
+
+double measure(function_type func) {
+    function_type volatile call = func;
+    auto start = read_cycles();
+    for (int i = 0; i < kCalls; ++i) call(i, 2.0f, 3, 4.0, 5, 6, 7, 8.0, 9.0f, 10, 11, 12, 13, 14, 15, i);
+    return static_cast<double>(read_cycles() - start) / kCalls;
+}
+
+int main() {
+    auto unhooked = measure(&lots_of_arguments);
+
+    kthook::kthook_simple<function_type> callback_only{&lots_of_arguments};
+    callback_only.set_cb([](const auto&, auto&&...) {});
+    callback_only.install();
+    auto relay = measure(&lots_of_arguments);
+
+    kthook::kthook_simple<function_type> calls_original{&lots_of_arguments_original};
+    calls_original.set_cb([](const auto& hook, auto&&... args) { hook.get_trampoline()(args...); });
+    calls_original.install();
+    auto relay_and_original = measure(&lots_of_arguments_original);
+
+    std::printf("unhooked               %.1f cycles/call\n", unhooked);
+    std::printf("relay, callback only   %.1f cycles/call\n", relay);
+    std::printf("relay, calls original  %.1f cycles/call\n", relay_and_original);
+}
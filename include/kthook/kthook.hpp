@@ -13,6 +13,10 @@
 #define KTHOOK_32
 #endif
 #endif
+// initial-exec thread locals sit at a fixed offset from fs, stubs hand data to relays through them
+#if defined(KTHOOK_64_GCC) && (defined(__linux__) || defined(__FreeBSD__))
+#define KTHOOK_64_TLS
+#endif
 
 #if defined(KTHOOK_64) || defined(KTHOOK_32)
 #include "xbyak/xbyak.h"
@@ -26,6 +30,9 @@
 #endif
 #include <windows.h>
 #include <tlhelp32.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #else
 #include <filesystem>
 #include <charconv>
@@ -34,17 +41,32 @@
 #ifdef __linux__
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <link.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
 #endif
 #endif
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <tuple>
+#include <utility>
 #include <vector>
 #include <type_traits>
 
@@ -52,16 +74,24 @@
 // clang-format off
 #include "hde/hde64.h"
 #include "x86_64/kthook_x86_64_detail.hpp"
+#include "x86_64/kthook_x86_64_function.hpp"
 #include "x64/kthook_detail.hpp"
+#include "x86_64/kthook_x86_64_allocator.hpp"
 #include "x64/kthook_impl.hpp"
+#include "x86_64/kthook_x86_64_signal.hpp"
+#include "x86_64/kthook_x86_64_transaction.hpp"
 // clang-format on
 
 #elif defined(KTHOOK_32)
 // clang-format off
 #include "hde/hde32.h"
 #include "x86_64/kthook_x86_64_detail.hpp"
+#include "x86_64/kthook_x86_64_function.hpp"
 #include "x86/kthook_detail.hpp"
+#include "x86_64/kthook_x86_64_allocator.hpp"
 #include "x86/kthook_impl.hpp"
+#include "x86_64/kthook_x86_64_signal.hpp"
+#include "x86_64/kthook_x86_64_transaction.hpp"
 // clang-format on
 #endif
 
@@ -130,7 +130,116 @@ using function_connect_t = typename function_connect<R, Types...>::type;
 
 } // namespace traits
 
-#ifndef _WIN32
+#ifdef KTHOOK_64_TLS
+// Per-thread stack of data stubs hand to their relays. A stub pushes an entry right before jumping into its relay
+// and the relay pops it first thing. A signal handler that calls hooked functions in between pushes and pops entries
+// of its own above the interrupted one, so every relay gets its own entry back. Only signals nest, so a few entries
+// are enough, deeper nesting wraps around. initial-exec keeps the stack in static TLS, its offset from fs is then
+// the same for every thread and stubs address it directly as fs:[offset].
+template <typename Entry>
+struct relay_stack {
+    static constexpr std::size_t kDepth = 4;
+    static_assert((kDepth & (kDepth - 1)) == 0, "stubs wrap the index with a mask");
+
+    std::uintptr_t top;  // entries pushed, stubs take the low bits as index
+    Entry entries[kDepth];
+
+    // the entry is read before it is released, a signal arriving in between can't reuse it
+    Entry pop() {
+        auto index = top - 1;
+        Entry entry = entries[index % kDepth];
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        top = index;
+        return entry;
+    }
+};
+
+// offset of an initial-exec thread_local from fs, the same for every thread
+inline std::int32_t get_tls_offset(const void* variable) {
+    std::uintptr_t thread_pointer;
+    asm("mov %%fs:0, %0" : "=r"(thread_pointer));
+    return static_cast<std::int32_t>(reinterpret_cast<std::uintptr_t>(variable) - thread_pointer);
+}
+
+// mov qword ptr fs:[offset], reg (64 REX.W 89 modrm SIB disp32)
+inline void store_tls(Xbyak::CodeGenerator& gen, std::int32_t offset, const Xbyak::Reg64& reg) {
+    auto index = reg.getIdx();
+    gen.db(0x64);
+    gen.db(0x48 | ((index & 8) >> 1));
+    gen.db(0x89);
+    gen.db(0x04 | ((index & 7) << 3));
+    gen.db(0x25);
+    gen.dd(static_cast<std::uint32_t>(offset));
+}
+
+// mov qword ptr fs:[rax + offset], reg (64 REX.W 89 modrm disp32)
+inline void store_tls_indexed(Xbyak::CodeGenerator& gen, std::int32_t offset, const Xbyak::Reg64& reg) {
+    auto index = reg.getIdx();
+    gen.db(0x64);
+    gen.db(0x48 | ((index & 8) >> 1));
+    gen.db(0x89);
+    gen.db(0x80 | ((index & 7) << 3));
+    gen.dd(static_cast<std::uint32_t>(offset));
+}
+
+// Reserves the next entry of a relay_stack whose top is at fs:[top_offset]: rax = offset of the entry from the
+// entries, top is incremented first so a signal arriving before the entry is written takes the one above.
+// Clobbers the flags.
+template <typename Entry>
+inline void emit_relay_stack_push(Xbyak::CodeGenerator& gen, std::int32_t top_offset) {
+    using namespace Xbyak::util;
+    constexpr std::uint8_t load_code[] = {0x64, 0x48, 0x8B, 0x04, 0x25};  // mov rax, qword ptr fs:[top]
+    constexpr std::uint8_t inc_code[] = {0x64, 0x48, 0xFF, 0x04, 0x25};   // inc qword ptr fs:[top]
+    gen.db(load_code, sizeof(load_code));
+    gen.dd(static_cast<std::uint32_t>(top_offset));
+    gen.db(inc_code, sizeof(inc_code));
+    gen.dd(static_cast<std::uint32_t>(top_offset));
+    gen.and_(eax, static_cast<std::uint32_t>(relay_stack<Entry>::kDepth - 1));
+    gen.imul(eax, eax, static_cast<int>(sizeof(Entry)));
+}
+
+// Hooks whose relay stubs are running, so the relay can have the hooked function's own signature
+inline thread_local relay_stack<void*> relay_hooks __attribute__((tls_model("initial-exec"))) = {};
+
+// pushes r11 onto relay_hooks, leaves every other register but the flags as it was
+inline void push_relay_hook(Xbyak::CodeGenerator& gen) {
+    using namespace Xbyak::util;
+    static const std::int32_t top = get_tls_offset(&relay_hooks.top);
+    static const std::int32_t entries = get_tls_offset(&relay_hooks.entries);
+    gen.push(rax);
+    emit_relay_stack_push<void*>(gen, top);
+    store_tls_indexed(gen, entries, r11);
+    gen.pop(rax);
+}
+
+// Depth of kNoReentry relays running on this thread. Their stubs test and increment it fs-relative and go straight
+// to the trampoline while it isn't 0, the relay's frame decrements it on the way out.
+inline thread_local std::uintptr_t relay_depth __attribute__((tls_model("initial-exec"))) = 0;
+
+// cmp qword ptr fs:[relay_depth], 0; jne bypass; inc qword ptr fs:[relay_depth]
+inline void emit_reentry_guard(Xbyak::CodeGenerator& gen, const Xbyak::Label& bypass) {
+    static const std::int32_t offset = get_tls_offset(&relay_depth);
+    constexpr std::uint8_t cmp_code[] = {0x64, 0x48, 0x83, 0x3C, 0x25};
+    constexpr std::uint8_t inc_code[] = {0x64, 0x48, 0xFF, 0x04, 0x25};
+    gen.db(cmp_code, sizeof(cmp_code));
+    gen.dd(static_cast<std::uint32_t>(offset));
+    gen.db(0x00);
+    gen.jne(bypass, Xbyak::CodeGenerator::LabelType::T_NEAR);
+    gen.db(inc_code, sizeof(inc_code));
+    gen.dd(static_cast<std::uint32_t>(offset));
+}
+
+// relay frame of a kNoReentry hook, takes back the depth its stub added
+template <typename Frame>
+struct no_reentry_frame : Frame {
+    using Frame::Frame;
+
+    ~no_reentry_frame() { --relay_depth; }
+};
+
+#elif !defined(_WIN32)
+// Where thread locals can't be addressed from a stub the hook goes on the stack, in a struct passed in memory
+// right before the stack arguments
 template <typename HookType>
 struct SystemVAbiTrick {
     HookType* ptr;
@@ -141,18 +250,30 @@ private:
 
 #endif
 
+// Address of the return address of the function it is used in. Stubs enter relays with a jump, so inside a relay
+// that is the hooked function's caller.
+#ifdef _MSC_VER
+#define KTHOOK_RETURN_ADDRESS_SLOT() static_cast<std::uintptr_t*>(_AddressOfReturnAddress())
+#else
+#define KTHOOK_RETURN_ADDRESS_SLOT() (static_cast<std::uintptr_t*>(__builtin_frame_address(0)) + 1)
+#endif
+
 template <typename HookType, typename Ret, typename Head, typename Tail, typename Args>
 struct common_relay_generator {
 };
 
 template <typename HookType, typename Ret, typename... Head, typename... Tail, typename... Args>
 struct common_relay_generator<HookType, Ret, std::tuple<Head...>, std::tuple<Tail...>, std::tuple<Args...>> {
-#ifndef _WIN32
+#if defined(KTHOOK_64_TLS)
+    static Ret relay(Head... head_args, Tail... tail_args) {
+        auto this_hook = static_cast<HookType*>(relay_hooks.pop());
+#elif !defined(_WIN32)
     static Ret relay(Head... head_args, SystemVAbiTrick<HookType> rsp_ptr, Tail... tail_args) {
         auto this_hook = rsp_ptr.ptr;
 #else
     static Ret relay(Head ... head_args, HookType* this_hook, void*, Tail ... tail_args) {
 #endif
+        typename HookType::relay_frame frame{this_hook, KTHOOK_RETURN_ADDRESS_SLOT()};
         auto& cb = this_hook->get_callback();
         return common_relay<decltype(cb), HookType, Ret, Args...>(cb, this_hook, head_args..., tail_args...);
     }
@@ -164,12 +285,8 @@ struct common_relay_generator_three_args {
 
 template <typename HookType, typename Ret, typename... Head, typename... Tail, typename... Args>
 struct common_relay_generator_three_args<HookType, Ret, std::tuple<Head...>, std::tuple<Tail...>, std::tuple<Args...>> {
-#ifndef _WIN32
-        static Ret relay(Head... head_args, SystemVAbiTrick<HookType> rsp_ptr, Tail... tail_args) {
-            auto this_hook = rsp_ptr.ptr;
-#else
     static Ret relay(Head ... head_args, HookType* this_hook, Tail ... tail_args) {
-#endif
+        typename HookType::relay_frame frame{this_hook, KTHOOK_RETURN_ADDRESS_SLOT()};
         auto& cb = this_hook->get_callback();
         return common_relay<decltype(cb), HookType, Ret, Args...>(cb, this_hook, head_args..., tail_args...);
     }
@@ -181,12 +298,16 @@ struct signal_relay_generator {
 
 template <typename HookType, typename Ret, typename... Head, typename... Tail, typename... Args>
 struct signal_relay_generator<HookType, Ret, std::tuple<Head...>, std::tuple<Tail...>, std::tuple<Args...>> {
-#ifndef _WIN32
+#if defined(KTHOOK_64_TLS)
+    static Ret relay(Head... head_args, Tail... tail_args) {
+        auto this_hook = static_cast<HookType*>(relay_hooks.pop());
+#elif !defined(_WIN32)
     static Ret relay(Head... head_args, SystemVAbiTrick<HookType> rsp_ptr, Tail... tail_args) {
         auto this_hook = rsp_ptr.ptr;
 #else
     static Ret relay(Head ... head_args, HookType* this_hook, void*, Tail ... tail_args) {
 #endif
+        typename HookType::relay_frame frame{this_hook, KTHOOK_RETURN_ADDRESS_SLOT()};
         return signal_relay<HookType, Ret, Args...>(this_hook, head_args..., tail_args...);
     }
 };
@@ -196,17 +317,16 @@ struct signal_relay_generator_three_args;
 
 template <typename HookType, typename Ret, typename... Head, typename... Tail, typename... Args>
 struct signal_relay_generator_three_args<HookType, Ret, std::tuple<Head...>, std::tuple<Tail...>, std::tuple<Args...>> {
-#ifndef _WIN32
-    static Ret relay(Head... head_args, SystemVAbiTrick<HookType> rsp_ptr, Tail... tail_args) {
-        auto this_hook = rsp_ptr.ptr;
-#else
     static Ret relay(Head ... head_args, HookType* this_hook, Tail ... tail_args) {
-#endif
+        typename HookType::relay_frame frame{this_hook, KTHOOK_RETURN_ADDRESS_SLOT()};
         return signal_relay<HookType, Ret, Args...>(this_hook, head_args..., tail_args...);
     }
 };
 
-inline std::uintptr_t find_prev_free(std::uintptr_t from, std::uintptr_t to, std::uintptr_t granularity) {
+constexpr std::uintptr_t kMaxMemoryRange = 0x40000000; // 1gb
+
+inline std::uintptr_t find_prev_free(std::uintptr_t from, std::uintptr_t to, std::uintptr_t granularity,
+                                     std::size_t size) {
 #ifdef KTHOOK_64_WIN
     to -= to % granularity; // alignment
     to -= granularity;
@@ -219,31 +339,28 @@ inline std::uintptr_t find_prev_free(std::uintptr_t from, std::uintptr_t to, std
     }
     return 0;
 #else
-    auto map_infos = parse_proc_maps();
+    auto& index = memory_map_index::instance();
 
     to -= to % granularity;  // alignment
     to -= granularity;
     while (from < to) {
-        bool found = false;
-        for (auto& mi : map_infos) {
-            if (mi.start <= to && to < mi.end) {
-                found = true;
-                to = mi.start - granularity;
-                if (mi.start < granularity) {
-                    return 0;
-                }
-                break;
-            }
-        }
-        if (!found) {
+        // the whole [to, to + size) has to be free, MAP_FIXED would silently replace anything inside
+        auto mi = index.find_overlapping(to, to + size);
+        if (!mi) {
             return to;
         }
+        if (mi->start < size + granularity) {
+            return 0;
+        }
+        to = mi->start - size;
+        to -= to % granularity;
     }
     return 0;
 #endif
 }
 
-inline std::uintptr_t find_next_free(std::uintptr_t from, std::uintptr_t to, std::uintptr_t granularity) {
+inline std::uintptr_t find_next_free(std::uintptr_t from, std::uintptr_t to, std::uintptr_t granularity,
+                                     std::size_t size) {
 #ifdef KTHOOK_64_WIN
     from -= from % granularity; // alignment
     from += granularity;
@@ -259,38 +376,211 @@ inline std::uintptr_t find_next_free(std::uintptr_t from, std::uintptr_t to, std
     }
     return 0;
 #else
-    auto map_infos = parse_proc_maps();
+    auto& index = memory_map_index::instance();
 
     from -= from % granularity;  // alignment
     from += granularity;
     while (from <= to) {
-        bool found = false;
-        for (auto& mi : map_infos) {
-            if (mi.start <= from && from < mi.end) {
-                found = true;
-                from = mi.end;
-                if (mi.start < granularity) {
-                    return 0;
+        auto mi = index.find_overlapping(from, from + size);
+        if (!mi) {
+            return from;
+        }
+        if (mi->start < granularity) {
+            return 0;
+        }
+        from = mi->end;
+        from += granularity - 1;
+        from -= from % granularity;
+    }
+    return 0;
+#endif
+}
+
+inline bool is_in_near_range(std::uintptr_t address, std::uintptr_t other) {
+    auto distance = address < other ? other - address : address - other;
+    return distance < kMaxMemoryRange;
+}
+
+#ifndef KTHOOK_64_WIN
+#if defined(MAP_FIXED_NOREPLACE)
+constexpr int kMapFixedNoReplace = MAP_FIXED_NOREPLACE;
+#elif defined(__linux__)
+constexpr int kMapFixedNoReplace = 0x100000; // linux >= 4.17, older kernels take the address as a hint
+#else
+constexpr int kMapFixedNoReplace = 0; // the address is only a hint, reserve checks where the mapping went
+#endif
+
+// executable segment of the loaded module containing address, the mapping itself if it isn't part of one
+inline std::pair<std::uintptr_t, std::uintptr_t> get_module_text(std::uintptr_t address) {
+#ifdef __linux__
+    struct query {
+        std::uintptr_t address;
+        std::uintptr_t start;
+        std::uintptr_t end;
+    } q{address, 0, 0};
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, std::size_t, void* data) {
+            auto q = static_cast<query*>(data);
+            for (int i = 0; i < info->dlpi_phnum; ++i) {
+                const auto& phdr = info->dlpi_phdr[i];
+                if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+                std::uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+                if (start <= q->address && q->address < start + phdr.p_memsz) {
+                    q->start = start;
+                    q->end = start + phdr.p_memsz;
+                    return 1;
+                }
+            }
+            return 0;
+        },
+        &q);
+    if (q.start != 0) return {q.start, q.end};
+#endif
+    if (auto mi = memory_map_index::instance().find(address)) return {mi->start, mi->end};
+    return {address, address + 1};
+}
+
+// Address space reserved PROT_NONE next to the executable segment of each hooked module, so the stubs
+// of one module share a single contiguous arena instead of being scattered around .text.
+// Code regions are committed inside an arena with MAP_FIXED over memory we already own, so only reserving
+// has to look for free space and it uses MAP_FIXED_NOREPLACE, which fails instead of replacing a mapping
+// created after the index was read. Where that flag doesn't exist the address is a hint and a mapping
+// that ended up anywhere else is unmapped again.
+// Regions of kHugePageSize are committed 2mb aligned and advised MADV_HUGEPAGE, see set_huge_code_pages.
+class near_reservations {
+public:
+    static constexpr std::size_t kChunkSize = 0x10000;
+    static constexpr std::size_t kReservationSize = 0x2000000; // 32mb, halved until it fits
+
+    static near_reservations& instance() {
+        static near_reservations reservations;
+        return reservations;
+    }
+
+    // fd != -1 maps a read-execute view of that file instead of anonymous read-write-execute memory
+    void* commit(std::uintptr_t address, std::size_t size, int fd) {
+        std::size_t chunks = (size + kChunkSize - 1) / kChunkSize;
+        std::size_t alignment = size % kHugePageSize == 0 ? kHugePageSize : kChunkSize;
+        auto text = get_module_text(address);
+        std::lock_guard lock{mutex};
+        std::uintptr_t start = find_chunks(text.first, address, chunks, alignment);
+        if (start == 0) {
+            if (!reserve(text, address, chunks * kChunkSize, alignment)) return nullptr;
+            start = find_chunks(text.first, address, chunks, alignment);
+            if (start == 0) return nullptr;
+        }
+
+        const int prot = fd == -1 ? PROT_EXEC | PROT_READ | PROT_WRITE : PROT_EXEC | PROT_READ;
+        const int flags = fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED : MAP_SHARED | MAP_FIXED;
+        void* result = mmap(reinterpret_cast<void*>(start), size, prot, flags, fd, 0);
+        if (result == MAP_FAILED) return nullptr;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        // only a hint, shared memfd views need shmem_enabled=advise to actually get huge pages
+        if (alignment == kHugePageSize) madvise(result, size, MADV_HUGEPAGE);
+#endif
+        mark(start, chunks, true);
+        return result;
+    }
+
+    void decommit(void* address, std::size_t size) {
+        std::size_t chunks = (size + kChunkSize - 1) / kChunkSize;
+        std::lock_guard lock{mutex};
+        // back to an inaccessible reservation, this drops the pages and the file reference
+        mmap(address, chunks * kChunkSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+             0);
+        mark(reinterpret_cast<std::uintptr_t>(address), chunks, false);
+    }
+
+private:
+    struct reservation {
+        std::uintptr_t module;  // start of the executable segment the arena belongs to
+        std::uintptr_t base;
+        std::size_t size;
+        std::vector<bool> used;
+    };
+
+    std::uintptr_t find_chunks(std::uintptr_t module, std::uintptr_t address, std::size_t chunks,
+                               std::size_t alignment) const {
+        for (auto& r : reservations) {
+            if (r.module != module) continue;
+            std::size_t run = 0;
+            for (std::size_t i = 0; i < r.used.size(); ++i) {
+                std::uintptr_t start = r.base + i * kChunkSize;
+                if (run == 0 && start % alignment != 0) continue;
+                if (r.used[i]) {
+                    run = 0;
+                    continue;
+                }
+                if (++run != chunks) continue;
+
+                start = r.base + (i + 1 - chunks) * kChunkSize;
+                if (is_in_near_range(address, start) && is_in_near_range(address, start + chunks * kChunkSize)) {
+                    return start;
                 }
-                break;
+                run = 0;
             }
         }
-        if (found) {
-            from += granularity - 1;
-            from -= from % granularity;
+        return 0;
+    }
+
+    void mark(std::uintptr_t start, std::size_t chunks, bool used) {
+        for (auto& r : reservations) {
+            if (start < r.base || r.base + r.size <= start) continue;
+            std::size_t first = (start - r.base) / kChunkSize;
+            for (std::size_t i = first; i < first + chunks; ++i) r.used[i] = used;
+            return;
         }
-        else {
-            return from;
+    }
+
+    bool reserve(std::pair<std::uintptr_t, std::uintptr_t> text, std::uintptr_t address, std::size_t min_size,
+                 std::size_t alignment) {
+        std::uintptr_t min_address = address;
+        std::uintptr_t max_address = address;
+
+        if (kMaxMemoryRange <= address) min_address = address - kMaxMemoryRange;
+
+        // overflow check
+        if (address < address + kMaxMemoryRange) max_address = address + kMaxMemoryRange;
+
+        // right behind the executable segment if possible, in front of it otherwise
+        std::uintptr_t after = std::clamp(text.second, min_address, max_address);
+        std::uintptr_t before = std::clamp(text.first, min_address, max_address);
+
+        auto& index = memory_map_index::instance();
+        index.refresh();
+        for (std::size_t size = kReservationSize; min_size <= size; size /= 2) {
+            // a failed attempt means someone mapped the spot in between, search again on a fresh index
+            for (int attempt = 0; attempt < 4; ++attempt) {
+                std::uintptr_t alloc = 0;
+                if (size - 1 <= max_address - after) {
+                    alloc = find_next_free(after - 1, max_address - (size - 1), alignment, size);
+                }
+                if (alloc == 0) alloc = find_prev_free(min_address, before, alignment, size);
+                if (alloc == 0) break;
+
+                void* result = mmap(reinterpret_cast<void*>(alloc), size, PROT_NONE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | kMapFixedNoReplace, -1, 0);
+                if (result == reinterpret_cast<void*>(alloc)) {
+                    index.insert({alloc, alloc + size, PROT_NONE});
+                    reservations.push_back({text.first, alloc, size, std::vector<bool>(size / kChunkSize)});
+                    return true;
+                }
+                // without MAP_FIXED_NOREPLACE the address is only a hint and the mapping may land elsewhere
+                if (result != MAP_FAILED) munmap(result, size);
+                index.refresh();
+            }
         }
+        return false;
     }
-    return 0;
+
+    std::vector<reservation> reservations;
+    std::mutex mutex;
+};
 #endif
-}
 
-inline void* try_alloc_near(std::uintptr_t address) {
+// fd != -1 maps a read-execute view of that file instead of anonymous read-write-execute memory
+inline void* try_alloc_near(std::uintptr_t address, std::size_t size, int fd = -1) {
 #ifdef KTHOOK_64_WIN
-    constexpr auto kMaxMemoryRange = 0x40000000; // 1gb
-    constexpr auto kMemoryBlockSize = 0x1000;    // windows page size
     SYSTEM_INFO si;
     GetSystemInfo(&si);
     std::uintptr_t min_address = reinterpret_cast<std::uintptr_t>(si.lpMinimumApplicationAddress);
@@ -300,17 +590,17 @@ inline void* try_alloc_near(std::uintptr_t address) {
 
     if (address + kMaxMemoryRange <= max_address) max_address = address + kMaxMemoryRange;
 
-    // Make room for one page
-    max_address -= kMemoryBlockSize - 1;
+    // Make room for the whole block
+    max_address -= size - 1;
 
     void* result = nullptr;
     {
         std::uintptr_t alloc = address;
         while (min_address <= alloc) {
-            alloc = find_prev_free(min_address, alloc, si.dwAllocationGranularity);
+            alloc = find_prev_free(min_address, alloc, si.dwAllocationGranularity, size);
             if (alloc == 0) break;
 
-            result = VirtualAlloc(reinterpret_cast<void*>(alloc), kMemoryBlockSize, MEM_COMMIT | MEM_RESERVE,
+            result = VirtualAlloc(reinterpret_cast<void*>(alloc), size, MEM_COMMIT | MEM_RESERVE,
                                   PAGE_EXECUTE_READWRITE);
             if (result != nullptr) break;
         }
@@ -318,57 +608,64 @@ inline void* try_alloc_near(std::uintptr_t address) {
     if (result == nullptr) {
         std::uintptr_t alloc = address;
         while (alloc <= max_address) {
-            alloc = find_next_free(alloc, max_address, si.dwAllocationGranularity);
+            alloc = find_next_free(alloc, max_address, si.dwAllocationGranularity, size);
             if (alloc == 0) break;
 
-            result = VirtualAlloc(reinterpret_cast<void*>(alloc), kMemoryBlockSize, MEM_COMMIT | MEM_RESERVE,
+            result = VirtualAlloc(reinterpret_cast<void*>(alloc), size, MEM_COMMIT | MEM_RESERVE,
                                   PAGE_EXECUTE_READWRITE);
             if (result != nullptr) break;
         }
     }
     return result;
 #else
-    constexpr auto kMaxMemoryRange = 0x40000000;  // 1gb
-    static auto kMemoryBlockSize = sysconf(_SC_PAGESIZE);
-
-    std::uintptr_t min_address = address;
-    std::uintptr_t max_address = address;
-
-    if (kMaxMemoryRange <= address) min_address = address - kMaxMemoryRange;
-
-    // overflow check
-    if (address < address + kMaxMemoryRange) max_address = address + kMaxMemoryRange;
+    return near_reservations::instance().commit(address, size, fd);
+#endif
+}
 
-    max_address -= kMemoryBlockSize - 1;
-    void* result = nullptr;
-    {
-        std::uintptr_t alloc = address;
-        while (min_address <= alloc) {
-            alloc = find_prev_free(min_address, alloc, kMemoryBlockSize);
-            if (alloc == 0) break;
+inline void free_near(void* address, std::size_t size) {
+#ifdef KTHOOK_64_WIN
+    VirtualFree(address, 0, MEM_RELEASE);
+#else
+    near_reservations::instance().decommit(address, size);
+#endif
+}
 
-            result = mmap(reinterpret_cast<void*>(alloc), kMemoryBlockSize, PROT_EXEC | PROT_READ | PROT_WRITE,
-                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, 0, 0);
-            if (result == reinterpret_cast<void*>(0xFFFFFFFFFFFFFFFF) || reinterpret_cast<std::uintptr_t>(result) != alloc) result = nullptr;
-            break;
+// Executable memory near address. On Linux it's a memfd mapped twice: read-execute near address and
+// read-write anywhere, code is written only through the second view and no mapping is ever writable and executable.
+// Falls back to a single read-write-execute mapping (exec == write) where that's not possible.
+inline code_region_memory alloc_code_region(std::uintptr_t address, std::size_t size) {
+#if defined(__linux__)
+    int fd = static_cast<int>(syscall(SYS_memfd_create, "kthook", MFD_CLOEXEC));
+    if (fd != -1) {
+        code_region_memory result{};
+        if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            void* write = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (write != MAP_FAILED) {
+                if (void* exec = try_alloc_near(address, size, fd)) {
+                    result = {static_cast<std::uint8_t*>(exec), static_cast<std::uint8_t*>(write)};
+                } else {
+                    munmap(write, size);
+                }
+            }
         }
+        // both views keep the file alive
+        close(fd);
+        if (result.exec != nullptr) return result;
     }
-    if (result == nullptr) {
-        std::uintptr_t alloc = address;
-        while (alloc <= max_address) {
-            alloc = find_next_free(alloc, max_address, kMemoryBlockSize);
-            if (alloc == 0) break;
+#endif
+    auto memory = static_cast<std::uint8_t*>(try_alloc_near(address, size));
+    return {memory, memory};
+}
 
-            result = mmap(reinterpret_cast<void*>(alloc), kMemoryBlockSize, PROT_EXEC | PROT_READ | PROT_WRITE,
-                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, 0, 0);
-            if (result == reinterpret_cast<void*>(0xFFFFFFFFFFFFFFFF) || reinterpret_cast<std::uintptr_t>(result) != alloc) result = nullptr;
-            break;
-        }
-    }
-    return result;
+inline void free_code_region(const code_region_memory& memory, std::size_t size) {
+    free_near(memory.exec, size);
+#ifndef KTHOOK_64_WIN
+    if (memory.write != memory.exec) munmap(memory.write, size);
 #endif
 }
 } // namespace detail
 } // namespace kthook
 
+#undef KTHOOK_RETURN_ADDRESS_SLOT
+
 #endif  // KTHOOK_DETAIL_HPP_
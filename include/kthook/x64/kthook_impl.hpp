@@ -9,6 +9,8 @@
 #endif
 
 namespace kthook {
+class transaction;
+
 #pragma pack(push, 1)
 struct cpu_ctx {
     struct eflags {
@@ -82,8 +84,109 @@ struct cpu_ctx_empty {
     std::uintptr_t rcx;
 };
 
-inline bool create_trampoline(std::uintptr_t hook_address,
-                              const std::unique_ptr<Xbyak::CodeGenerator>& trampoline_gen, bool naked = false) {
+#ifdef KTHOOK_64_TLS
+// Registers a kCreateContext stub captured on this thread. The stub pushes them onto relay_contexts like the hook
+// onto relay_hooks and the relay copies them into its own context_frame before anything else runs on the thread,
+// so every call, including concurrent, recursive and signal handler ones, keeps its own context on its own stack.
+struct captured_context {
+    // eflags has private bit-fields, so no offsetof
+    static constexpr std::size_t kRegistersOffset = 0;
+    static constexpr std::size_t kFlagsOffset = sizeof(cpu_ctx);
+
+    cpu_ctx registers;
+    cpu_ctx::eflags flags;
+};
+
+static_assert(sizeof(cpu_ctx::eflags) == sizeof(std::uintptr_t), "the stub stores the flags with one 64-bit mov");
+static_assert(sizeof(captured_context) == captured_context::kFlagsOffset + sizeof(cpu_ctx::eflags));
+
+inline thread_local relay_stack<captured_context> relay_contexts __attribute__((tls_model("initial-exec")));
+
+// Pushes the caller's registers and flags onto relay_contexts, leaves every register and the flags as they were
+inline void emit_context_capture(Xbyak::CodeGenerator& gen) {
+    using namespace Xbyak::util;
+    static const std::int32_t top = get_tls_offset(&relay_contexts.top);
+    static const std::int32_t entries = get_tls_offset(&relay_contexts.entries);
+    auto store = [&](std::size_t field, const Xbyak::Reg64& reg) {
+        store_tls_indexed(gen, entries + static_cast<std::int32_t>(field), reg);
+    };
+    gen.pushfq();
+    gen.push(rax);
+    gen.push(r11);
+    emit_relay_stack_push<captured_context>(gen, top);
+    gen.mov(r11, ptr[rsp + sizeof(std::uintptr_t) * 2]);
+    store(captured_context::kFlagsOffset, r11);
+    gen.mov(r11, ptr[rsp + sizeof(std::uintptr_t)]);
+    store(captured_context::kRegistersOffset + offsetof(cpu_ctx, rax), r11);
+    gen.mov(r11, ptr[rsp]);
+    store(captured_context::kRegistersOffset + offsetof(cpu_ctx, r11), r11);
+    gen.lea(r11, ptr[rsp + sizeof(std::uintptr_t) * 3]);
+    store(captured_context::kRegistersOffset + offsetof(cpu_ctx, rsp), r11);
+
+    constexpr std::array<std::pair<std::size_t, Xbyak::Reg64>, 13> context_registers{{
+        {offsetof(cpu_ctx, rbx), rbx}, {offsetof(cpu_ctx, rcx), rcx}, {offsetof(cpu_ctx, rdx), rdx},
+        {offsetof(cpu_ctx, rbp), rbp}, {offsetof(cpu_ctx, rsi), rsi}, {offsetof(cpu_ctx, rdi), rdi},
+        {offsetof(cpu_ctx, r8), r8},   {offsetof(cpu_ctx, r9), r9},   {offsetof(cpu_ctx, r10), r10},
+        {offsetof(cpu_ctx, r12), r12}, {offsetof(cpu_ctx, r13), r13}, {offsetof(cpu_ctx, r14), r14},
+        {offsetof(cpu_ctx, r15), r15},
+    }};
+    for (auto& [field, reg] : context_registers) {
+        store(captured_context::kRegistersOffset + field, reg);
+    }
+    gen.pop(r11);
+    gen.pop(rax);
+    gen.popfq();
+}
+
+// dec qword ptr fs:[relay_contexts.top], drops the capture of a call that doesn't go through the relay
+inline void emit_context_drop(Xbyak::CodeGenerator& gen) {
+    static const std::int32_t top = get_tls_offset(&relay_contexts.top);
+    constexpr std::uint8_t dec_code[] = {0x64, 0x48, 0xFF, 0x0C, 0x25};
+    gen.db(dec_code, sizeof(dec_code));
+    gen.dd(static_cast<std::uint32_t>(top));
+}
+
+struct context_frame : return_frame {
+    context_frame(const void* hook, std::uintptr_t* return_address) : return_frame(hook, return_address) {
+        auto captured = relay_contexts.pop();
+        context = captured.registers;
+        flags = captured.flags;
+        context.flags = &flags;
+    }
+
+    cpu_ctx context;
+    cpu_ctx::eflags flags;
+};
+
+// frame type of the relays of a hook with these options
+template <bool CreateContext, bool NoReentry,
+          typename Frame = std::conditional_t<CreateContext, context_frame, return_frame>>
+using relay_frame_t = std::conditional_t<NoReentry, no_reentry_frame<Frame>, Frame>;
+
+// context of the hooked call of hook the calling thread is in, a zeroed one outside of its callbacks
+inline const cpu_ctx& find_context(const void* hook) {
+    static const cpu_ctx no_context{};
+    auto frame = find_frame(hook);
+    return (frame != nullptr) ? static_cast<const context_frame*>(frame)->context : no_context;
+}
+#endif
+
+// E9 rel32 when the destination is within reach of the stub, FF25 with the address inline otherwise.
+// The measuring pass of generate_near always takes the long form so the final code is never longer.
+inline void emit_jump(stub_generator& gen, std::uintptr_t destination) {
+    using namespace Xbyak::util;
+    auto displacement = static_cast<std::intptr_t>(destination - (gen.get_exec_curr() + sizeof(JMP_REL)));
+    if (!gen.is_measuring() && displacement == static_cast<std::int32_t>(displacement)) {
+        gen.db(0xE9);
+        gen.dd(static_cast<std::uint32_t>(displacement));
+    } else {
+        gen.jmp(ptr[rip]);
+        gen.db(destination, 8);
+    }
+}
+
+inline bool create_trampoline(std::uintptr_t hook_address, stub_generator& trampoline_gen, bool naked = false,
+                              trampoline_ip_map* ip_map = nullptr) {
     CALL_ABS call = {
         0xFF,
         0x15,
@@ -112,6 +215,7 @@ inline bool create_trampoline(std::uintptr_t hook_address,
     std::uintptr_t max_jmp_ref = 0;
     std::uint8_t inst_buf[16];
     bool finished = false;
+    if (ip_map) *ip_map = {};
 
     while (!finished) {
         detail::hde hs;
@@ -119,11 +223,7 @@ inline bool create_trampoline(std::uintptr_t hook_address,
         if (hs.flags & F_ERROR) return false;
         op_copy_src = reinterpret_cast<void*>(current_address);
         if (current_address - hook_address >= sizeof(JMP_REL)) {
-            using namespace Xbyak::util;
-            if (!naked) {
-                trampoline_gen->jmp(ptr[rip]);
-                trampoline_gen->db(current_address, 8);
-            }
+            if (!naked) emit_jump(trampoline_gen, current_address);
             break;
         } else if ((hs.modrm & 0xC7) == 0x05) {
             // Instructions using RIP relative addressing. (ModR/M = 00???101B)
@@ -138,8 +238,7 @@ inline bool create_trampoline(std::uintptr_t hook_address,
             // Relative address is stored at (instruction length - immediate value length - 4).
             pRelAddr = reinterpret_cast<std::uint32_t*>(inst_buf + hs.len - ((hs.flags & 0x3C) >> 2) - 4);
             auto value_pointer = current_address + static_cast<std::int32_t>(hs.disp.disp32);
-            *pRelAddr = static_cast<uint32_t>(value_pointer -
-                                              reinterpret_cast<const std::uintptr_t>(trampoline_gen->getCurr()));
+            *pRelAddr = static_cast<uint32_t>(value_pointer - trampoline_gen.get_exec_curr());
 
             // Complete the function if JMP (FF /4).
             if (hs.opcode == 0xFF && hs.modrm_reg == 4) finished = true;
@@ -205,7 +304,8 @@ inline bool create_trampoline(std::uintptr_t hook_address,
             finished = (current_address >= max_jmp_ref);
         }
 
-        trampoline_gen->db(reinterpret_cast<std::uint8_t*>(op_copy_src), op_copy_size);
+        if (ip_map) ip_map->add(current_address - hook_address, trampoline_gen.getSize());
+        trampoline_gen.db(reinterpret_cast<std::uint8_t*>(op_copy_src), op_copy_size);
 
         trampoline_size += op_copy_size;
         current_address += hs.len;
@@ -213,6 +313,119 @@ inline bool create_trampoline(std::uintptr_t hook_address,
     if (current_address - hook_address < sizeof(JMP_REL)) return false;
     return true;
 }
+
+// Hot state of kthook_simple's and kthook_signal's relay stubs. Lives in an alloc_data slot next to the stub
+// instead of in the hook object and is addressed RIP-relative, so a hooked call touches one extra cache line.
+struct alignas(64) stub_data {
+    std::uintptr_t rax;
+    std::uintptr_t rcx;
+    // caller's return address while a Windows stub that moves it off the stack runs, relays entered with it still
+    // in place record it in a return_frame instead
+    std::uintptr_t* last_return_address;
+    const void* hook;
+};
+
+// allocates a hook's stub_data near the hooked function, so its stubs reach it with a 32-bit displacement
+inline code_block alloc_stub_data(std::uintptr_t hook_address, const void* hook) {
+    auto block = code_allocator::instance().alloc_data(hook_address, sizeof(stub_data));
+    if (block) new (block.code) stub_data{0, 0, nullptr, hook};
+    return block;
+}
+
+// true if target is within reach of a 32-bit displacement from anywhere in the slot the code goes to
+inline bool is_rip_reachable(const stub_generator& gen, const void* target) {
+    if (gen.is_measuring()) return true;
+    constexpr std::intptr_t kMaxSlotSize = std::intptr_t{1}
+                                           << (code_allocator::kMinSlotShift + code_allocator::kSizeClassCount - 1);
+    auto distance = static_cast<std::intptr_t>(reinterpret_cast<std::uintptr_t>(target) - gen.get_exec_curr());
+    return -(INT32_MAX - kMaxSlotSize) < distance && distance < INT32_MAX - kMaxSlotSize;
+}
+
+// [rip + disp32] operand of a 64-bit mov or lea between a register and target (REX.W 89/8B/8D modrm disp32, 7 bytes).
+// The displacement is taken from where the code runs, measuring passes get 0: the length is the same.
+inline Xbyak::Address rip_operand(const stub_generator& gen, const void* target) {
+    using namespace Xbyak::util;
+    constexpr std::size_t kMovRipLength = 7;
+    std::int32_t displacement = 0;
+    if (!gen.is_measuring()) {
+        displacement = static_cast<std::int32_t>(reinterpret_cast<std::uintptr_t>(target) -
+                                                 (gen.get_exec_curr() + kMovRipLength));
+    }
+    return ptr[rip + displacement];
+}
+
+#ifdef KTHOOK_64_TLS
+// Entry of Relay shared by every hook of one type, only the hook's stub_data differs between them and comes in r11:
+// a hook's own stub is just its trampoline copy, a lea and a jump here. Generated once and kept for the process,
+// returns 0 if that fails and hooks fall back to a complete stub of their own.
+template <auto Relay>
+inline std::uintptr_t get_shared_relay_stub() {
+    static const code_block stub = [] {
+        using namespace Xbyak::util;
+        auto relay = reinterpret_cast<std::uintptr_t>(Relay);
+        auto block = generate_near(relay, [relay](stub_generator& gen) {
+            gen.mov(r11, ptr[r11 + offsetof(stub_data, hook)]);
+            push_relay_hook(gen);
+            emit_jump(gen, relay);
+            return true;
+        });
+        if (block) flush_intruction_cache(block.code, block.size);
+        return block;
+    }();
+    return reinterpret_cast<std::uintptr_t>(stub.code);
+}
+#endif
+
+// E8 rel32 when the callee is within reach, an absolute call through rax otherwise. Same measuring rule as emit_jump.
+inline void emit_call(stub_generator& gen, std::uintptr_t destination) {
+    using namespace Xbyak::util;
+    auto displacement = static_cast<std::intptr_t>(destination - (gen.get_exec_curr() + sizeof(CALL_REL)));
+    if (!gen.is_measuring() && displacement == static_cast<std::int32_t>(displacement)) {
+        gen.db(0xE8);
+        gen.dd(static_cast<std::uint32_t>(displacement));
+    } else {
+        gen.mov(rax, destination);
+        gen.call(rax);
+    }
+}
+
+// bool dispatcher(void* args, void* result) of a compiled hook_signal: calls every thunk with its slot object,
+// args and result in order and returns the thunks' results or-ed together
+inline bool generate_signal_dispatcher(stub_generator& gen, const std::vector<dispatch_call>& calls) {
+    using namespace Xbyak::util;
+#ifdef KTHOOK_64_WIN
+    const Xbyak::Reg64 arg0 = rcx, arg1 = rdx, arg2 = r8;
+#else
+    const Xbyak::Reg64 arg0 = rdi, arg1 = rsi, arg2 = rdx;
+#endif
+    // three pushes realign the stack for the calls
+    gen.push(rbx);
+    gen.push(rbp);
+    gen.push(r12);
+#ifdef KTHOOK_64_WIN
+    gen.sub(rsp, 32);
+#endif
+    gen.mov(rbx, arg0);  // args
+    gen.mov(rbp, arg1);  // result
+    gen.xor_(r12, r12);
+    for (auto& call : calls) {
+        gen.mov(arg0, reinterpret_cast<std::uintptr_t>(call.object));
+        gen.mov(arg1, rbx);
+        gen.mov(arg2, rbp);
+        emit_call(gen, call.thunk);
+        gen.movzx(eax, al);
+        gen.or_(r12, rax);
+    }
+    gen.mov(rax, r12);
+#ifdef KTHOOK_64_WIN
+    gen.add(rsp, 32);
+#endif
+    gen.pop(r12);
+    gen.pop(rbp);
+    gen.pop(rbx);
+    gen.ret();
+    return true;
+}
 } // namespace detail
 
 enum class XMM: unsigned {
@@ -317,13 +530,280 @@ public:
 };
 #pragma pack(pop)
 
+namespace detail {
+// What a naked stub saves for one call. The stub builds it on the hooked thread's own stack, so concurrent and
+// recursive calls never share one. The fxsave image goes first for its 16-byte alignment, return_address is where
+// the call continues.
+struct alignas(16) naked_save_area {
+    cpu_ctx_x87 context_x87;
+    cpu_ctx context;
+    std::uintptr_t flags;
+    std::uintptr_t return_address;
+
+    static constexpr std::size_t kContextOffset = sizeof(cpu_ctx_x87);
+    static constexpr std::size_t kFlagsOffset = kContextOffset + sizeof(cpu_ctx);
+    static constexpr std::size_t kReturnAddressOffset = kFlagsOffset + sizeof(std::uintptr_t);
+};
+static_assert(sizeof(cpu_ctx_x87) == 512 && sizeof(cpu_ctx) % sizeof(std::uintptr_t) == 0);
+
+// save area of the call of hook the calling thread is in, an empty per-thread one outside of its callback
+inline naked_save_area& find_naked_save_area(const void* hook) {
+    static thread_local naked_save_area no_call{};
+    auto return_address = find_return_address(hook);
+    if (return_address == nullptr) return no_call;
+    return *reinterpret_cast<naked_save_area*>(reinterpret_cast<unsigned char*>(return_address) -
+                                               naked_save_area::kReturnAddressOffset);
+}
+}  // namespace detail
+
+enum class YMM: unsigned {
+    YMM0,
+    YMM1,
+    YMM2,
+    YMM3,
+    YMM4,
+    YMM5,
+    YMM6,
+    YMM7,
+    YMM8,
+    YMM9,
+    YMM10,
+    YMM11,
+    YMM12,
+    YMM13,
+    YMM14,
+    YMM15
+};
+
+enum class ZMM: unsigned {
+    ZMM0,
+    ZMM1,
+    ZMM2,
+    ZMM3,
+    ZMM4,
+    ZMM5,
+    ZMM6,
+    ZMM7,
+    ZMM8,
+    ZMM9,
+    ZMM10,
+    ZMM11,
+    ZMM12,
+    ZMM13,
+    ZMM14,
+    ZMM15,
+    ZMM16,
+    ZMM17,
+    ZMM18,
+    ZMM19,
+    ZMM20,
+    ZMM21,
+    ZMM22,
+    ZMM23,
+    ZMM24,
+    ZMM25,
+    ZMM26,
+    ZMM27,
+    ZMM28,
+    ZMM29,
+    ZMM30,
+    ZMM31
+};
+
+using ymm_value = std::array<M128, 2>;
+using zmm_value = std::array<M128, 4>;
+
+namespace detail {
+struct cpuid_result {
+    std::uint32_t eax;
+    std::uint32_t ebx;
+    std::uint32_t ecx;
+    std::uint32_t edx;
+};
+
+inline cpuid_result cpuid(std::uint32_t leaf, std::uint32_t subleaf = 0) {
+#ifdef _MSC_VER
+    int registers[4];
+    __cpuidex(registers, static_cast<int>(leaf), static_cast<int>(subleaf));
+    return {static_cast<std::uint32_t>(registers[0]), static_cast<std::uint32_t>(registers[1]),
+            static_cast<std::uint32_t>(registers[2]), static_cast<std::uint32_t>(registers[3])};
+#else
+    cpuid_result result;
+    asm volatile("cpuid"
+                 : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx)
+                 : "a"(leaf), "c"(subleaf));
+    return result;
+#endif
+}
+
+// state components the OS enabled in XCR0, only valid once cpuid reported OSXSAVE
+inline std::uint64_t read_xcr0() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    std::uint32_t low, high;
+    asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return (std::uint64_t{high} << 32) | low;
+#endif
+}
+
+// XSAVE components an ExtendedState naked stub saves next to its fxsave image: AVX (2), opmask (5), ZMM_Hi256 (6)
+// and Hi16_ZMM (7). x87 and SSE stay with fxsave, which keeps them readable whatever state they are in.
+constexpr std::uint64_t kXsaveExtendedComponents = (1 << 2) | (1 << 5) | (1 << 6) | (1 << 7);
+constexpr std::size_t kXsaveHeaderOffset = 512;
+constexpr std::size_t kXsaveHeaderSize = 64;
+
+// What CPUID leaf 0xD says about the XSAVE image of kXsaveExtendedComponents on this machine, read once
+struct xsave_layout {
+    std::uint64_t components = 0; // 0 without XSAVE or without OS support for any of them
+    std::uint32_t size = 0;       // what a stub reserves for the image, a multiple of 64
+    bool compacted = false;       // xsavec, saves only components that aren't in their initial state
+    std::array<std::uint32_t, 8> offsets{};
+    std::array<std::uint32_t, 8> sizes{};
+    std::array<bool, 8> aligned{}; // starts on 64 bytes in the compacted format
+
+    // where component starts in image: standard offsets, or packed after the header in XCOMP_BV order
+    std::size_t offset_of(const unsigned char* image, unsigned component) const {
+        std::uint64_t xcomp_bv;
+        std::memcpy(&xcomp_bv, image + kXsaveHeaderOffset + sizeof(std::uint64_t), sizeof(xcomp_bv));
+        if ((xcomp_bv >> 63) == 0) return offsets[component];
+        std::size_t offset = kXsaveHeaderOffset + kXsaveHeaderSize;
+        for (unsigned i = 2; i <= component; ++i) {
+            if (((xcomp_bv >> i) & 1) == 0) continue;
+            if (aligned[i]) offset = (offset + 63) & ~std::size_t{63};
+            if (i == component) break;
+            offset += sizes[i];
+        }
+        return offset;
+    }
+};
+
+inline const xsave_layout& get_xsave_layout() {
+    static const xsave_layout layout = [] {
+        constexpr std::uint32_t kXsave = 1u << 26;
+        constexpr std::uint32_t kOsxsave = 1u << 27;
+        xsave_layout layout;
+        if (cpuid(0).eax < 0xD || (cpuid(1).ecx & (kXsave | kOsxsave)) != (kXsave | kOsxsave)) return layout;
+        layout.components = read_xcr0() & kXsaveExtendedComponents;
+        if (layout.components == 0) return layout;
+
+        layout.compacted = (cpuid(0xD, 1).eax & 2) != 0;
+        std::size_t standard_end = kXsaveHeaderOffset + kXsaveHeaderSize;
+        std::size_t compacted_end = standard_end;
+        for (unsigned i = 2; i < layout.sizes.size(); ++i) {
+            if (((layout.components >> i) & 1) == 0) continue;
+            auto component = cpuid(0xD, i);
+            layout.sizes[i] = component.eax;
+            layout.offsets[i] = component.ebx;
+            layout.aligned[i] = (component.ecx & 2) != 0;
+            standard_end = (std::max)(standard_end, std::size_t{component.ebx} + component.eax);
+            if (layout.aligned[i]) compacted_end = (compacted_end + 63) & ~std::size_t{63};
+            compacted_end += component.eax;
+        }
+        auto end = layout.compacted ? compacted_end : standard_end;
+        layout.size = static_cast<std::uint32_t>((end + 63) & ~std::size_t{63});
+        return layout;
+    }();
+    return layout;
+}
+}  // namespace detail
+
+// YMM and ZMM registers of a naked call, for basic_kthook_naked with ExtendedState. The low 128 bits are the XMM
+// registers of the fxsave image, the rest comes from the XSAVE image the stub keeps below the save area.
+// Registers the CPU or OS doesn't have read as 0 and ignore writes, has_ymm() and has_zmm() tell.
+class cpu_ctx_extended {
+public:
+    cpu_ctx_extended(cpu_ctx_x87& legacy, unsigned char* image) : legacy(legacy), image(image) {}
+
+    [[nodiscard]] bool has_ymm() const noexcept { return has_component(2); }
+    [[nodiscard]] bool has_zmm() const noexcept { return has_component(6) && has_component(7); }
+
+    template <YMM R>
+    [[nodiscard]] ymm_value reg() const noexcept {
+        constexpr auto index = static_cast<unsigned>(R);
+        return {legacy.reg<static_cast<XMM>(index)>(), part(2, index * sizeof(M128))};
+    }
+
+    template <YMM R>
+    void set_reg(const ymm_value& v) noexcept {
+        constexpr auto index = static_cast<unsigned>(R);
+        legacy.set_reg<static_cast<XMM>(index)>(v[0]);
+        set_part(2, index * sizeof(M128), v[1]);
+    }
+
+    template <ZMM R>
+    [[nodiscard]] zmm_value reg() const noexcept {
+        constexpr auto index = static_cast<unsigned>(R);
+        if constexpr (index < 16) {
+            return {legacy.reg<static_cast<XMM>(index)>(), part(2, index * sizeof(M128)),
+                    part(6, index * sizeof(ymm_value)), part(6, index * sizeof(ymm_value) + sizeof(M128))};
+        } else {
+            constexpr auto offset = (index - 16) * sizeof(zmm_value);
+            return {part(7, offset), part(7, offset + sizeof(M128)), part(7, offset + 2 * sizeof(M128)),
+                    part(7, offset + 3 * sizeof(M128))};
+        }
+    }
+
+    template <ZMM R>
+    void set_reg(const zmm_value& v) noexcept {
+        constexpr auto index = static_cast<unsigned>(R);
+        if constexpr (index < 16) {
+            legacy.set_reg<static_cast<XMM>(index)>(v[0]);
+            set_part(2, index * sizeof(M128), v[1]);
+            set_part(6, index * sizeof(ymm_value), v[2]);
+            set_part(6, index * sizeof(ymm_value) + sizeof(M128), v[3]);
+        } else {
+            constexpr auto offset = (index - 16) * sizeof(zmm_value);
+            for (std::size_t i = 0; i < v.size(); ++i) set_part(7, offset + i * sizeof(M128), v[i]);
+        }
+    }
+
+private:
+    bool has_component(unsigned component) const noexcept {
+        return image != nullptr && ((detail::get_xsave_layout().components >> component) & 1) != 0;
+    }
+
+    std::uint64_t& xstate_bv() const noexcept {
+        return *reinterpret_cast<std::uint64_t*>(image + detail::kXsaveHeaderOffset);
+    }
+
+    // a component in its initial state is all zeros and wasn't written by xsavec
+    M128 part(unsigned component, std::size_t offset) const noexcept {
+        M128 value{};
+        if (!has_component(component) || ((xstate_bv() >> component) & 1) == 0) return value;
+        auto location = image + detail::get_xsave_layout().offset_of(image, component);
+        std::memcpy(&value, location + offset, sizeof(value));
+        return value;
+    }
+
+    // writing a component in its initial state makes it explicit, xrstor then loads it instead of zeroing
+    void set_part(unsigned component, std::size_t offset, const M128& v) noexcept {
+        if (!has_component(component)) return;
+        auto& layout = detail::get_xsave_layout();
+        auto location = image + layout.offset_of(image, component);
+        if (((xstate_bv() >> component) & 1) == 0) {
+            std::memset(location, 0, layout.sizes[component]);
+            xstate_bv() |= std::uint64_t{1} << component;
+        }
+        std::memcpy(location + offset, &v, sizeof(v));
+    }
+
+    cpu_ctx_x87& legacy;
+    unsigned char* image;
+};
+
 enum kthook_option {
     kNone = 0,
     kCreateContext = 1 << 0,
     kFreezeThreads = 1 << 1,
+    kTextPoke = 1 << 2,  // patch with int3 and membarrier like the kernel's text_poke_bp instead of freezing,
+                         // when the jump replaces a single instruction
+    kNoReentry = 1 << 3,  // calls made on a thread already inside a kNoReentry relay skip the callback,
+                          // x64 Linux and FreeBSD only
 };
 
-template <typename FunctionPtr, kthook_option Options = kthook_option::kNone>
+template <typename FunctionPtr, kthook_option Options = kthook_option::kNone,
+          std::size_t CallbackCapacity = detail::kCallbackCapacity, typename CallbackT = void>
 class kthook_simple {
     static_assert(std::is_member_function_pointer_v<FunctionPtr> ||
                   std::is_function_v<std::remove_pointer_t<FunctionPtr>> || std::is_function_v<FunctionPtr>,
@@ -334,11 +814,20 @@ class kthook_simple {
     using Ret = typename function::return_type;
     using function_ptr = typename detail::traits::function_connect_ptr_t<Ret, Args>;
     using converted_args = typename detail::traits::add_refs_t<detail::traits::convert_refs_t<Args>>;
-    using cb_type = std::function<
-        detail::traits::function_connect_t<Ret, detail::traits::tuple_cat_t<const kthook_simple&, converted_args>>>;
+    using cb_type = std::conditional_t<
+        std::is_void_v<CallbackT>,
+        detail::inplace_function<detail::traits::function_connect_t<
+                                     Ret, detail::traits::tuple_cat_t<const kthook_simple&, converted_args>>,
+                                 CallbackCapacity>,
+        CallbackT>;
 
     static constexpr auto create_context = Options & kthook_option::kCreateContext;
     static constexpr auto freeze_threads = Options & kthook_option::kFreezeThreads;
+    static constexpr auto text_poke = Options & kthook_option::kTextPoke;
+    static constexpr auto no_reentry = Options & kthook_option::kNoReentry;
+#ifndef KTHOOK_64_TLS
+    static_assert(!no_reentry, "kNoReentry needs the fs-relative TLS of x64 Linux and FreeBSD");
+#endif
 
     struct hook_info {
         std::uintptr_t hook_address;
@@ -389,19 +878,28 @@ public:
         : kthook_simple(reinterpret_cast<void*>(destination), callback_, force_enable) {
     }
 
-    ~kthook_simple() { remove(); }
+    ~kthook_simple() {
+        if (!detail::release_hook_code(info.hook_address, info.original_code.get(), hook_size, jump_stub,
+                                       trampoline_stub, freeze_threads, &data_block))
+            remove();
+    }
 
     bool install() {
-        if (installed) return false;
-        if (info.hook_address == 0) return false;
-        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
-        if (!create_generators()) return false;
-        if (!detail::create_trampoline(info.hook_address, trampoline_gen)) return false;
-        if (!detail::flush_intruction_cache(trampoline_gen->getCode(), trampoline_gen->getSize())) return false;
-        if (!patch_hook(true)) return false;
-        if (!detail::flush_intruction_cache(reinterpret_cast<void*>(info.hook_address), hook_size)) return false;
-        installed = true;
-        return true;
+        if (!prepare_install()) return false;
+        // only the first patch writes to the hooked function, later ones only touch the relay stub
+        bool first_patch = !info.original_code;
+        bool freeze =
+            first_patch && (text_poke ? !detail::can_text_poke(info.hook_address, hook_size) : freeze_threads);
+        detail::frozen_threads threads;
+        if (freeze && !detail::freeze_threads(threads)) return false;
+        bool applied = apply_install();
+        if (!applied && text_poke && first_patch && !freeze) {
+            // text_poke wrote nothing, the patch goes in under a freeze instead
+            freeze = detail::freeze_threads(threads);
+            if (freeze) applied = apply_install();
+        }
+        if (freeze) detail::unfreeze_threads(threads);
+        return applied;
     }
 
     bool remove() {
@@ -422,14 +920,18 @@ public:
         return true;
     }
 
-    void set_cb(cb_type callback_) { callback = std::move(callback_); }
+    // while there is no callback the relay stub starts with NOPs and runs straight into its trampoline copy,
+    // so an idle hook costs one jump
+    void set_cb(cb_type callback_) {
+        bool enable = static_cast<bool>(callback_);
+        if (!enable) set_relay_enabled(false);
+        callback = std::move(callback_);
+        if (enable) set_relay_enabled(true);
+    }
 
     template <typename C, typename S = decltype(&C::template operator()<const kthook_simple&>)>
     void set_cb_wrapped(C cb) {
-        callback = [cb = std::forward<C>(cb)](auto&&... args) {
-            std::apply(cb, detail::bind_values<detail::traits::args<S>>(
-                           std::forward_as_tuple(std::forward<decltype(args)>(args)...)));
-        };
+        set_cb(detail::wrapped_callback<C, detail::traits::args<S>>{std::move(cb)});
     }
 
     void set_dest(std::uintptr_t address) { info = {address, nullptr}; }
@@ -438,22 +940,36 @@ public:
 
     void set_dest(function_ptr address) { set_dest(reinterpret_cast<std::uintptr_t>(address)); }
 
+    // return address of the hooked call the calling thread is in, 0 outside of the callback
     std::uintptr_t get_return_address() const {
-        return (using_ptr_to_return_address)
-                   ? *last_return_address
-                   : reinterpret_cast<std::uintptr_t>(last_return_address);
+        auto return_address = get_return_address_ptr();
+        return (return_address != nullptr) ? *return_address : 0;
     }
 
     std::uintptr_t* get_return_address_ptr() const {
         return (using_ptr_to_return_address)
-                   ? last_return_address
-                   : reinterpret_cast<std::uintptr_t*>(&last_return_address);
+                   ? detail::find_return_address(this)
+                   : reinterpret_cast<std::uintptr_t*>(&get_stub_data().last_return_address);
     }
 
-    const cpu_ctx& get_context() const { return context; }
+    // frame the relay keeps on its stack for the duration of a hooked call
+#ifdef KTHOOK_64_TLS
+    using relay_frame = detail::relay_frame_t<create_context != 0, no_reentry != 0>;
+#else
+    using relay_frame = detail::return_frame;
+#endif
+
+    const cpu_ctx& get_context() const {
+        static_assert(create_context, "get_context needs kthook_option::kCreateContext");
+#ifdef KTHOOK_64_TLS
+        return detail::find_context(this);
+#else
+        return context;
+#endif
+    }
 
     function_ptr get_trampoline() const {
-        return reinterpret_cast<function_ptr>(const_cast<std::uint8_t*>(trampoline_gen->getCode()));
+        return reinterpret_cast<function_ptr>(trampoline_stub.code);
     }
 
     template <typename... Ts>
@@ -464,71 +980,133 @@ public:
     cb_type& get_callback() { return callback; }
 
 private:
-    bool create_generators() {
-        void* alloc = detail::try_alloc_near(info.hook_address);
-        if (alloc == nullptr) return false;
-        void* jump_alloc = alloc;
-        auto trampoline_alloc = reinterpret_cast<void*>(reinterpret_cast<std::uintptr_t>(jump_alloc) + 0x800);
-        jump_gen = std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, jump_alloc,
-                                                          &detail::default_jmp_allocator);
-        trampoline_gen = std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, trampoline_alloc,
-                                                                &detail::default_trampoline_allocator);
+    friend class transaction;
+
+    // stubs are generated here, outside of a thread freeze
+    bool prepare_install() {
+        if (installed) return false;
+        if (info.hook_address == 0) return false;
+        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
+        if (!trampoline_stub) {
+            trampoline_stub = detail::generate_near(info.hook_address, [this](detail::stub_generator& gen) {
+                return detail::create_trampoline(info.hook_address, gen, false, &ip_map);
+            });
+            if (!trampoline_stub) return false;
+        }
+        if (!detail::flush_intruction_cache(trampoline_stub.code, trampoline_stub.size)) return false;
+        return prepare_patch();
+    }
+
+    bool apply_install() {
+        if (!patch_hook(true)) return false;
+        if (!detail::flush_intruction_cache(reinterpret_cast<void*>(info.hook_address), hook_size)) return false;
+        installed = true;
         return true;
     }
 
-    const std::uint8_t* generate_relay_jump() {
+
+    detail::stub_data& get_stub_data() const { return *reinterpret_cast<detail::stub_data*>(data_block.code); }
+
+#ifdef KTHOOK_64_TLS
+    static std::uintptr_t get_shared_relay_stub() {
+        // rdi, rsi, rdx, rcx, r8, r9
+        constexpr detail::traits::relay_args_info args_info =
+            detail::traits::get_head_and_tail_size<6, Ret, Args>::value;
+        using head = detail::traits::get_first_n_types_t<args_info.head_size, Args>;
+        using tail = detail::traits::get_last_n_types_t<args_info.tail_size, Args, function::args_count>;
+        using relay = detail::common_relay_generator<kthook_simple, Ret, head, tail, Args>;
+        return detail::get_shared_relay_stub<&relay::relay>();
+    }
+#endif
+
+    bool generate_relay_jump(detail::stub_generator& gen) {
         using namespace Xbyak::util;
 
+        auto& data = get_stub_data();
+        if (!detail::is_rip_reachable(gen, &data)) return false;
+
         auto hook_address = info.hook_address;
 
-        Xbyak::Label UserCode, ret_addr;
-        jump_gen->jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
-        jump_gen->nop(3);
-        detail::create_trampoline(hook_address, jump_gen);
-        jump_gen->L(UserCode);
+        Xbyak::Label UserCode, Trampoline, DropContext;
+        gen.jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        gen.nop(3);
+        gen.L(Trampoline);
+        if (!detail::create_trampoline(hook_address, gen)) return false;
+#ifdef KTHOOK_64_TLS
+        if constexpr (create_context && no_reentry) {
+            gen.L(DropContext);
+            detail::emit_context_drop(gen);
+            gen.jmp(Trampoline, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        }
+#endif
+        gen.L(UserCode);
+
+#if defined(KTHOOK_64_TLS)
+        // a call made under a kNoReentry relay on this thread runs the original code right away, with
+        // kCreateContext only once the caller's flags are captured
+        if constexpr (no_reentry && !create_context) detail::emit_reentry_guard(gen, Trampoline);
+#endif
+
+#if defined(KTHOOK_64_TLS)
+        if constexpr (!create_context) {
+            if (auto shared_stub = get_shared_relay_stub()) {
+                using_ptr_to_return_address = true;
+                gen.lea(r11, detail::rip_operand(gen, &data));
+                detail::emit_jump(gen, shared_stub);
+                return true;
+            }
+        }
+#endif
 
         if constexpr (create_context) {
-            jump_gen->pushfq();
-
-            jump_gen->push(rax);
-            jump_gen->push(rbx);
-            jump_gen->mov(rax, ptr[rsp + sizeof(std::uintptr_t)]);
-            jump_gen->xchg(rbx, rax);
-            jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(&context.flags));
-            jump_gen->mov(ptr[rax], rbx);
-            jump_gen->pop(rbx);
-            jump_gen->pop(rax);
-            jump_gen->add(rsp, sizeof(cpu_ctx::eflags));
-
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
-            jump_gen->mov(rax, rsp);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)], rax);
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-
-            jump_gen->mov(rsp, reinterpret_cast<std::uintptr_t>(&context.flags));
-            jump_gen->push(r15);
-            jump_gen->push(r14);
-            jump_gen->push(r13);
-            jump_gen->push(r12);
-            jump_gen->push(r11);
-            jump_gen->push(r10);
-            jump_gen->push(r9);
-            jump_gen->push(r8);
-            jump_gen->push(rdi);
-            jump_gen->push(rsi);
-            jump_gen->push(rbp);
-            jump_gen->sub(rsp, sizeof(std::uintptr_t));
-            jump_gen->push(rdx);
-            jump_gen->push(rcx);
-            jump_gen->push(rbx);
-
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)]);
-            jump_gen->mov(rsp, rax);
+#ifdef KTHOOK_64_TLS
+            detail::emit_context_capture(gen);
+            // a bypassed call takes its capture back off the stack on the way to the original code
+            if constexpr (no_reentry) detail::emit_reentry_guard(gen, DropContext);
+#else
+            gen.pushfq();
+
+            gen.push(rax);
+            gen.push(rbx);
+            gen.mov(rax, ptr[rsp + sizeof(std::uintptr_t)]);
+            gen.xchg(rbx, rax);
+            gen.mov(rax, reinterpret_cast<std::uintptr_t>(&context.flags));
+            gen.mov(ptr[rax], rbx);
+            gen.pop(rbx);
+            gen.pop(rax);
+            gen.add(rsp, sizeof(cpu_ctx::eflags));
+
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
+            gen.mov(detail::rip_operand(gen, &data.rax), rax);
+            gen.mov(rax, rsp);
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)], rax);
+            gen.mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
+
+            gen.mov(rsp, reinterpret_cast<std::uintptr_t>(&context.flags));
+            gen.push(r15);
+            gen.push(r14);
+            gen.push(r13);
+            gen.push(r12);
+            gen.push(r11);
+            gen.push(r10);
+            gen.push(r9);
+            gen.push(r8);
+            gen.push(rdi);
+            gen.push(rsi);
+            gen.push(rbp);
+            gen.sub(rsp, sizeof(std::uintptr_t));
+            gen.push(rdx);
+            gen.push(rcx);
+            gen.push(rbx);
+
+            gen.mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)]);
+            gen.mov(rsp, rax);
+#endif
         } else {
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
+#ifndef KTHOOK_64_TLS
+            gen.mov(detail::rip_operand(gen, &data.rax), rax);
+#endif
         }
-        jump_gen->mov(rax, rsp);
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
 
 #if defined(KTHOOK_64_WIN)
         constexpr std::array registers{rcx, rdx, r8, r9};
@@ -540,86 +1118,105 @@ private:
         using head = detail::traits::get_first_n_types_t<args_info.head_size, Args>;
         using tail = detail::traits::get_last_n_types_t<args_info.tail_size, Args, function::args_count>;
 
+#ifdef KTHOOK_64_TLS
+        // the relay has the hooked function's own signature and pops the hook from relay_hooks, the arguments and
+        // the caller's return address stay where they are and the relay returns straight to the caller. rax is
+        // kept, al still holds the vector register count of a variadic call.
+        auto relay_ptr =
+            reinterpret_cast<void*>(&detail::common_relay_generator<kthook_simple, Ret, head, tail, Args>::relay);
+        using_ptr_to_return_address = true;
+        gen.mov(r11, detail::rip_operand(gen, &data.hook));
+        detail::push_relay_hook(gen);
+        detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
+#else
         if constexpr (args_info.register_idx_if_full == -1) {
+            Xbyak::Label ret_addr;
             auto relay_ptr =
                 reinterpret_cast<void*>(&detail::common_relay_generator<kthook_simple, Ret, head, tail, Args>::relay);
             using_ptr_to_return_address = false;
 
             // save context
-            jump_gen->mov(rax, rcx);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rcx)], rax);
+            gen.mov(detail::rip_operand(gen, &data.rcx), rcx);
 
             // pop out return address
-            jump_gen->pop(rcx);
+            gen.pop(rcx);
 
+            gen.mov(rax, detail::rip_operand(gen, &data.hook));
 #ifdef KTHOOK_64_WIN
-            jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(this));
             // set rsp to next stack argument pointer
-            jump_gen->add(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
-            jump_gen->push(0);
-            jump_gen->push(rax);
-#else
-            jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(this));
-            // push our hook to the stack
-            jump_gen->push(std::uintptr_t(0));
-            jump_gen->push(std::uintptr_t(0));
-            jump_gen->push(std::uintptr_t(0));
-            jump_gen->push(rax);
-#endif
-
-#ifdef KTHOOK_64_WIN
+            gen.add(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
+            gen.push(0);
+            gen.push(rax);
             // return the rsp to its initial state
-            jump_gen->sub(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
+            gen.sub(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
 #else
-
+            // SystemVAbiTrick right below the stack arguments
+            gen.push(0);
+            gen.push(0);
+            gen.push(0);
+            gen.push(rax);
 #endif
             // save return address
-            jump_gen->mov(rax, rcx);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
+            gen.mov(detail::rip_operand(gen, &data.last_return_address), rcx);
             // push our return address
-            jump_gen->mov(rax, ret_addr);
-            jump_gen->push(rax);
+            gen.lea(rax, ptr[rip + ret_addr]);
+            gen.push(rax);
 
             // restore context
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rcx)]);
-            jump_gen->mov(rcx, rax);
+            gen.mov(rcx, detail::rip_operand(gen, &data.rcx));
 
-            jump_gen->jmp(ptr[rip]);
-            jump_gen->db(reinterpret_cast<std::uintptr_t>(relay_ptr), 8);
-            jump_gen->L(ret_addr);
+            detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
+            gen.L(ret_addr);
 #ifdef KTHOOK_64_WIN
-            jump_gen->add(rsp, sizeof(void*) * 2);
+            gen.add(rsp, sizeof(void*) * 2);
 #else
-            jump_gen->add(rsp, 32);
+            gen.add(rsp, sizeof(void*) * 4);
 #endif
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
-            // push original return address and return
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
-            jump_gen->push(rax);
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-            jump_gen->ret();
+            // push original return address and return, rcx is free after the call
+            gen.mov(rcx, detail::rip_operand(gen, &data.last_return_address));
+            gen.push(rcx);
+            gen.ret();
 
         } else {
             using_ptr_to_return_address = true;
-            jump_gen->mov(rax, rsp);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-            jump_gen->mov(registers[args_info.register_idx_if_full], reinterpret_cast<std::uintptr_t>(this));
-            jump_gen->jmp(ptr[rip]);
+            gen.mov(rax, detail::rip_operand(gen, &data.rax));
+            gen.mov(registers[args_info.register_idx_if_full], detail::rip_operand(gen, &data.hook));
             if constexpr (args_info.register_idx_if_full == 2) {
                 auto relay_ptr =
                     reinterpret_cast<void*>(&detail::common_relay_generator_three_args<
                         kthook_simple, Ret, head, tail, Args>::relay);
-                jump_gen->db(reinterpret_cast<std::uintptr_t>(relay_ptr), 8);
+                detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
             } else {
                 auto relay_ptr =
                     reinterpret_cast<void*>(&detail::common_relay_generator<
                         kthook_simple, Ret, head, tail, Args>::relay);
-                jump_gen->db(reinterpret_cast<std::uintptr_t>(relay_ptr), 8);
+                detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
             }
         }
-        detail::flush_intruction_cache(jump_gen->getCode(), jump_gen->getSize());
-        return jump_gen->getCode();
+#endif
+        return true;
+    }
+
+    // generates the relay stub, the hooked function is left untouched
+    bool prepare_patch() {
+        if (jump_stub) return true;
+        if (!data_block) {
+            data_block = detail::alloc_stub_data(info.hook_address, this);
+            if (!data_block) return false;
+        }
+        this->hook_size = detail::detect_hook_size(info.hook_address);
+        jump_stub = detail::generate_near(
+            info.hook_address, [this](detail::stub_generator& gen) { return generate_relay_jump(gen); });
+        if (!jump_stub) return false;
+        std::memcpy(&original, jump_stub.code, sizeof(original));
+        detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
+        return true;
+    }
+
+    void set_relay_enabled(bool enable) {
+        if (!installed) return;
+        detail::write_stub_head(jump_stub, enable ? original : detail::kStubFallthrough);
+        detail::flush_intruction_cache(jump_stub.code, sizeof(original));
     }
 
     bool patch_hook(bool enable) {
@@ -630,59 +1227,56 @@ private:
                 std::uint32_t operand;
             } patch;
 #pragma pack(pop)
-            if (!this->relay_jump) {
-                this->hook_size = detail::detect_hook_size(info.hook_address);
-                this->relay_jump = generate_relay_jump();
-                detail::frozen_threads threads;
-
-                if constexpr (freeze_threads)
-                    if (!detail::freeze_threads(threads))
-                        return false;
-                if (!set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                     detail::MemoryProt::PROTECT_RWE))
-                    return false;
+            if (!info.original_code) {
                 info.original_code = std::make_unique<unsigned char[]>(this->hook_size);
                 std::memcpy(info.original_code.get(), reinterpret_cast<void*>(info.hook_address), this->hook_size);
                 std::uintptr_t relative =
-                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(this->relay_jump), info.hook_address);
-                std::memcpy(&patch, reinterpret_cast<void*>(info.hook_address), sizeof(patch));
+                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(jump_stub.code), info.hook_address);
+                std::memcpy(&patch, info.original_code.get(), sizeof(patch));
                 if (patch.opcode != 0xE8) {
                     patch.opcode = 0xE9;
                 }
                 patch.operand = static_cast<std::uint32_t>(relative);
-                std::memcpy(reinterpret_cast<void*>(info.hook_address), &patch, sizeof(patch));
-                memset(reinterpret_cast<void*>(info.hook_address + sizeof(patch)), 0x90,
-                       this->hook_size - sizeof(patch));
-                if (!detail::set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                             detail::MemoryProt::PROTECT_RE))
+                std::array<std::uint8_t, detail::kMaxHookSize> code;
+                std::memcpy(code.data(), &patch, sizeof(patch));
+                std::memset(code.data() + sizeof(patch), 0x90, this->hook_size - sizeof(patch));
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
+                detail::relocate_frozen_threads(info.hook_address, this->hook_size, trampoline_stub.code, ip_map);
+                if (!detail::patch_code(info.hook_address, code.data(), this->hook_size, text_poke,
+                                        trampoline_stub.code)) {
+                    info.original_code.reset();
                     return false;
-                if constexpr (freeze_threads)
-                    if (!detail::unfreeze_threads(threads))
-                        return false;
+                }
             } else {
-                jump_gen->rewrite(0, original, 8);
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
             }
-        } else if (relay_jump) {
-            std::memcpy(reinterpret_cast<void*>(&original), relay_jump, sizeof(original));
-            jump_gen->rewrite(0, 0x9090909090909090, 8);
+        } else if (jump_stub) {
+            detail::write_stub_head(jump_stub, detail::kStubFallthrough);
         }
-        if (jump_gen.get()) detail::flush_intruction_cache(relay_jump, jump_gen->getSize());
+        if (jump_stub) detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
         return true;
     }
 
     hook_info info;
     cb_type callback;
-    mutable std::uintptr_t* last_return_address = nullptr;
     std::size_t hook_size = 0;
-    std::unique_ptr<Xbyak::CodeGenerator> jump_gen;
-    std::unique_ptr<Xbyak::CodeGenerator> trampoline_gen;
+    detail::code_block jump_stub;
+    detail::code_block data_block;
+    detail::code_block trampoline_stub;
+    detail::trampoline_ip_map ip_map;
     std::uint64_t original = 0;
-    const std::uint8_t* relay_jump = nullptr;
+#ifndef KTHOOK_64_TLS
     std::conditional_t<create_context, cpu_ctx, detail::cpu_ctx_empty> context;
+#endif
     bool using_ptr_to_return_address = true;
     bool installed = false;
 };
 
+// Callback is a function pointer or a pointer to a constexpr stateless lambda, taking (const hook&, args&...).
+// The relay calls it without going through std::function, so the compiler can inline it.
+template <typename FunctionPtr, auto Callback, kthook_option Options = kthook_option::kNone>
+using kthook_static = kthook_simple<FunctionPtr, Options, 0, detail::static_callback<Callback>>;
+
 template <typename FunctionPtrT, kthook_option Options = kthook_option::kNone>
 class kthook_signal {
     using function = detail::traits::function_traits<FunctionPtrT>;
@@ -694,6 +1288,11 @@ class kthook_signal {
 
     static constexpr auto create_context = Options & kthook_option::kCreateContext;
     static constexpr auto freeze_threads = Options & kthook_option::kFreezeThreads;
+    static constexpr auto text_poke = Options & kthook_option::kTextPoke;
+    static constexpr auto no_reentry = Options & kthook_option::kNoReentry;
+#ifndef KTHOOK_64_TLS
+    static_assert(!no_reentry, "kNoReentry needs the fs-relative TLS of x64 Linux and FreeBSD");
+#endif
 
     struct hook_info {
         std::uintptr_t hook_address;
@@ -730,19 +1329,28 @@ public:
         : kthook_signal(reinterpret_cast<void*>(destination), force_enable) {
     }
 
-    ~kthook_signal() { remove(); }
+    ~kthook_signal() {
+        if (!detail::release_hook_code(info.hook_address, info.original_code.get(), hook_size, jump_stub,
+                                       trampoline_stub, freeze_threads, &data_block))
+            remove();
+    }
 
     bool install() {
-        if (installed) return false;
-        if (info.hook_address == 0) return false;
-        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
-        if (!create_generators()) return false;
-        if (!detail::create_trampoline(info.hook_address, trampoline_gen)) return false;
-        if (!detail::flush_intruction_cache(trampoline_gen->getCode(), trampoline_gen->getSize())) return false;
-        if (!patch_hook(true)) return false;
-        if (!detail::flush_intruction_cache(reinterpret_cast<void*>(info.hook_address), hook_size)) return false;
-        installed = true;
-        return true;
+        if (!prepare_install()) return false;
+        // only the first patch writes to the hooked function, later ones only touch the relay stub
+        bool first_patch = !info.original_code;
+        bool freeze =
+            first_patch && (text_poke ? !detail::can_text_poke(info.hook_address, hook_size) : freeze_threads);
+        detail::frozen_threads threads;
+        if (freeze && !detail::freeze_threads(threads)) return false;
+        bool applied = apply_install();
+        if (!applied && text_poke && first_patch && !freeze) {
+            // text_poke wrote nothing, the patch goes in under a freeze instead
+            freeze = detail::freeze_threads(threads);
+            if (freeze) applied = apply_install();
+        }
+        if (freeze) detail::unfreeze_threads(threads);
+        return applied;
     }
 
     bool remove() {
@@ -769,93 +1377,175 @@ public:
 
     void set_dest(function_ptr address) { set_dest(reinterpret_cast<std::uintptr_t>(address)); }
 
+    // return address of the hooked call the calling thread is in, 0 outside of the callback
     std::uintptr_t get_return_address() const {
-        return (using_ptr_to_return_address)
-                   ? *last_return_address
-                   : reinterpret_cast<std::uintptr_t>(last_return_address);
+        auto return_address = get_return_address_ptr();
+        return (return_address != nullptr) ? *return_address : 0;
     }
 
     std::uintptr_t* get_return_address_ptr() const {
         return (using_ptr_to_return_address)
-                   ? last_return_address
-                   : reinterpret_cast<std::uintptr_t*>(&last_return_address);
+                   ? detail::find_return_address(this)
+                   : reinterpret_cast<std::uintptr_t*>(&get_stub_data().last_return_address);
     }
 
-    const cpu_ctx& get_context() const { return context; }
+    // frame the relay keeps on its stack for the duration of a hooked call
+#ifdef KTHOOK_64_TLS
+    using relay_frame = detail::relay_frame_t<create_context != 0, no_reentry != 0>;
+#else
+    using relay_frame = detail::return_frame;
+#endif
+
+    const cpu_ctx& get_context() const {
+        static_assert(create_context, "get_context needs kthook_option::kCreateContext");
+#ifdef KTHOOK_64_TLS
+        return detail::find_context(this);
+#else
+        return context;
+#endif
+    }
 
     function_ptr get_trampoline() const {
-        return reinterpret_cast<function_ptr>(const_cast<std::uint8_t*>(trampoline_gen->getCode()));
+        return reinterpret_cast<function_ptr>(trampoline_stub.code);
+    }
+
+    // calls the slots of both signals through generated dispatchers, see hook_signal::compile
+    void compile() {
+        before.compile();
+        after.compile();
     }
 
-    before_t before;
-    after_t after;
+    before_t before{&subscribers_changed, this};
+    after_t after{&subscribers_changed, this};
 
 private:
-    bool create_generators() {
-        void* alloc = detail::try_alloc_near(info.hook_address);
-        if (alloc == nullptr) return false;
-        void* jump_alloc = alloc;
-        auto trampoline_alloc = reinterpret_cast<void*>(reinterpret_cast<std::uintptr_t>(jump_alloc) + 0x800);
-        jump_gen = std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, jump_alloc,
-                                                          &detail::default_jmp_allocator);
-        trampoline_gen = std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, trampoline_alloc,
-                                                                &detail::default_trampoline_allocator);
+    friend class transaction;
+
+    // stubs are generated here, outside of a thread freeze
+    bool prepare_install() {
+        if (installed) return false;
+        if (info.hook_address == 0) return false;
+        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
+        if (!trampoline_stub) {
+            trampoline_stub = detail::generate_near(info.hook_address, [this](detail::stub_generator& gen) {
+                return detail::create_trampoline(info.hook_address, gen, false, &ip_map);
+            });
+            if (!trampoline_stub) return false;
+        }
+        if (!detail::flush_intruction_cache(trampoline_stub.code, trampoline_stub.size)) return false;
+        return prepare_patch();
+    }
+
+    bool apply_install() {
+        if (!patch_hook(true)) return false;
+        if (!detail::flush_intruction_cache(reinterpret_cast<void*>(info.hook_address), hook_size)) return false;
+        installed = true;
         return true;
     }
 
-    const std::uint8_t* generate_relay_jump() {
+
+    detail::stub_data& get_stub_data() const { return *reinterpret_cast<detail::stub_data*>(data_block.code); }
+
+#ifdef KTHOOK_64_TLS
+    static std::uintptr_t get_shared_relay_stub() {
+        // rdi, rsi, rdx, rcx, r8, r9
+        constexpr detail::traits::relay_args_info args_info =
+            detail::traits::get_head_and_tail_size<6, Ret, Args>::value;
+        using head = detail::traits::get_first_n_types_t<args_info.head_size, Args>;
+        using tail = detail::traits::get_last_n_types_t<args_info.tail_size, Args, function::args_count>;
+        using relay = detail::signal_relay_generator<kthook_signal, Ret, head, tail, Args>;
+        return detail::get_shared_relay_stub<&relay::relay>();
+    }
+#endif
+
+    bool generate_relay_jump(detail::stub_generator& gen) {
         using namespace Xbyak::util;
 
+        auto& data = get_stub_data();
+        if (!detail::is_rip_reachable(gen, &data)) return false;
+
         auto hook_address = info.hook_address;
 
-        Xbyak::Label UserCode, ret_addr;
-        jump_gen->jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
-        jump_gen->nop(3);
-        detail::create_trampoline(hook_address, jump_gen);
-        jump_gen->L(UserCode);
+        Xbyak::Label UserCode, Trampoline, DropContext;
+        gen.jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        gen.nop(3);
+        gen.L(Trampoline);
+        if (!detail::create_trampoline(hook_address, gen)) return false;
+#ifdef KTHOOK_64_TLS
+        if constexpr (create_context && no_reentry) {
+            gen.L(DropContext);
+            detail::emit_context_drop(gen);
+            gen.jmp(Trampoline, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        }
+#endif
+        gen.L(UserCode);
+
+#if defined(KTHOOK_64_TLS)
+        // a call made under a kNoReentry relay on this thread runs the original code right away, with
+        // kCreateContext only once the caller's flags are captured
+        if constexpr (no_reentry && !create_context) detail::emit_reentry_guard(gen, Trampoline);
+#endif
+
+#if defined(KTHOOK_64_TLS)
+        if constexpr (!create_context) {
+            if (auto shared_stub = get_shared_relay_stub()) {
+                using_ptr_to_return_address = true;
+                gen.lea(r11, detail::rip_operand(gen, &data));
+                detail::emit_jump(gen, shared_stub);
+                return true;
+            }
+        }
+#endif
 
         if constexpr (create_context) {
-            jump_gen->pushfq();
-
-            jump_gen->push(rax);
-            jump_gen->push(rbx);
-            jump_gen->mov(rax, ptr[rsp + sizeof(std::uintptr_t)]);
-            jump_gen->xchg(rbx, rax);
-            jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(&context.flags));
-            jump_gen->mov(ptr[rax], rbx);
-            jump_gen->pop(rbx);
-            jump_gen->pop(rax);
-            jump_gen->add(rsp, sizeof(cpu_ctx::eflags));
-
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
-            jump_gen->mov(rax, rsp);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)], rax);
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-
-            jump_gen->mov(rsp, reinterpret_cast<std::uintptr_t>(&context.flags));
-            jump_gen->push(r15);
-            jump_gen->push(r14);
-            jump_gen->push(r13);
-            jump_gen->push(r12);
-            jump_gen->push(r11);
-            jump_gen->push(r10);
-            jump_gen->push(r9);
-            jump_gen->push(r8);
-            jump_gen->push(rdi);
-            jump_gen->push(rsi);
-            jump_gen->push(rbp);
-            jump_gen->sub(rsp, sizeof(std::uintptr_t));
-            jump_gen->push(rdx);
-            jump_gen->push(rcx);
-            jump_gen->push(rbx);
-
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)]);
-            jump_gen->mov(rsp, rax);
+#ifdef KTHOOK_64_TLS
+            detail::emit_context_capture(gen);
+            // a bypassed call takes its capture back off the stack on the way to the original code
+            if constexpr (no_reentry) detail::emit_reentry_guard(gen, DropContext);
+#else
+            gen.pushfq();
+
+            gen.push(rax);
+            gen.push(rbx);
+            gen.mov(rax, ptr[rsp + sizeof(std::uintptr_t)]);
+            gen.xchg(rbx, rax);
+            gen.mov(rax, reinterpret_cast<std::uintptr_t>(&context.flags));
+            gen.mov(ptr[rax], rbx);
+            gen.pop(rbx);
+            gen.pop(rax);
+            gen.add(rsp, sizeof(cpu_ctx::eflags));
+
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
+            gen.mov(detail::rip_operand(gen, &data.rax), rax);
+            gen.mov(rax, rsp);
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)], rax);
+            gen.mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
+
+            gen.mov(rsp, reinterpret_cast<std::uintptr_t>(&context.flags));
+            gen.push(r15);
+            gen.push(r14);
+            gen.push(r13);
+            gen.push(r12);
+            gen.push(r11);
+            gen.push(r10);
+            gen.push(r9);
+            gen.push(r8);
+            gen.push(rdi);
+            gen.push(rsi);
+            gen.push(rbp);
+            gen.sub(rsp, sizeof(std::uintptr_t));
+            gen.push(rdx);
+            gen.push(rcx);
+            gen.push(rbx);
+
+            gen.mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)]);
+            gen.mov(rsp, rax);
+#endif
         } else {
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
+#ifndef KTHOOK_64_TLS
+            gen.mov(detail::rip_operand(gen, &data.rax), rax);
+#endif
         }
-        jump_gen->mov(rax, rsp);
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
 
 #if defined(KTHOOK_64_WIN)
         constexpr std::array registers{rcx, rdx, r8, r9};
@@ -867,87 +1557,112 @@ private:
         using head = detail::traits::get_first_n_types_t<args_info.head_size, Args>;
         using tail = detail::traits::get_last_n_types_t<args_info.tail_size, Args, function::args_count>;
 
+#ifdef KTHOOK_64_TLS
+        // the relay has the hooked function's own signature and pops the hook from relay_hooks, the arguments and
+        // the caller's return address stay where they are and the relay returns straight to the caller. rax is
+        // kept, al still holds the vector register count of a variadic call.
+        auto relay_ptr =
+            reinterpret_cast<void*>(&detail::signal_relay_generator<kthook_signal, Ret, head, tail, Args>::relay);
+        using_ptr_to_return_address = true;
+        gen.mov(r11, detail::rip_operand(gen, &data.hook));
+        detail::push_relay_hook(gen);
+        detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
+#else
         if constexpr (args_info.register_idx_if_full == -1) {
-
+            Xbyak::Label ret_addr;
             auto relay_ptr =
                 reinterpret_cast<void*>(&detail::signal_relay_generator<kthook_signal, Ret, head, tail, Args>::relay);
             using_ptr_to_return_address = false;
 
             // save context
-            jump_gen->mov(rax, rcx);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rcx)], rax);
+            gen.mov(detail::rip_operand(gen, &data.rcx), rcx);
 
             // pop out return address
-            jump_gen->pop(rcx);
+            gen.pop(rcx);
 
+            gen.mov(rax, detail::rip_operand(gen, &data.hook));
 #ifdef KTHOOK_64_WIN
-            jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(this));
             // set rsp to next stack argument pointer
-            jump_gen->add(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
-            jump_gen->push(0);
-            jump_gen->push(rax);
-#else
-            jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(this));
-            // push our hook to the stack
-            jump_gen->push(std::uintptr_t(0));
-            jump_gen->push(std::uintptr_t(0));
-            jump_gen->push(std::uintptr_t(0));
-            jump_gen->push(rax);
-#endif
-
-#ifdef KTHOOK_64_WIN
+            gen.add(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
+            gen.push(0);
+            gen.push(rax);
             // return the rsp to its initial state
-            jump_gen->sub(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
+            gen.sub(rsp, static_cast<std::uint32_t>(sizeof(void*) * registers.size()));
 #else
-
+            // SystemVAbiTrick right below the stack arguments
+            gen.push(0);
+            gen.push(0);
+            gen.push(0);
+            gen.push(rax);
 #endif
             // save return address
-            jump_gen->mov(rax, rcx);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
+            gen.mov(detail::rip_operand(gen, &data.last_return_address), rcx);
             // push our return address
-            jump_gen->mov(rax, ret_addr);
-            jump_gen->push(rax);
+            gen.lea(rax, ptr[rip + ret_addr]);
+            gen.push(rax);
 
             // restore context
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rcx)]);
-            jump_gen->mov(rcx, rax);
+            gen.mov(rcx, detail::rip_operand(gen, &data.rcx));
 
-            jump_gen->jmp(ptr[rip]);
-            jump_gen->db(reinterpret_cast<std::uintptr_t>(relay_ptr), 8);
-            jump_gen->L(ret_addr);
+            detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
+            gen.L(ret_addr);
 #ifdef KTHOOK_64_WIN
-            jump_gen->add(rsp, sizeof(void*) * 2);
+            gen.add(rsp, sizeof(void*) * 2);
 #else
-            jump_gen->add(rsp, 32);
+            gen.add(rsp, sizeof(void*) * 4);
 #endif
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
-            // push original return address and return
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
-            jump_gen->push(rax);
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-            jump_gen->ret();
+            // push original return address and return, rcx is free after the call
+            gen.mov(rcx, detail::rip_operand(gen, &data.last_return_address));
+            gen.push(rcx);
+            gen.ret();
 
         } else {
             using_ptr_to_return_address = true;
-            jump_gen->mov(rax, rsp);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
-            jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-            jump_gen->mov(registers[args_info.register_idx_if_full], reinterpret_cast<std::uintptr_t>(this));
-            jump_gen->jmp(ptr[rip]);
+            gen.mov(rax, detail::rip_operand(gen, &data.rax));
+            gen.mov(registers[args_info.register_idx_if_full], detail::rip_operand(gen, &data.hook));
             if constexpr (args_info.register_idx_if_full == 2) {
                 auto relay_ptr =
                     reinterpret_cast<void*>(&detail::signal_relay_generator_three_args<
                         kthook_signal, Ret, head, tail, Args>::relay);
-                jump_gen->db(reinterpret_cast<std::uintptr_t>(relay_ptr), 8);
+                detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
             } else {
                 auto relay_ptr =
                     reinterpret_cast<void*>(&detail::signal_relay_generator<
                         kthook_signal, Ret, head, tail, Args>::relay);
-                jump_gen->db(reinterpret_cast<std::uintptr_t>(relay_ptr), 8);
+                detail::emit_jump(gen, reinterpret_cast<std::uintptr_t>(relay_ptr));
             }
         }
-        detail::flush_intruction_cache(jump_gen->getCode(), jump_gen->getSize());
-        return jump_gen->getCode();
+#endif
+        return true;
+    }
+
+    // generates the relay stub, the hooked function is left untouched
+    bool prepare_patch() {
+        if (jump_stub) return true;
+        if (!data_block) {
+            data_block = detail::alloc_stub_data(info.hook_address, this);
+            if (!data_block) return false;
+        }
+        this->hook_size = detail::detect_hook_size(info.hook_address);
+        jump_stub = detail::generate_near(
+            info.hook_address, [this](detail::stub_generator& gen) { return generate_relay_jump(gen); });
+        if (!jump_stub) return false;
+        std::memcpy(&original, jump_stub.code, sizeof(original));
+        detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
+        return true;
+    }
+
+    bool has_subscribers() const { return !before.empty() || !after.empty(); }
+
+    // while neither signal has a connection the relay stub starts with NOPs and runs straight into its
+    // trampoline copy, connecting the first slot puts the jump into the relay back
+    static void subscribers_changed(void* hook) {
+        auto this_hook = static_cast<kthook_signal*>(hook);
+        std::lock_guard lock{this_hook->subscribers_mutex};
+        if (!this_hook->installed) return;
+        detail::write_stub_head(this_hook->jump_stub,
+                                this_hook->has_subscribers() ? this_hook->original : detail::kStubFallthrough);
+        detail::flush_intruction_cache(this_hook->jump_stub.code, sizeof(this_hook->original));
     }
 
     bool patch_hook(bool enable) {
@@ -958,61 +1673,54 @@ private:
                 std::uint32_t operand;
             } patch;
 #pragma pack(pop)
-            if (!this->relay_jump) {
-                this->hook_size = detail::detect_hook_size(info.hook_address);
-                this->relay_jump = generate_relay_jump();
-
-                detail::frozen_threads threads;
-
-                if constexpr (freeze_threads)
-                    if (!detail::freeze_threads(threads))
-                        return false;
-
-                if (!set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                     detail::MemoryProt::PROTECT_RWE))
-                    return false;
+            if (!info.original_code) {
                 info.original_code = std::make_unique<unsigned char[]>(this->hook_size);
                 std::memcpy(info.original_code.get(), reinterpret_cast<void*>(info.hook_address), this->hook_size);
                 std::uintptr_t relative =
-                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(this->relay_jump), info.hook_address);
-                std::memcpy(&patch, reinterpret_cast<void*>(info.hook_address), sizeof(patch));
+                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(jump_stub.code), info.hook_address);
+                std::memcpy(&patch, info.original_code.get(), sizeof(patch));
                 if (patch.opcode != 0xE8) {
                     patch.opcode = 0xE9;
                 }
                 patch.operand = static_cast<std::uint32_t>(relative);
-                std::memcpy(reinterpret_cast<void*>(info.hook_address), &patch, sizeof(patch));
-                memset(reinterpret_cast<void*>(info.hook_address + sizeof(patch)), 0x90,
-                       this->hook_size - sizeof(patch));
-                if (!detail::set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                             detail::MemoryProt::PROTECT_RE))
+                std::array<std::uint8_t, detail::kMaxHookSize> code;
+                std::memcpy(code.data(), &patch, sizeof(patch));
+                std::memset(code.data() + sizeof(patch), 0x90, this->hook_size - sizeof(patch));
+                detail::write_stub_head(jump_stub, has_subscribers() ? original : detail::kStubFallthrough);
+                detail::relocate_frozen_threads(info.hook_address, this->hook_size, trampoline_stub.code, ip_map);
+                if (!detail::patch_code(info.hook_address, code.data(), this->hook_size, text_poke,
+                                        trampoline_stub.code)) {
+                    info.original_code.reset();
                     return false;
-                if constexpr (freeze_threads)
-                    if (!detail::unfreeze_threads(threads))
-                        return false;
+                }
             } else {
-                jump_gen->rewrite(0, original, 8);
+                detail::write_stub_head(jump_stub, has_subscribers() ? original : detail::kStubFallthrough);
             }
-        } else if (relay_jump) {
-            std::memcpy(reinterpret_cast<void*>(&original), relay_jump, sizeof(original));
-            jump_gen->rewrite(0, 0x9090909090909090, 8);
+        } else if (jump_stub) {
+            detail::write_stub_head(jump_stub, detail::kStubFallthrough);
         }
-        if (jump_gen.get()) detail::flush_intruction_cache(relay_jump, jump_gen->getSize());
+        if (jump_stub) detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
         return true;
     }
 
     hook_info info;
-    mutable std::uintptr_t* last_return_address = nullptr;
     std::size_t hook_size = 0;
-    std::unique_ptr<Xbyak::CodeGenerator> jump_gen;
-    std::unique_ptr<Xbyak::CodeGenerator> trampoline_gen;
+    detail::code_block jump_stub;
+    detail::code_block data_block;
+    detail::code_block trampoline_stub;
+    detail::trampoline_ip_map ip_map;
     std::uint64_t original = 0;
-    const std::uint8_t* relay_jump = nullptr;
+#ifndef KTHOOK_64_TLS
     std::conditional_t<create_context, cpu_ctx, detail::cpu_ctx_empty> context;
+#endif
     bool using_ptr_to_return_address = true;
     bool installed = false;
+    std::mutex subscribers_mutex;
 };
 
-class kthook_naked {
+// ExtendedState also saves the AVX and AVX-512 registers with XSAVE, see get_extended_context()
+template <std::size_t CallbackCapacity = detail::kCallbackCapacity, bool ExtendedState = false>
+class basic_kthook_naked {
     struct hook_info {
         std::uintptr_t hook_address;
         std::unique_ptr<unsigned char[]> original_code;
@@ -1028,14 +1736,14 @@ class kthook_naked {
         }
     };
 
-    using cb_type = std::function<void(const kthook_naked&)>;
-    friend std::uintptr_t detail::naked_relay<kthook_naked>(kthook_naked*);
+    using cb_type = detail::inplace_function<void(const basic_kthook_naked&), CallbackCapacity>;
+    friend std::uintptr_t detail::naked_relay<basic_kthook_naked>(basic_kthook_naked*, std::uintptr_t*);
 public:
-    kthook_naked()
+    basic_kthook_naked()
         : info(0, nullptr) {
     };
 
-    kthook_naked(std::uintptr_t destination, cb_type callback_, bool force_enable = true)
+    basic_kthook_naked(std::uintptr_t destination, cb_type callback_, bool force_enable = true)
         : info(destination, nullptr),
           callback(std::move(callback_)) {
         if (force_enable) {
@@ -1043,31 +1751,33 @@ public:
         }
     }
 
-    kthook_naked(std::uintptr_t destination)
+    basic_kthook_naked(std::uintptr_t destination)
         : info(destination, nullptr) {
     }
 
-    kthook_naked(void* destination)
-        : kthook_naked(reinterpret_cast<std::uintptr_t>(destination)) {
+    basic_kthook_naked(void* destination)
+        : basic_kthook_naked(reinterpret_cast<std::uintptr_t>(destination)) {
     }
 
-    kthook_naked(void* destination, cb_type callback, bool force_enable = true)
-        : kthook_naked(reinterpret_cast<std::uintptr_t>(destination), callback, force_enable) {
+    basic_kthook_naked(void* destination, cb_type callback, bool force_enable = true)
+        : basic_kthook_naked(reinterpret_cast<std::uintptr_t>(destination), callback, force_enable) {
     }
 
-    ~kthook_naked() { remove(); }
+    ~basic_kthook_naked() {
+        if (!detail::release_hook_code(info.hook_address, info.original_code.get(), hook_size, jump_stub,
+                                       trampoline_stub, true))
+            remove();
+    }
 
     bool install() {
-        if (installed) return false;
-        if (info.hook_address == 0) return false;
-        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
-        if (!create_generators()) return false;
-        if (!detail::create_trampoline(info.hook_address, trampoline_gen)) return false;
-        if (!detail::flush_intruction_cache(trampoline_gen->getCode(), trampoline_gen->getSize())) return false;
-        if (!patch_hook(true)) return false;
-        if (!detail::flush_intruction_cache(reinterpret_cast<void*>(info.hook_address), hook_size)) return false;
-        installed = true;
-        return true;
+        if (!prepare_install()) return false;
+        // only the first patch writes to the hooked function, later ones only touch the relay stub
+        bool freeze = !info.original_code;
+        detail::frozen_threads threads;
+        if (freeze && !detail::freeze_threads(threads)) return false;
+        bool applied = apply_install();
+        if (freeze) detail::unfreeze_threads(threads);
+        return applied;
     }
 
     bool remove() {
@@ -1089,170 +1799,209 @@ public:
 
     [[nodiscard]] cb_type& get_callback() { return callback; }
 
-    void set_cb(cb_type callback_) { callback = std::move(callback_); }
+    // while there is no callback the relay stub starts with NOPs and runs straight into its trampoline copy,
+    // so an idle hook costs one jump
+    void set_cb(cb_type callback_) {
+        bool enable = static_cast<bool>(callback_);
+        if (!enable) set_relay_enabled(false);
+        callback = std::move(callback_);
+        if (enable) set_relay_enabled(true);
+    }
 
     void set_dest(std::uintptr_t address) { info = {address, nullptr}; }
 
     void set_dest(void* address) { set_dest(reinterpret_cast<std::uintptr_t>(address)); }
 
-    cpu_ctx& get_context() const { return context; }
-    cpu_ctx_x87& get_x87_context() const { return context_x87; }
-    std::uintptr_t& get_return_address() const { return last_return_address; }
+    // registers of the hooked call the calling thread is in, the callback may change them
+    cpu_ctx& get_context() const { return detail::find_naked_save_area(this).context; }
+    cpu_ctx_x87& get_x87_context() const { return detail::find_naked_save_area(this).context_x87; }
+    std::uintptr_t& get_return_address() const { return detail::find_naked_save_area(this).return_address; }
+
+    // YMM and ZMM registers of the hooked call, the XMM parts are the ones of get_x87_context()
+    cpu_ctx_extended get_extended_context() const {
+        static_assert(ExtendedState, "extended context is only saved by basic_kthook_naked<..., true>");
+        auto& area = detail::find_naked_save_area(this);
+        auto& layout = detail::get_xsave_layout();
+        unsigned char* image = nullptr;
+        if (detail::find_return_address(this) != nullptr && layout.components != 0)
+            image = reinterpret_cast<unsigned char*>(&area) - layout.size;
+        return {area.context_x87, image};
+    }
 
 private:
-    const std::uint8_t* generate_relay_jump() {
-        using namespace Xbyak::util;
+    friend class transaction;
 
-        static const std::uint8_t fxsave_code[] = {0x0f, 0xae, 0x00}; // fxsave [rax]
-        static const std::uint8_t fxrstor_code[] = {0x0f, 0xae, 0x08}; // fxrstor [rax]
+    // stubs are generated here, outside of a thread freeze
+    bool prepare_install() {
+        if (installed) return false;
+        if (info.hook_address == 0) return false;
+        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
+        if (!trampoline_stub) {
+            trampoline_stub = detail::generate_near(info.hook_address, [this](detail::stub_generator& gen) {
+                return detail::create_trampoline(info.hook_address, gen, false, &ip_map);
+            });
+            if (!trampoline_stub) return false;
+        }
+        if (!detail::flush_intruction_cache(trampoline_stub.code, trampoline_stub.size)) return false;
+        return prepare_patch();
+    }
+
+    bool apply_install() {
+        if (!patch_hook(true)) return false;
+        if (!detail::flush_intruction_cache(reinterpret_cast<void*>(info.hook_address), hook_size)) return false;
+        installed = true;
+        return true;
+    }
+
+    bool generate_relay_jump(detail::stub_generator& gen) {
+        using namespace Xbyak::util;
+        using detail::naked_save_area;
+
+        static const std::uint8_t xsavec_code[] = {0x48, 0x0f, 0xc7, 0x24, 0x24}; // xsavec64 [rsp]
+        static const std::uint8_t xsave_code[] = {0x48, 0x0f, 0xae, 0x24, 0x24}; // xsave64 [rsp]
+        static const std::uint8_t xrstor_code[] = {0x48, 0x0f, 0xae, 0x2c, 0x24}; // xrstor64 [rsp]
+#if defined(KTHOOK_64_GCC)
+        // the hooked code may keep live data below its rsp
+        constexpr std::uint32_t kRedZone = 128;
+#else
+        constexpr std::uint32_t kRedZone = 0;
+#endif
+        // the XSAVE image goes at rsp, 64 byte aligned, and the save area right above it
+        auto& layout = detail::get_xsave_layout();
+        const std::uint32_t area = ExtendedState ? layout.size : 0;
+        const std::size_t context = area + naked_save_area::kContextOffset;
+        const std::size_t flags = area + naked_save_area::kFlagsOffset;
+        const std::size_t return_address = area + naked_save_area::kReturnAddressOffset;
+        // fxsave [rsp + area] (/0) or fxrstor [rsp + area] (/1)
+        auto emit_fx = [&gen, area](std::uint8_t operation) {
+            const std::uint8_t code[] = {0x0f, 0xae, static_cast<std::uint8_t>(0x84 | (operation << 3)), 0x24};
+            gen.db(code, sizeof(code));
+            gen.dd(area);
+        };
+        constexpr std::array<std::pair<std::size_t, Xbyak::Reg64>, 14> saved_registers{{
+            {offsetof(cpu_ctx, rbx), rbx}, {offsetof(cpu_ctx, rcx), rcx}, {offsetof(cpu_ctx, rdx), rdx},
+            {offsetof(cpu_ctx, rbp), rbp}, {offsetof(cpu_ctx, rsi), rsi}, {offsetof(cpu_ctx, rdi), rdi},
+            {offsetof(cpu_ctx, r8), r8},   {offsetof(cpu_ctx, r9), r9},   {offsetof(cpu_ctx, r10), r10},
+            {offsetof(cpu_ctx, r11), r11}, {offsetof(cpu_ctx, r12), r12}, {offsetof(cpu_ctx, r13), r13},
+            {offsetof(cpu_ctx, r14), r14}, {offsetof(cpu_ctx, r15), r15},
+        }};
 
         auto hook_address = info.hook_address;
 
-        Xbyak::Label UserCode, ret_addr, jump_in_trampoline, skip_bytes, jump_out;
-        jump_gen->jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
-        jump_gen->nop(3);
-        detail::create_trampoline(hook_address, jump_gen);
-        jump_gen->L(UserCode);
-
-        jump_gen->push(std::uintptr_t{});
-        jump_gen->pushfq();
-
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rax)], rax);
-
-        // saving x87 registers
-        jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(&context_x87));
-        jump_gen->db(fxsave_code, sizeof(fxsave_code));
-
-        jump_gen->mov(rax, rsp);
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-
-        // [rsp - 0x00] == 0
-        // [rsp - 0x08] == eflags
-        // last_return_address == rsp - 0x10
-
-        jump_gen->mov(rsp, reinterpret_cast<std::uintptr_t>(&context.flags));
-        jump_gen->push(r15);
-        jump_gen->push(r14);
-        jump_gen->push(r13);
-        jump_gen->push(r12);
-        jump_gen->push(r11);
-        jump_gen->push(r10);
-        jump_gen->push(r9);
-        jump_gen->push(r8);
-        jump_gen->push(rdi);
-        jump_gen->push(rsi);
-        jump_gen->push(rbp);
-        jump_gen->sub(rsp, sizeof(std::uintptr_t));
-        jump_gen->push(rdx);
-        jump_gen->push(rcx);
-        jump_gen->push(rbx);
-
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
-        jump_gen->mov(rsp, rax);
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.flags)], rax);
-        jump_gen->add(rax, sizeof(cpu_ctx::eflags) + sizeof(std::uintptr_t));
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)], rax);
-        jump_gen->mov(rax, info.hook_address);
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
-        jump_gen->mov(rax, ret_addr);
+        Xbyak::Label UserCode, skip_bytes, jump_out;
+        gen.jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        gen.nop(3);
+        if (!detail::create_trampoline(hook_address, gen)) return false;
+        gen.L(UserCode);
+
+        // [rax] == rax, [rax + 0x08] == eflags, the save area goes below them
+        if constexpr (kRedZone != 0) gen.lea(rsp, ptr[rsp - kRedZone]);
+        gen.pushfq();
+        gen.push(rax);
+        gen.mov(rax, rsp);
+        gen.sub(rsp, static_cast<std::uint32_t>(area + sizeof(naked_save_area) + 2 * sizeof(std::uintptr_t)));
+        gen.and_(rsp, area != 0 ? -64 : -16);
+
+        for (auto& [field, reg] : saved_registers) gen.mov(ptr[rsp + context + field], reg);
+        gen.mov(rbx, ptr[rax]);
+        gen.mov(ptr[rsp + context + offsetof(cpu_ctx, rax)], rbx);
+        gen.mov(rbx, ptr[rax + sizeof(std::uintptr_t)]);
+        gen.mov(ptr[rsp + flags], rbx);
+        gen.lea(rbx, ptr[rsp + flags]);
+        gen.mov(ptr[rsp + context + offsetof(cpu_ctx, flags)], rbx);
+        gen.lea(rbx, ptr[rax + 2 * sizeof(std::uintptr_t) + kRedZone]);
+        gen.mov(ptr[rsp + context + offsetof(cpu_ctx, rsp)], rbx);
+        gen.mov(rbx, hook_address);
+        gen.mov(ptr[rsp + return_address], rbx);
+        emit_fx(0);
+        if (area != 0) {
+            // XSAVE only fills in the header's XSTATE_BV, the rest has to be zero for xrstor
+            gen.xor_(ecx, ecx);
+            for (std::size_t i = 0; i < detail::kXsaveHeaderSize; i += sizeof(std::uint64_t))
+                gen.mov(ptr[rsp + detail::kXsaveHeaderOffset + i], rcx);
+            gen.mov(eax, static_cast<std::uint32_t>(layout.components));
+            gen.xor_(edx, edx);
+            // xsaveopt isn't used, skipping components unmodified since the last xrstor from the same address
+            // only holds for memory nothing else writes to, which the stack isn't
+            if (layout.compacted)
+                gen.db(xsavec_code, sizeof(xsavec_code));
+            else
+                gen.db(xsave_code, sizeof(xsave_code));
+        }
 
+        // rbx keeps the save area across the call
+        gen.mov(rbx, rsp);
 #if defined(KTHOOK_64_WIN)
-        jump_gen->mov(rcx, reinterpret_cast<std::uintptr_t>(this));
-        jump_gen->sub(rsp, sizeof(std::uintptr_t) * 8);
+        gen.mov(rcx, reinterpret_cast<std::uintptr_t>(this));
+        gen.lea(rdx, ptr[rsp + return_address]);
+        gen.sub(rsp, sizeof(std::uintptr_t) * 4);
 #elif defined(KTHOOK_64_GCC)
-        jump_gen->mov(rdi, reinterpret_cast<std::uintptr_t>(this));
+        gen.mov(rdi, reinterpret_cast<std::uintptr_t>(this));
+        gen.lea(rsi, ptr[rsp + return_address]);
 #endif
+        detail::emit_call(gen, reinterpret_cast<std::uintptr_t>(&detail::naked_relay<basic_kthook_naked>));
+        gen.mov(rsp, rbx);
+
+        // the relay returns how far into the trampoline copy to continue, or ~0 to go to return_address
+        gen.cmp(rax, -1);
+        gen.je(jump_out);
+        gen.cmp(rax, hook_size);
+        gen.jae(jump_out);
+        gen.lea(rcx, ptr[rip + skip_bytes]);
+        gen.add(rcx, rax);
+        gen.mov(ptr[rsp + return_address], rcx);
+
+        gen.L(jump_out);
+        // before fxrstor, which has the final say on the XMM registers and mxcsr
+        if (area != 0) {
+            gen.mov(eax, static_cast<std::uint32_t>(layout.components));
+            gen.xor_(edx, edx);
+            gen.db(xrstor_code, sizeof(xrstor_code));
+        }
+        // [rax] == rax, [rax + 0x08] == eflags, [rax + 0x10] == return_address, ret leaves rsp at context.rsp
+        gen.mov(rax, ptr[rsp + context + offsetof(cpu_ctx, rsp)]);
+        gen.sub(rax, static_cast<std::uint32_t>(3 * sizeof(std::uintptr_t) + kRedZone));
+        gen.mov(rcx, ptr[rsp + context + offsetof(cpu_ctx, rax)]);
+        gen.mov(ptr[rax], rcx);
+        gen.mov(rcx, ptr[rsp + context + offsetof(cpu_ctx, flags)]);
+        gen.mov(rcx, ptr[rcx]);
+        gen.mov(ptr[rax + sizeof(std::uintptr_t)], rcx);
+        gen.mov(rcx, ptr[rsp + return_address]);
+        gen.mov(ptr[rax + 2 * sizeof(std::uintptr_t)], rcx);
+        emit_fx(1);
+        for (auto& [field, reg] : saved_registers) gen.mov(reg, ptr[rsp + context + field]);
+
+        gen.mov(rsp, rax);
+        gen.pop(rax);
+        gen.popfq();
+        if constexpr (kRedZone != 0)
+            gen.ret(kRedZone);
+        else
+            gen.ret();
+
+        gen.L(skip_bytes);
+
+        if (!detail::create_trampoline(info.hook_address, gen)) return false;
 
-        jump_gen->push(rax);
-        jump_gen->jmp(ptr[rip]);
-        jump_gen->db(reinterpret_cast<std::uintptr_t>(&detail::naked_relay<kthook_naked>), sizeof(std::uintptr_t));
-        jump_gen->L(ret_addr);
-
-        jump_gen->cmp(rax, -1);
-        jump_gen->je(jump_out);
-
-        jump_gen->cmp(rax, hook_size);
-        jump_gen->jl(jump_in_trampoline);
-
-        jump_gen->L(jump_out);
-
-        jump_gen->mov(rsp, reinterpret_cast<std::uintptr_t>(&context.rbx));
-        jump_gen->pop(rbx);
-        jump_gen->pop(rcx);
-        jump_gen->pop(rdx);
-        jump_gen->add(rsp, 8);
-        jump_gen->pop(rbp);
-        jump_gen->pop(rsi);
-        jump_gen->pop(rdi);
-        jump_gen->pop(r8);
-        jump_gen->pop(r9);
-        jump_gen->pop(r10);
-        jump_gen->pop(r11);
-        jump_gen->pop(r12);
-        jump_gen->pop(r13);
-        jump_gen->pop(r14);
-        jump_gen->pop(r15);
-
-        // restoring x87 registers
-        jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(&context_x87));
-        jump_gen->db(fxrstor_code, sizeof(fxrstor_code));
-
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)]);
-        jump_gen->mov(rsp, rax);
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
-        jump_gen->push(rax);
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-        jump_gen->sub(rsp, sizeof(cpu_ctx::eflags));
-        jump_gen->popfq();
-
-        jump_gen->ret();
-
-        jump_gen->L(jump_in_trampoline);
-
-        jump_gen->mov(rsp, rax);
-        jump_gen->mov(rax, skip_bytes);
-        jump_gen->add(rax, rsp);
-
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)], rax);
-
-        jump_gen->mov(rsp, reinterpret_cast<std::uintptr_t>(&context.rbx));
-        jump_gen->pop(rbx);
-        jump_gen->pop(rcx);
-        jump_gen->pop(rdx);
-        jump_gen->add(rsp, 8);
-        jump_gen->pop(rbp);
-        jump_gen->pop(rsi);
-        jump_gen->pop(rdi);
-        jump_gen->pop(r8);
-        jump_gen->pop(r9);
-        jump_gen->pop(r10);
-        jump_gen->pop(r11);
-        jump_gen->pop(r12);
-        jump_gen->pop(r13);
-        jump_gen->pop(r14);
-        jump_gen->pop(r15);
-
-        // restoring x87 registers
-        jump_gen->mov(rax, reinterpret_cast<std::uintptr_t>(&context_x87));
-        jump_gen->db(fxrstor_code, sizeof(fxrstor_code));
-
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rsp)]);
-        jump_gen->mov(rsp, rax);
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
-        jump_gen->push(rax);
-        jump_gen->mov(rax, ptr[reinterpret_cast<std::uintptr_t>(&context.rax)]);
-        jump_gen->sub(rsp, sizeof(cpu_ctx::eflags));
-        jump_gen->popfq();
-
-        jump_gen->ret();
-
-        jump_gen->L(skip_bytes);
-
-        detail::create_trampoline(info.hook_address, jump_gen);
-
-        detail::flush_intruction_cache(jump_gen->getCode(), jump_gen->getSize());
-        return jump_gen->getCode();
+        return true;
+    }
+
+    // generates the relay stub, the hooked function is left untouched
+    bool prepare_patch() {
+        if (jump_stub) return true;
+        this->hook_size = detail::detect_hook_size(info.hook_address);
+        jump_stub = detail::generate_near(
+            info.hook_address, [this](detail::stub_generator& gen) { return generate_relay_jump(gen); });
+        if (!jump_stub) return false;
+        std::memcpy(&original, jump_stub.code, sizeof(original));
+        detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
+        return true;
+    }
+
+    void set_relay_enabled(bool enable) {
+        if (!installed) return;
+        detail::write_stub_head(jump_stub, enable ? original : detail::kStubFallthrough);
+        detail::flush_intruction_cache(jump_stub.code, sizeof(original));
     }
 
     bool patch_hook(bool enable) {
@@ -1263,73 +2012,51 @@ private:
                 std::uint32_t operand;
             } patch;
 #pragma pack(pop)
-            if (!this->relay_jump) {
-                this->hook_size = detail::detect_hook_size(info.hook_address);
-                this->relay_jump = generate_relay_jump();
-
-                detail::frozen_threads threads;
-
-                if (!detail::freeze_threads(threads))
-                    return false;
-                if (!set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                     detail::MemoryProt::PROTECT_RWE))
-                    return false;
+            if (!info.original_code) {
                 info.original_code = std::make_unique<unsigned char[]>(this->hook_size);
                 std::memcpy(info.original_code.get(), reinterpret_cast<void*>(info.hook_address), this->hook_size);
                 std::uintptr_t relative =
-                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(this->relay_jump), info.hook_address);
-                std::memcpy(&patch, reinterpret_cast<void*>(info.hook_address), sizeof(patch));
+                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(jump_stub.code), info.hook_address);
+                std::memcpy(&patch, info.original_code.get(), sizeof(patch));
                 if (patch.opcode != 0xE8) {
                     patch.opcode = 0xE9;
                 }
                 patch.operand = static_cast<std::uint32_t>(relative);
-                std::memcpy(reinterpret_cast<void*>(info.hook_address), &patch, sizeof(patch));
-                memset(reinterpret_cast<void*>(info.hook_address + sizeof(patch)), 0x90,
-                       this->hook_size - sizeof(patch));
-                if (!detail::set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                             detail::MemoryProt::PROTECT_RE))
-                    return false;
-
-                if (!detail::unfreeze_threads(threads))
+                std::array<std::uint8_t, detail::kMaxHookSize> code;
+                std::memcpy(code.data(), &patch, sizeof(patch));
+                std::memset(code.data() + sizeof(patch), 0x90, this->hook_size - sizeof(patch));
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
+                detail::relocate_frozen_threads(info.hook_address, this->hook_size, trampoline_stub.code, ip_map);
+                if (!detail::patch_code(info.hook_address, code.data(), this->hook_size, false,
+                                        trampoline_stub.code)) {
+                    info.original_code.reset();
                     return false;
+                }
             } else {
-                jump_gen->rewrite(0, original, 8);
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
             }
-        } else if (relay_jump) {
-            std::memcpy(reinterpret_cast<void*>(&original), relay_jump, sizeof(original));
-            jump_gen->rewrite(0, 0x9090909090909090, 8);
+        } else if (jump_stub) {
+            detail::write_stub_head(jump_stub, detail::kStubFallthrough);
         }
-        if (jump_gen.get()) detail::flush_intruction_cache(relay_jump, jump_gen->getSize());
+        if (jump_stub) detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
         return true;
     }
 
-    bool create_generators() {
-        void* alloc = detail::try_alloc_near(info.hook_address);
-        if (alloc == nullptr) return false;
-        void* jump_alloc = alloc;
-        auto trampoline_alloc = reinterpret_cast<void*>(reinterpret_cast<std::uintptr_t>(jump_alloc) + 0x800);
-        jump_gen = std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, jump_alloc,
-                                                          &detail::default_jmp_allocator);
-        trampoline_gen = std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, trampoline_alloc,
-                                                                &detail::default_trampoline_allocator);
-        return true;
-    }
 
     hook_info info;
     cb_type callback{};
     std::size_t hook_size{0};
     std::uint64_t original{0};
 
-    mutable std::uintptr_t last_return_address{0};
-    mutable cpu_ctx context{};
-    mutable cpu_ctx_x87 context_x87{};
+    detail::code_block jump_stub;
+    detail::code_block trampoline_stub;
+    detail::trampoline_ip_map ip_map;
 
-    std::unique_ptr<Xbyak::CodeGenerator> jump_gen;
-    std::unique_ptr<Xbyak::CodeGenerator> trampoline_gen;
-
-    const std::uint8_t* relay_jump{nullptr};
     bool installed{false};
 };
+
+using kthook_naked = basic_kthook_naked<>;
+using kthook_naked_extended = basic_kthook_naked<detail::kCallbackCapacity, true>;
 } // namespace kthook
 
 #endif  // KTHOOK_IMPL_HPP_
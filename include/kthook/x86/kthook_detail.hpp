@@ -225,6 +225,37 @@ struct relay_generator<HookPtrType, traits::cconv::cfastcall, Ret, std::tuple<Ar
         return common_relay<decltype(cb), HookPtrType, Ret, Args...>(cb, this_hook, args...);
     }
 };
+
+// rel32 reaches the whole 32-bit address space, so any address is near enough
+constexpr std::uintptr_t kMaxMemoryRange = ~std::uintptr_t{0};
+
+inline bool is_in_near_range(std::uintptr_t, std::uintptr_t) { return true; }
+
+inline void* try_alloc_near(std::uintptr_t, std::size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void* result = mmap(nullptr, size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) return nullptr;
+    return result;
+#endif
+}
+
+inline void free_near(void* address, std::size_t size) {
+#ifdef _WIN32
+    VirtualFree(address, 0, MEM_RELEASE);
+#else
+    munmap(address, size);
+#endif
+}
+
+// no dual mapping on x86, code is written in place
+inline code_region_memory alloc_code_region(std::uintptr_t address, std::size_t size) {
+    auto memory = static_cast<std::uint8_t*>(try_alloc_near(address, size));
+    return {memory, memory};
+}
+
+inline void free_code_region(const code_region_memory& memory, std::size_t size) { free_near(memory.exec, size); }
 } // namespace detail
 } // namespace kthook
 
@@ -9,6 +9,8 @@
 #endif
 
 namespace kthook {
+class transaction;
+
 #pragma pack(push, 1)
 struct cpu_ctx {
     struct eflags {
@@ -76,8 +78,8 @@ struct cpu_ctx_empty {
     void* flags;
 };
 
-inline bool create_trampoline(std::uintptr_t hook_address,
-                              const std::unique_ptr<Xbyak::CodeGenerator>& trampoline_gen, bool naked = false) {
+inline bool create_trampoline(std::uintptr_t hook_address, stub_generator& trampoline_gen, bool naked = false,
+                              trampoline_ip_map* ip_map = nullptr) {
     CALL_REL call = {
         0xE8,      // E8 xxxxxxxx: CALL +5+xxxxxxxx
         0x00000000 // Relative destination address
@@ -97,6 +99,7 @@ inline bool create_trampoline(std::uintptr_t hook_address,
     std::uintptr_t current_address = hook_address;
     std::uintptr_t max_jmp_ref = 0;
     bool finished = false;
+    if (ip_map) *ip_map = {};
 
     while (!finished) {
         detail::hde hs;
@@ -105,14 +108,14 @@ inline bool create_trampoline(std::uintptr_t hook_address,
         op_copy_src = reinterpret_cast<void*>(current_address);
         if (current_address - hook_address >= sizeof(call)) {
             if (!naked)
-                trampoline_gen->jmp(reinterpret_cast<std::uint8_t*>(current_address));
+                trampoline_gen.jmp(reinterpret_cast<std::uint8_t*>(current_address));
             break;
         }
         // Relative Call
         else if (hs.opcode == 0xE8) {
             std::uintptr_t call_destination = detail::restore_absolute_address(current_address, hs.imm.imm32, hs.len);
             jmp.operand = detail::get_relative_address(
-                call_destination, reinterpret_cast<std::uintptr_t>(trampoline_gen->getCurr()), sizeof(jmp));
+                call_destination, trampoline_gen.get_exec_curr(), sizeof(jmp));
             op_copy_src = &jmp;
             op_copy_size = sizeof(jmp);
         }
@@ -129,7 +132,7 @@ inline bool create_trampoline(std::uintptr_t hook_address,
                 if (max_jmp_ref < jmp_destination) max_jmp_ref = jmp_destination;
             } else {
                 jmp.operand = detail::get_relative_address(
-                    jmp_destination, reinterpret_cast<std::uintptr_t>(trampoline_gen->getCurr()), sizeof(jmp));
+                    jmp_destination, trampoline_gen.get_exec_curr(), sizeof(jmp));
                 op_copy_src = &jmp;
                 op_copy_size = sizeof(jmp);
 
@@ -161,7 +164,7 @@ inline bool create_trampoline(std::uintptr_t hook_address,
                 std::uint8_t cond = ((hs.opcode != 0x0F ? hs.opcode : hs.opcode2) & 0x0F);
                 jcc.opcode1 = 0x80 | cond;
                 jcc.operand = detail::get_relative_address(
-                    jmp_destination, reinterpret_cast<std::uintptr_t>(trampoline_gen->getCurr()), sizeof(jcc));
+                    jmp_destination, trampoline_gen.get_exec_curr(), sizeof(jcc));
                 op_copy_src = &jcc;
                 op_copy_size = sizeof(jcc);
             }
@@ -171,7 +174,8 @@ inline bool create_trampoline(std::uintptr_t hook_address,
             finished = (current_address >= max_jmp_ref);
         }
 
-        trampoline_gen->db(reinterpret_cast<std::uint8_t*>(op_copy_src), op_copy_size);
+        if (ip_map) ip_map->add(current_address - hook_address, trampoline_gen.getSize());
+        trampoline_gen.db(reinterpret_cast<std::uint8_t*>(op_copy_src), op_copy_size);
 
         trampoline_size += op_copy_size;
         current_address += hs.len;
@@ -179,6 +183,37 @@ inline bool create_trampoline(std::uintptr_t hook_address,
     if (current_address - hook_address < sizeof(JMP_REL)) return false;
     return true;
 }
+
+// bool CCDECL dispatcher(void* args, void* result) of a compiled hook_signal: calls every thunk with its slot object,
+// args and result in order and returns the thunks' results or-ed together
+inline bool generate_signal_dispatcher(stub_generator& gen, const std::vector<dispatch_call>& calls) {
+    using namespace Xbyak::util;
+    gen.push(ebx);
+    gen.push(ebp);
+    gen.push(esi);
+    gen.mov(ebx, dword[esp + 16]);
+    gen.mov(ebp, dword[esp + 20]);
+    gen.xor_(esi, esi);
+    // room for the three thunk arguments, keeps the stack 16 byte aligned at the calls
+    gen.sub(esp, 16);
+    for (auto& call : calls) {
+        gen.mov(dword[esp], static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(call.object)));
+        gen.mov(dword[esp + 4], ebx);
+        gen.mov(dword[esp + 8], ebp);
+        // rel32 reaches the whole address space
+        gen.db(0xE8);
+        gen.dd(static_cast<std::uint32_t>(call.thunk - (gen.get_exec_curr() + sizeof(CALL_REL))));
+        gen.movzx(eax, al);
+        gen.or_(esi, eax);
+    }
+    gen.add(esp, 16);
+    gen.mov(eax, esi);
+    gen.pop(esi);
+    gen.pop(ebp);
+    gen.pop(ebx);
+    gen.ret();
+    return true;
+}
 } // namespace detail
 
 enum class XMM: unsigned {
@@ -284,24 +319,62 @@ public:
 };
 #pragma pack(pop)
 
+namespace detail {
+// What a naked stub saves for one call. The stub builds it on the hooked thread's own stack, so concurrent and
+// recursive calls never share one. The fxsave image goes first for its 16-byte alignment, return_address is where
+// the call continues.
+struct alignas(16) naked_save_area {
+    cpu_ctx_x87 context_x87;
+    cpu_ctx context;
+    std::uintptr_t flags;
+    std::uintptr_t return_address;
+
+    static constexpr std::size_t kContextOffset = sizeof(cpu_ctx_x87);
+    static constexpr std::size_t kFlagsOffset = kContextOffset + sizeof(cpu_ctx);
+    static constexpr std::size_t kReturnAddressOffset = kFlagsOffset + sizeof(std::uintptr_t);
+};
+static_assert(sizeof(cpu_ctx_x87) == 512 && sizeof(cpu_ctx) % sizeof(std::uintptr_t) == 0);
+
+// save area of the call of hook the calling thread is in, an empty per-thread one outside of its callback
+inline naked_save_area& find_naked_save_area(const void* hook) {
+    static thread_local naked_save_area no_call{};
+    auto return_address = find_return_address(hook);
+    if (return_address == nullptr) return no_call;
+    return *reinterpret_cast<naked_save_area*>(reinterpret_cast<unsigned char*>(return_address) -
+                                               naked_save_area::kReturnAddressOffset);
+}
+}  // namespace detail
+
 enum kthook_option {
     kNone = 0,
     kCreateContext = 1 << 0,
     kFreezeThreads = 1 << 1,
+    kTextPoke = 1 << 2,  // patch with int3 and membarrier like the kernel's text_poke_bp instead of freezing,
+                         // when the jump replaces a single instruction
+    kNoReentry = 1 << 3,  // calls made on a thread already inside a kNoReentry relay skip the callback,
+                          // x64 Linux and FreeBSD only
 };
 
-template <typename FunctionPtrT, kthook_option Options = kthook_option::kNone>
+template <typename FunctionPtrT, kthook_option Options = kthook_option::kNone,
+          std::size_t CallbackCapacity = detail::kCallbackCapacity, typename CallbackT = void>
 class kthook_simple {
     using function = detail::traits::function_traits<FunctionPtrT>;
     using Args = typename function::args;
     using Ret = typename function::return_type;
     using function_ptr = detail::traits::function_connect_ptr_t<function::convention, Ret, Args>;
     using converted_args = detail::traits::add_refs_t<detail::traits::convert_refs_t<Args>>;
-    using cb_type = std::function<
-        detail::traits::function_connect_t<Ret, detail::traits::tuple_cat_t<const kthook_simple&, converted_args>>>;
+    using cb_type = std::conditional_t<
+        std::is_void_v<CallbackT>,
+        detail::inplace_function<detail::traits::function_connect_t<
+                                     Ret, detail::traits::tuple_cat_t<const kthook_simple&, converted_args>>,
+                                 CallbackCapacity>,
+        CallbackT>;
 
     static constexpr auto create_context = Options & kthook_option::kCreateContext;
     static constexpr auto freeze_threads = Options & kthook_option::kFreezeThreads;
+    static constexpr auto text_poke = Options & kthook_option::kTextPoke;
+    static constexpr auto no_reentry = Options & kthook_option::kNoReentry;
+    static_assert(!no_reentry, "kNoReentry needs the fs-relative TLS of x64 Linux and FreeBSD");
 
     struct hook_info {
         std::uintptr_t hook_address;
@@ -359,20 +432,28 @@ public:
     }
 
     ~kthook_simple() {
-        remove();
+        if (!detail::release_hook_code(info.hook_address, info.original_code.get(), hook_size, jump_stub,
+                                       trampoline_stub, freeze_threads))
+            remove();
         delete reinterpret_cast<cpu_ctx::eflags*>(context.flags);
     }
 
     bool install() {
-        if (installed) return false;
-        if (info.hook_address == 0) return false;
-        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
-        if (!detail::create_trampoline(info.hook_address, trampoline_gen)) return false;
-        if (!detail::flush_intruction_cache(trampoline_gen->getCode(), trampoline_gen->getSize())) return false;
-        if (!patch_hook(true)) return false;
-
-        installed = true;
-        return true;
+        if (!prepare_install()) return false;
+        // only the first patch writes to the hooked function, later ones only touch the relay stub
+        bool first_patch = !info.original_code;
+        bool freeze =
+            first_patch && (text_poke ? !detail::can_text_poke(info.hook_address, hook_size) : freeze_threads);
+        detail::frozen_threads threads;
+        if (freeze && !detail::freeze_threads(threads)) return false;
+        bool applied = apply_install();
+        if (!applied && text_poke && first_patch && !freeze) {
+            // text_poke wrote nothing, the patch goes in under a freeze instead
+            freeze = detail::freeze_threads(threads);
+            if (freeze) applied = apply_install();
+        }
+        if (freeze) detail::unfreeze_threads(threads);
+        return applied;
     }
 
     bool remove() {
@@ -394,14 +475,18 @@ public:
         return true;
     }
 
-    void set_cb(cb_type callback_) { callback = std::move(callback_); }
+    // while there is no callback the relay stub starts with NOPs and runs straight into its trampoline copy,
+    // so an idle hook costs one jump
+    void set_cb(cb_type callback_) {
+        bool enable = static_cast<bool>(callback_);
+        if (!enable) set_relay_enabled(false);
+        callback = std::move(callback_);
+        if (enable) set_relay_enabled(true);
+    }
 
     template <typename C, typename S = decltype(&C::template operator()<const kthook_simple&>)>
     void set_cb_wrapped(C cb) {
-        callback = [cb = std::forward<C>(cb)](auto&&... args) {
-            std::apply(cb, detail::bind_values<detail::traits::args<S>>(
-                           std::forward_as_tuple(std::forward<decltype(args)>(args)...)));
-        };
+        set_cb(detail::wrapped_callback<C, detail::traits::args<S>>{std::move(cb)});
     }
 
     void set_dest(std::uintptr_t address) { info = {address, nullptr}; }
@@ -412,10 +497,13 @@ public:
 
     std::uintptr_t& get_return_address() const { return last_return_address; }
 
-    const cpu_ctx& get_context() const { return context; }
+    const cpu_ctx& get_context() const {
+        static_assert(create_context, "get_context needs kthook_option::kCreateContext");
+        return context;
+    }
 
     const function_ptr get_trampoline() const {
-        return reinterpret_cast<function_ptr>(const_cast<std::uint8_t*>(trampoline_gen->getCode()));
+        return reinterpret_cast<function_ptr>(trampoline_stub.code);
     }
 
     template <typename... Ts>
@@ -426,40 +514,64 @@ public:
     cb_type& get_callback() { return callback; }
 
 private:
-    const std::uint8_t* generate_relay_jump() {
+    friend class transaction;
+
+    // stubs are generated here, outside of a thread freeze
+    bool prepare_install() {
+        if (installed) return false;
+        if (info.hook_address == 0) return false;
+        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
+        if (!trampoline_stub) {
+            trampoline_stub = detail::generate_near(info.hook_address, [this](detail::stub_generator& gen) {
+                return detail::create_trampoline(info.hook_address, gen, false, &ip_map);
+            });
+            if (!trampoline_stub) return false;
+        }
+        if (!detail::flush_intruction_cache(trampoline_stub.code, trampoline_stub.size)) return false;
+        return prepare_patch();
+    }
+
+    bool apply_install() {
+        if (!patch_hook(true)) return false;
+
+        installed = true;
+        return true;
+    }
+
+    bool generate_relay_jump(detail::stub_generator& gen) {
         using namespace Xbyak::util;
 
         auto hook_address = info.hook_address;
 
         Xbyak::Label UserCode;
         // this jump gets nopped when hook.remove() is called
-        jump_gen->jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
-        jump_gen->nop(3);
+        gen.jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        gen.nop(3);
 
         // create trampoline
-        detail::create_trampoline(hook_address, jump_gen);
-        jump_gen->L(UserCode);
+        if (!detail::create_trampoline(hook_address, gen)) return false;
+        gen.L(UserCode);
 
         if constexpr (create_context) {
-            jump_gen->pushfd();
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.eax)], eax);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)], ecx);
-            jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.flags)]);
-            jump_gen->mov(ecx, ptr[esp]);
-            jump_gen->mov(ptr[eax], ecx);
-            jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.eax)]);
-            jump_gen->mov(ecx, ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)]);
-            jump_gen->add(esp, sizeof(cpu_ctx::eflags));
-
-            jump_gen->mov(ptr[&last_return_address], esp);
-            jump_gen->mov(esp, reinterpret_cast<std::uintptr_t>(&context.flags));
-            jump_gen->pushad();
-            jump_gen->mov(esp, ptr[&last_return_address]);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.esp)], esp);
+            gen.pushfd();
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.eax)], eax);
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)], ecx);
+            gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.flags)]);
+            gen.mov(ecx, ptr[esp]);
+            gen.mov(ptr[eax], ecx);
+            gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.eax)]);
+            gen.mov(ecx, ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)]);
+            gen.add(esp, sizeof(cpu_ctx::eflags));
+
+            gen.mov(ptr[&last_return_address], esp);
+            gen.mov(esp, reinterpret_cast<std::uintptr_t>(&context.flags));
+            gen.pushad();
+            gen.mov(esp, ptr[&last_return_address]);
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.esp)], esp);
         }
 
-        jump_gen->mov(eax, ptr[esp]);
-        jump_gen->mov(ptr[&last_return_address], eax);
+        gen.mov(eax, ptr[esp]);
+        gen.mov(ptr[&last_return_address], eax);
 
         constexpr bool can_be_pushed = []() {
             if constexpr (function::args_count > 0) {
@@ -471,68 +583,68 @@ private:
         constexpr bool is_thiscall = (function::convention == detail::traits::cconv::cthiscall);
         constexpr bool is_fastcall = (function::convention == detail::traits::cconv::cfastcall);
 #ifdef _WIN32
-        jump_gen->pop(eax);
+        gen.pop(eax);
         if constexpr (!std::is_void_v<Ret>) {
             constexpr bool is_fully_nontrivial = !std::is_trivial_v<Ret> || !std::is_trivially_destructible_v<Ret>;
             if constexpr (sizeof(Ret) > 8 || is_fully_nontrivial) {
                 if constexpr ((is_thiscall || is_fastcall) && (sizeof(Ret) % 2 != 0 || is_fully_nontrivial)) {
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
                     if constexpr (is_thiscall)
-                        jump_gen->push(ecx);
+                        gen.push(ecx);
                 } else {
-                    jump_gen->pop(eax);
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-                    jump_gen->push(eax);
-                    jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
+                    gen.pop(eax);
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(eax);
+                    gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
                 }
             } else {
                 if constexpr (is_thiscall) {
                     if constexpr (can_be_pushed) {
-                        jump_gen->push(ecx);
+                        gen.push(ecx);
                     }
                 }
-                jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+                gen.push(reinterpret_cast<std::uintptr_t>(this));
             }
         } else {
             if constexpr (is_thiscall) {
                 if constexpr (can_be_pushed) {
-                    jump_gen->push(ecx);
+                    gen.push(ecx);
                 }
             }
-            jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+            gen.push(reinterpret_cast<std::uintptr_t>(this));
         }
 #else
-        jump_gen->pop(eax);
+        gen.pop(eax);
         // if Ret is class or union, memory for return value as first argument(hidden)
         // so we need to push our hook pointer after this hidden argument
         if constexpr (!std::is_void_v<Ret>) {
             constexpr bool is_fully_nontrivial = !std::is_trivial_v<Ret> || !std::is_trivially_destructible_v<Ret>;
             if constexpr (std::is_class_v<Ret> || std::is_union_v<Ret> || sizeof(Ret) > 8) {
                 if constexpr (is_thiscall && (sizeof(Ret) % 2 != 0 || is_fully_nontrivial)) {
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-                    jump_gen->push(ecx);
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(ecx);
                 } else {
-                    jump_gen->pop(eax);
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-                    jump_gen->push(eax);
-                    jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
+                    gen.pop(eax);
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(eax);
+                    gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
                 }
 
             } else {
                 if constexpr (is_thiscall) {
                     if constexpr (can_be_pushed) {
-                        jump_gen->push(ecx);
+                        gen.push(ecx);
                     }
                 }
-                jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+                gen.push(reinterpret_cast<std::uintptr_t>(this));
             }
         } else {
             if constexpr (is_thiscall) {
                 if constexpr (can_be_pushed) {
-                    jump_gen->push(ecx);
+                    gen.push(ecx);
                 }
             }
-            jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+            gen.push(reinterpret_cast<std::uintptr_t>(this));
         }
         static_assert(function::convention != detail::traits::cconv::cfastcall, "linux fastcall not supported");
 #endif
@@ -540,15 +652,32 @@ private:
             reinterpret_cast<void*>(&detail::relay_generator<kthook_simple, function::convention, Ret, Args>::relay);
         if constexpr (function::convention == detail::traits::cconv::ccdecl) {
             // call relay for restoring stack pointer after call
-            jump_gen->call(relay_ptr);
-            jump_gen->add(esp, 4);
-            jump_gen->jmp(ptr[&last_return_address]);
+            gen.call(relay_ptr);
+            gen.add(esp, 4);
+            gen.jmp(ptr[&last_return_address]);
         } else {
-            jump_gen->push(eax);
-            jump_gen->jmp(relay_ptr);
+            gen.push(eax);
+            gen.jmp(relay_ptr);
         }
-        detail::flush_intruction_cache(jump_gen->getCode(), jump_gen->getSize());
-        return jump_gen->getCode();
+        return true;
+    }
+
+    // generates the relay stub, the hooked function is left untouched
+    bool prepare_patch() {
+        if (jump_stub) return true;
+        this->hook_size = detail::detect_hook_size(info.hook_address);
+        jump_stub = detail::generate_near(
+            info.hook_address, [this](detail::stub_generator& gen) { return generate_relay_jump(gen); });
+        if (!jump_stub) return false;
+        std::memcpy(&original, jump_stub.code, sizeof(original));
+        detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
+        return true;
+    }
+
+    void set_relay_enabled(bool enable) {
+        if (!installed) return;
+        detail::write_stub_head(jump_stub, enable ? original : detail::kStubFallthrough);
+        detail::flush_intruction_cache(jump_stub.code, sizeof(original));
     }
 
     bool patch_hook(bool enable) {
@@ -559,46 +688,33 @@ private:
                 std::uint32_t operand;
             } patch;
 #pragma pack(pop)
-            if (!this->relay_jump) {
-                this->hook_size = detail::detect_hook_size(info.hook_address);
-                this->relay_jump = generate_relay_jump();
-
-                detail::frozen_threads threads;
-
-                if constexpr (freeze_threads)
-                    if (!detail::freeze_threads(threads))
-                        return false;
-
-                if (!set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                     detail::MemoryProt::PROTECT_RWE))
-                    return false;
+            if (!info.original_code) {
                 info.original_code = std::make_unique<unsigned char[]>(this->hook_size);
                 std::memcpy(info.original_code.get(), reinterpret_cast<void*>(info.hook_address), this->hook_size);
-                uintptr_t relative =
-                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(this->relay_jump), info.hook_address);
-                std::memcpy(&patch, reinterpret_cast<void*>(info.hook_address), sizeof(patch));
+                std::uintptr_t relative =
+                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(jump_stub.code), info.hook_address);
+                std::memcpy(&patch, info.original_code.get(), sizeof(patch));
                 if (patch.opcode != 0xE8) {
                     patch.opcode = 0xE9;
                 }
-                patch.operand = relative;
-                std::memcpy(reinterpret_cast<void*>(info.hook_address), &patch, sizeof(patch));
-                memset(reinterpret_cast<void*>(info.hook_address + sizeof(patch)), 0x90,
-                       this->hook_size - sizeof(patch));
-                if (!detail::set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                             detail::MemoryProt::PROTECT_RE))
+                patch.operand = static_cast<std::uint32_t>(relative);
+                std::array<std::uint8_t, detail::kMaxHookSize> code;
+                std::memcpy(code.data(), &patch, sizeof(patch));
+                std::memset(code.data() + sizeof(patch), 0x90, this->hook_size - sizeof(patch));
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
+                detail::relocate_frozen_threads(info.hook_address, this->hook_size, trampoline_stub.code, ip_map);
+                if (!detail::patch_code(info.hook_address, code.data(), this->hook_size, text_poke,
+                                        trampoline_stub.code)) {
+                    info.original_code.reset();
                     return false;
-
-                if constexpr (freeze_threads)
-                    if (!detail::unfreeze_threads(threads))
-                        return false;
+                }
             } else {
-                jump_gen->rewrite(0, original, 8);
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
             }
-        } else if (relay_jump) {
-            std::memcpy(reinterpret_cast<void*>(&original), relay_jump, sizeof(original));
-            jump_gen->rewrite(0, 0x9090909090909090, 8);
+        } else if (jump_stub) {
+            detail::write_stub_head(jump_stub, detail::kStubFallthrough);
         }
-        detail::flush_intruction_cache(relay_jump, jump_gen->getSize());
+        if (jump_stub) detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
         return true;
     }
 
@@ -606,16 +722,20 @@ private:
     hook_info info;
     mutable std::uintptr_t last_return_address{0};
     std::size_t hook_size{0};
-    std::unique_ptr<Xbyak::CodeGenerator> jump_gen{
-        std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, nullptr, &detail::default_jmp_allocator)};
-    std::unique_ptr<Xbyak::CodeGenerator> trampoline_gen{std::make_unique<Xbyak::CodeGenerator>()};
+    detail::code_block jump_stub;
+    detail::code_block trampoline_stub;
+    detail::trampoline_ip_map ip_map;
     std::uint64_t original{0};
-    const std::uint8_t* relay_jump{nullptr};
     std::conditional_t<Options & kthook_option::kCreateContext, cpu_ctx, detail::cpu_ctx_empty> context{};
     bool using_ptr_to_return_address = true;
     bool installed = false;
 };
 
+// Callback is a function pointer or a pointer to a constexpr stateless lambda, taking (const hook&, args&...).
+// The relay calls it without going through std::function, so the compiler can inline it.
+template <typename FunctionPtrT, auto Callback, kthook_option Options = kthook_option::kNone>
+using kthook_static = kthook_simple<FunctionPtrT, Options, 0, detail::static_callback<Callback>>;
+
 template <typename FunctionPtrT, kthook_option Options = kthook_option::kNone>
 class kthook_signal {
     using function = detail::traits::function_traits<FunctionPtrT>;
@@ -628,6 +748,9 @@ class kthook_signal {
 
     static constexpr auto create_context = Options & kthook_option::kCreateContext;
     static constexpr auto freeze_threads = Options & kthook_option::kFreezeThreads;
+    static constexpr auto text_poke = Options & kthook_option::kTextPoke;
+    static constexpr auto no_reentry = Options & kthook_option::kNoReentry;
+    static_assert(!no_reentry, "kNoReentry needs the fs-relative TLS of x64 Linux and FreeBSD");
 
     struct hook_info {
         std::uintptr_t hook_address;
@@ -670,18 +793,28 @@ public:
     }
 
     ~kthook_signal() {
-        remove();
+        if (!detail::release_hook_code(info.hook_address, info.original_code.get(), hook_size, jump_stub,
+                                       trampoline_stub, freeze_threads))
+            remove();
         delete reinterpret_cast<cpu_ctx::eflags*>(context.flags);
     }
 
     bool install() {
-        if (installed) return false;
-        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
-        if (!detail::create_trampoline(info.hook_address, trampoline_gen)) return false;
-        if (!detail::flush_intruction_cache(trampoline_gen->getCode(), trampoline_gen->getSize())) return false;
-        if (!patch_hook(true)) return false;
-        installed = true;
-        return true;
+        if (!prepare_install()) return false;
+        // only the first patch writes to the hooked function, later ones only touch the relay stub
+        bool first_patch = !info.original_code;
+        bool freeze =
+            first_patch && (text_poke ? !detail::can_text_poke(info.hook_address, hook_size) : freeze_threads);
+        detail::frozen_threads threads;
+        if (freeze && !detail::freeze_threads(threads)) return false;
+        bool applied = apply_install();
+        if (!applied && text_poke && first_patch && !freeze) {
+            // text_poke wrote nothing, the patch goes in under a freeze instead
+            freeze = detail::freeze_threads(threads);
+            if (freeze) applied = apply_install();
+        }
+        if (freeze) detail::unfreeze_threads(threads);
+        return applied;
     }
 
     bool remove() {
@@ -710,50 +843,81 @@ public:
 
     std::uintptr_t& get_return_address() const { return last_return_address; }
 
-    const cpu_ctx& get_context() const { return context; }
+    const cpu_ctx& get_context() const {
+        static_assert(create_context, "get_context needs kthook_option::kCreateContext");
+        return context;
+    }
 
     const function_ptr get_trampoline() {
-        return reinterpret_cast<function_ptr>(const_cast<std::uint8_t*>(trampoline_gen->getCode()));
+        return reinterpret_cast<function_ptr>(trampoline_stub.code);
     }
 
-    before_t before;
-    after_t after;
+    // calls the slots of both signals through generated dispatchers, see hook_signal::compile
+    void compile() {
+        before.compile();
+        after.compile();
+    }
+
+    before_t before{&subscribers_changed, this};
+    after_t after{&subscribers_changed, this};
 
 private:
-    const std::uint8_t* generate_relay_jump() {
+    friend class transaction;
+
+    // stubs are generated here, outside of a thread freeze
+    bool prepare_install() {
+        if (installed) return false;
+        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
+        if (!trampoline_stub) {
+            trampoline_stub = detail::generate_near(info.hook_address, [this](detail::stub_generator& gen) {
+                return detail::create_trampoline(info.hook_address, gen, false, &ip_map);
+            });
+            if (!trampoline_stub) return false;
+        }
+        if (!detail::flush_intruction_cache(trampoline_stub.code, trampoline_stub.size)) return false;
+        return prepare_patch();
+    }
+
+    bool apply_install() {
+        if (!patch_hook(true)) return false;
+        installed = true;
+        return true;
+    }
+
+    bool generate_relay_jump(detail::stub_generator& gen) {
         using namespace Xbyak::util;
 
         auto hook_address = info.hook_address;
 
         Xbyak::Label UserCode;
         // this jump gets nopped when hook.remove() is called
-        jump_gen->jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
-        jump_gen->nop(3);
+        gen.jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        gen.nop(3);
 
         // create trampoline
-        detail::create_trampoline(hook_address, jump_gen);
-        jump_gen->L(UserCode);
+        if (!detail::create_trampoline(hook_address, gen)) return false;
+        gen.L(UserCode);
 
         if constexpr (create_context) {
-            jump_gen->pushfd();
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.eax)], eax);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)], ecx);
-            jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.flags)]);
-            jump_gen->mov(ecx, ptr[esp]);
-            jump_gen->mov(ptr[eax], ecx);
-            jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.eax)]);
-            jump_gen->mov(ecx, ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)]);
-            jump_gen->add(esp, sizeof(cpu_ctx::eflags));
-
-            jump_gen->mov(ptr[&last_return_address], esp);
-            jump_gen->mov(esp, reinterpret_cast<std::uintptr_t>(&context.flags));
-            jump_gen->pushad();
-            jump_gen->mov(esp, ptr[&last_return_address]);
-            jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.esp)], esp);
+            gen.pushfd();
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.eax)], eax);
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)], ecx);
+            gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.flags)]);
+            gen.mov(ecx, ptr[esp]);
+            gen.mov(ptr[eax], ecx);
+            gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&context.eax)]);
+            gen.mov(ecx, ptr[reinterpret_cast<std::uintptr_t>(&context.ecx)]);
+            gen.add(esp, sizeof(cpu_ctx::eflags));
+
+            gen.mov(ptr[&last_return_address], esp);
+            gen.mov(esp, reinterpret_cast<std::uintptr_t>(&context.flags));
+            gen.pushad();
+            gen.mov(esp, ptr[&last_return_address]);
+            gen.mov(ptr[reinterpret_cast<std::uintptr_t>(&context.esp)], esp);
         }
 
-        jump_gen->mov(eax, ptr[esp]);
-        jump_gen->mov(ptr[&last_return_address], eax);
+        gen.mov(eax, ptr[esp]);
+        gen.mov(ptr[&last_return_address], eax);
 
         constexpr bool can_be_pushed = []() {
             if constexpr (function::args_count > 0) {
@@ -765,67 +929,67 @@ private:
         constexpr bool is_thiscall = (function::convention == detail::traits::cconv::cthiscall);
         constexpr bool is_fastcall = (function::convention == detail::traits::cconv::cfastcall);
 #ifdef _WIN32
-        jump_gen->pop(eax);
+        gen.pop(eax);
         if constexpr (!std::is_void_v<Ret>) {
             constexpr bool is_fully_nontrivial = !std::is_trivial_v<Ret> || !std::is_trivially_destructible_v<Ret>;
             if constexpr (sizeof(Ret) > 8 || is_fully_nontrivial) {
                 if constexpr ((is_thiscall || is_fastcall) && (sizeof(Ret) % 2 != 0 || is_fully_nontrivial)) {
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
                     if constexpr (is_thiscall)
-                        jump_gen->push(ecx);
+                        gen.push(ecx);
                 } else {
-                    jump_gen->pop(eax);
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-                    jump_gen->push(eax);
-                    jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
+                    gen.pop(eax);
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(eax);
+                    gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
                 }
             } else {
                 if constexpr (is_thiscall) {
                     if constexpr (can_be_pushed) {
-                        jump_gen->push(ecx);
+                        gen.push(ecx);
                     }
                 }
-                jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+                gen.push(reinterpret_cast<std::uintptr_t>(this));
             }
         } else {
             if constexpr (is_thiscall) {
                 if constexpr (can_be_pushed) {
-                    jump_gen->push(ecx);
+                    gen.push(ecx);
                 }
             }
-            jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+            gen.push(reinterpret_cast<std::uintptr_t>(this));
         }
 #else
-        jump_gen->pop(eax);
+        gen.pop(eax);
         // if Ret is class or union, memory for return value as first argument(hidden)
         // so we need to push our hook pointer after this hidden argument
         if constexpr (!std::is_void_v<Ret>) {
             if constexpr (std::is_class_v<Ret> || std::is_union_v<Ret> || sizeof(Ret) > 8) {
                 if constexpr (is_thiscall) {
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-                    jump_gen->push(ecx);
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(ecx);
                 } else {
-                    jump_gen->pop(eax);
-                    jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-                    jump_gen->push(eax);
-                    jump_gen->mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
+                    gen.pop(eax);
+                    gen.push(reinterpret_cast<std::uintptr_t>(this));
+                    gen.push(eax);
+                    gen.mov(eax, ptr[reinterpret_cast<std::uintptr_t>(&last_return_address)]);
                 }
 
             } else {
                 if constexpr (is_thiscall) {
                     if constexpr (can_be_pushed) {
-                        jump_gen->push(ecx);
+                        gen.push(ecx);
                     }
                 }
-                jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+                gen.push(reinterpret_cast<std::uintptr_t>(this));
             }
         } else {
             if constexpr (is_thiscall) {
                 if constexpr (can_be_pushed) {
-                    jump_gen->push(ecx);
+                    gen.push(ecx);
                 }
             }
-            jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
+            gen.push(reinterpret_cast<std::uintptr_t>(this));
         }
         static_assert(function::convention != detail::traits::cconv::cfastcall, "linux fastcall not supported");
 #endif
@@ -833,15 +997,39 @@ private:
             &detail::signal_relay_generator<kthook_signal, function::convention, Ret, Args>::relay);
         if constexpr (function::convention == detail::traits::cconv::ccdecl) {
             // call relay for restoring stack pointer after call
-            jump_gen->call(relay_ptr);
-            jump_gen->add(esp, 4);
-            jump_gen->jmp(ptr[&last_return_address]);
+            gen.call(relay_ptr);
+            gen.add(esp, 4);
+            gen.jmp(ptr[&last_return_address]);
         } else {
-            jump_gen->push(eax);
-            jump_gen->jmp(relay_ptr);
+            gen.push(eax);
+            gen.jmp(relay_ptr);
         }
-        detail::flush_intruction_cache(jump_gen->getCode(), jump_gen->getSize());
-        return jump_gen->getCode();
+        return true;
+    }
+
+    // generates the relay stub, the hooked function is left untouched
+    bool prepare_patch() {
+        if (jump_stub) return true;
+        this->hook_size = detail::detect_hook_size(info.hook_address);
+        jump_stub = detail::generate_near(
+            info.hook_address, [this](detail::stub_generator& gen) { return generate_relay_jump(gen); });
+        if (!jump_stub) return false;
+        std::memcpy(&original, jump_stub.code, sizeof(original));
+        detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
+        return true;
+    }
+
+    bool has_subscribers() const { return !before.empty() || !after.empty(); }
+
+    // while neither signal has a connection the relay stub starts with NOPs and runs straight into its
+    // trampoline copy, connecting the first slot puts the jump into the relay back
+    static void subscribers_changed(void* hook) {
+        auto this_hook = static_cast<kthook_signal*>(hook);
+        std::lock_guard lock{this_hook->subscribers_mutex};
+        if (!this_hook->installed) return;
+        detail::write_stub_head(this_hook->jump_stub,
+                                this_hook->has_subscribers() ? this_hook->original : detail::kStubFallthrough);
+        detail::flush_intruction_cache(this_hook->jump_stub.code, sizeof(this_hook->original));
     }
 
     bool patch_hook(bool enable) {
@@ -852,64 +1040,52 @@ private:
                 std::uint32_t operand;
             } patch;
 #pragma pack(pop)
-            if (!this->relay_jump) {
-                this->hook_size = detail::detect_hook_size(info.hook_address);
-                this->relay_jump = generate_relay_jump();
-
-                detail::frozen_threads threads;
-
-                if constexpr (freeze_threads)
-                    if (!detail::freeze_threads(threads))
-                        return false;
-
-                if (!set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                     detail::MemoryProt::PROTECT_RWE))
-                    return false;
+            if (!info.original_code) {
                 info.original_code = std::make_unique<unsigned char[]>(this->hook_size);
                 std::memcpy(info.original_code.get(), reinterpret_cast<void*>(info.hook_address), this->hook_size);
-                uintptr_t relative =
-                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(this->relay_jump), info.hook_address);
-                std::memcpy(&patch, reinterpret_cast<void*>(info.hook_address), sizeof(patch));
+                std::uintptr_t relative =
+                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(jump_stub.code), info.hook_address);
+                std::memcpy(&patch, info.original_code.get(), sizeof(patch));
                 if (patch.opcode != 0xE8) {
                     patch.opcode = 0xE9;
                 }
-                patch.operand = relative;
-                std::memcpy(reinterpret_cast<void*>(info.hook_address), &patch, sizeof(patch));
-                memset(reinterpret_cast<void*>(info.hook_address + sizeof(patch)), 0x90,
-                       this->hook_size - sizeof(patch));
-                if (!detail::set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                             detail::MemoryProt::PROTECT_RE))
+                patch.operand = static_cast<std::uint32_t>(relative);
+                std::array<std::uint8_t, detail::kMaxHookSize> code;
+                std::memcpy(code.data(), &patch, sizeof(patch));
+                std::memset(code.data() + sizeof(patch), 0x90, this->hook_size - sizeof(patch));
+                detail::write_stub_head(jump_stub, has_subscribers() ? original : detail::kStubFallthrough);
+                detail::relocate_frozen_threads(info.hook_address, this->hook_size, trampoline_stub.code, ip_map);
+                if (!detail::patch_code(info.hook_address, code.data(), this->hook_size, text_poke,
+                                        trampoline_stub.code)) {
+                    info.original_code.reset();
                     return false;
-
-                if constexpr (freeze_threads)
-                    if (!detail::unfreeze_threads(threads))
-                        return false;
+                }
             } else {
-                jump_gen->rewrite(0, original, 8);
+                detail::write_stub_head(jump_stub, has_subscribers() ? original : detail::kStubFallthrough);
             }
-        } else if (relay_jump) {
-            std::memcpy(reinterpret_cast<void*>(&original), relay_jump, sizeof(original));
-            jump_gen->rewrite(0, 0x9090909090909090, 8);
+        } else if (jump_stub) {
+            detail::write_stub_head(jump_stub, detail::kStubFallthrough);
         }
-        detail::flush_intruction_cache(relay_jump, jump_gen->getSize());
+        if (jump_stub) detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
         return true;
     }
 
     hook_info info;
     mutable std::uintptr_t last_return_address{0};
     std::size_t hook_size = 0;
-    std::unique_ptr<Xbyak::CodeGenerator> jump_gen{
-        std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, nullptr, &detail::default_jmp_allocator)};
-    std::unique_ptr<Xbyak::CodeGenerator> trampoline_gen{std::make_unique<Xbyak::CodeGenerator>()};
+    detail::code_block jump_stub;
+    detail::code_block trampoline_stub;
+    detail::trampoline_ip_map ip_map;
     std::uint64_t original = 0;
-    const std::uint8_t* relay_jump = nullptr;
     std::conditional_t<create_context, cpu_ctx, detail::cpu_ctx_empty> context{};
 
     bool installed = false;
+    std::mutex subscribers_mutex;
 };
 
-class kthook_naked {
-    using cb_type = std::function<void(const kthook_naked&)>;
+template <std::size_t CallbackCapacity = detail::kCallbackCapacity>
+class basic_kthook_naked {
+    using cb_type = detail::inplace_function<void(const basic_kthook_naked&), CallbackCapacity>;
 
     struct hook_info {
         std::uintptr_t hook_address;
@@ -926,13 +1102,13 @@ class kthook_naked {
         }
     };
 
-    friend std::uintptr_t detail::naked_relay<kthook_naked>(kthook_naked*);
+    friend std::uintptr_t detail::naked_relay<basic_kthook_naked>(basic_kthook_naked*, std::uintptr_t*);
 public:
-    kthook_naked()
+    basic_kthook_naked()
         : info(0, nullptr) {
     };
 
-    kthook_naked(std::uintptr_t destination, cb_type callback_, bool force_enable = true)
+    basic_kthook_naked(std::uintptr_t destination, cb_type callback_, bool force_enable = true)
         : info(destination, nullptr),
           callback(std::move(callback_)) {
         if (force_enable) {
@@ -940,29 +1116,33 @@ public:
         }
     }
 
-    kthook_naked(std::uintptr_t destination)
+    basic_kthook_naked(std::uintptr_t destination)
         : info(destination, nullptr) {
     }
 
-    kthook_naked(void* destination)
-        : kthook_naked(reinterpret_cast<std::uintptr_t>(destination)) {
+    basic_kthook_naked(void* destination)
+        : basic_kthook_naked(reinterpret_cast<std::uintptr_t>(destination)) {
     }
 
-    kthook_naked(void* destination, cb_type callback, bool force_enable = true)
-        : kthook_naked(reinterpret_cast<std::uintptr_t>(destination), callback, force_enable) {
+    basic_kthook_naked(void* destination, cb_type callback, bool force_enable = true)
+        : basic_kthook_naked(reinterpret_cast<std::uintptr_t>(destination), callback, force_enable) {
     }
 
-    ~kthook_naked() { remove(); }
+    ~basic_kthook_naked() {
+        if (!detail::release_hook_code(info.hook_address, info.original_code.get(), hook_size, jump_stub,
+                                       trampoline_stub, true))
+            remove();
+    }
 
     bool install() {
-        if (installed) return false;
-        if (info.hook_address == 0) return false;
-        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
-        if (!detail::create_trampoline(info.hook_address, trampoline_gen)) return false;
-        if (!detail::flush_intruction_cache(trampoline_gen->getCode(), trampoline_gen->getSize())) return false;
-        if (!patch_hook(true)) return false;
-        installed = true;
-        return true;
+        if (!prepare_install()) return false;
+        // only the first patch writes to the hooked function, later ones only touch the relay stub
+        bool freeze = !info.original_code;
+        detail::frozen_threads threads;
+        if (freeze && !detail::freeze_threads(threads)) return false;
+        bool applied = apply_install();
+        if (freeze) detail::unfreeze_threads(threads);
+        return applied;
     }
 
     bool remove() {
@@ -983,127 +1163,160 @@ public:
         return true;
     }
 
-    void set_cb(cb_type callback_) { callback = std::move(callback_); }
+    // while there is no callback the relay stub starts with NOPs and runs straight into its trampoline copy,
+    // so an idle hook costs one jump
+    void set_cb(cb_type callback_) {
+        bool enable = static_cast<bool>(callback_);
+        if (!enable) set_relay_enabled(false);
+        callback = std::move(callback_);
+        if (enable) set_relay_enabled(true);
+    }
 
     void set_dest(std::uintptr_t address) { info = {address, nullptr}; }
 
     void set_dest(void* address) { set_dest(reinterpret_cast<std::uintptr_t>(address)); }
 
-    std::uintptr_t& get_return_address() const { return last_return_address; }
+    std::uintptr_t& get_return_address() const { return detail::find_naked_save_area(this).return_address; }
 
-    cpu_ctx& get_context() const { return context; }
-    cpu_ctx_x87& get_x87_context() const { return context_x87; }
+    // registers of the hooked call the calling thread is in, the callback may change them
+    cpu_ctx& get_context() const { return detail::find_naked_save_area(this).context; }
+    cpu_ctx_x87& get_x87_context() const { return detail::find_naked_save_area(this).context_x87; }
 
     cb_type& get_callback() { return callback; }
 
 private:
-    const std::uint8_t* generate_relay_jump() {
-        using namespace Xbyak::util;
+    friend class transaction;
+
+    // stubs are generated here, outside of a thread freeze
+    bool prepare_install() {
+        if (installed) return false;
+        if (info.hook_address == 0) return false;
+        if (!detail::check_is_executable(reinterpret_cast<void*>(info.hook_address))) return false;
+        if (!trampoline_stub) {
+            trampoline_stub = detail::generate_near(info.hook_address, [this](detail::stub_generator& gen) {
+                return detail::create_trampoline(info.hook_address, gen, false, &ip_map);
+            });
+            if (!trampoline_stub) return false;
+        }
+        if (!detail::flush_intruction_cache(trampoline_stub.code, trampoline_stub.size)) return false;
+        return prepare_patch();
+    }
 
-        static const std::uint8_t fxsave_code[] = {0x0f, 0xae, 0x02}; // fxsave [edx]
-        static const std::uint8_t fxrstor_code[] = {0x0f, 0xae, 0x0a}; // fxrstor [edx]
+    bool apply_install() {
+        if (!patch_hook(true)) return false;
+        installed = true;
+        return true;
+    }
+
+    bool generate_relay_jump(detail::stub_generator& gen) {
+        using namespace Xbyak::util;
+        using detail::naked_save_area;
+
+        static const std::uint8_t fxsave_code[] = {0x0f, 0xae, 0x04, 0x24}; // fxsave [esp]
+        static const std::uint8_t fxrstor_code[] = {0x0f, 0xae, 0x0c, 0x24}; // fxrstor [esp]
+        constexpr auto context = naked_save_area::kContextOffset;
+        constexpr std::array<std::pair<std::size_t, Xbyak::Reg32>, 6> saved_registers{{
+            {offsetof(cpu_ctx, ebx), ebx},
+            {offsetof(cpu_ctx, ecx), ecx},
+            {offsetof(cpu_ctx, edx), edx},
+            {offsetof(cpu_ctx, ebp), ebp},
+            {offsetof(cpu_ctx, esi), esi},
+            {offsetof(cpu_ctx, edi), edi},
+        }};
 
         auto hook_address = info.hook_address;
 
-        Xbyak::Label UserCode, ret_addr, jump_in_trampoline, skip_bytes, jump_out;
+        Xbyak::Label UserCode, skip_bytes, jump_out;
         // this jump gets nopped when hook.remove() is called
-        jump_gen->jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
-        jump_gen->nop(3);
+        gen.jmp(UserCode, Xbyak::CodeGenerator::LabelType::T_NEAR);
+        gen.nop(3);
 
         // create trampoline
-        detail::create_trampoline(hook_address, jump_gen);
-        jump_gen->L(UserCode);
-
-        jump_gen->pushfd();
-
-        jump_gen->mov(ptr[&last_return_address], esp);
-
-        // &context.end -> esp
-        // pushad -> context.registers
-        // memory.esp -> esp
-        // esp -> context.esp
-        // &label ret_addr  -> eax
-        // info.hook_address -> last_return_address
-        jump_gen->mov(esp, reinterpret_cast<std::uintptr_t>(&context.flags));
-        jump_gen->pushad();
-        jump_gen->mov(esp, ptr[&last_return_address]);
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.flags)], esp);
-        jump_gen->add(esp, sizeof(cpu_ctx::eflags));
-        jump_gen->mov(ptr[reinterpret_cast<std::uintptr_t>(&context.esp)], esp);
-        jump_gen->sub(esp, sizeof(cpu_ctx::eflags));
-        jump_gen->mov(eax, ret_addr);
-
-        jump_gen->mov(dword[reinterpret_cast<std::uintptr_t>(&last_return_address)], info.hook_address);
-
-        // push this
-        // push eax(&label ret_addr)
-        jump_gen->push(reinterpret_cast<std::uintptr_t>(this));
-        jump_gen->push(eax);
+        if (!detail::create_trampoline(hook_address, gen)) return false;
+        gen.L(UserCode);
+
+        // [eax] == eax, [eax + 0x04] == eflags, the save area goes below them
+        gen.pushfd();
+        gen.push(eax);
+        gen.mov(eax, esp);
+        gen.sub(esp, static_cast<std::uint32_t>(sizeof(naked_save_area) + 2 * sizeof(std::uintptr_t)));
+        gen.and_(esp, -16);
+
+        for (auto& [field, reg] : saved_registers) gen.mov(ptr[esp + context + field], reg);
+        gen.mov(ebx, ptr[eax]);
+        gen.mov(ptr[esp + context + offsetof(cpu_ctx, eax)], ebx);
+        gen.mov(ebx, ptr[eax + sizeof(std::uintptr_t)]);
+        gen.mov(ptr[esp + naked_save_area::kFlagsOffset], ebx);
+        gen.lea(ebx, ptr[esp + naked_save_area::kFlagsOffset]);
+        gen.mov(ptr[esp + context + offsetof(cpu_ctx, flags)], ebx);
+        gen.lea(ebx, ptr[eax + 2 * sizeof(std::uintptr_t)]);
+        gen.mov(ptr[esp + context + offsetof(cpu_ctx, esp)], ebx);
+        gen.mov(dword[esp + naked_save_area::kReturnAddressOffset], hook_address);
 
         // saving x87 registers
-        jump_gen->mov(edx, reinterpret_cast<std::uintptr_t>(&context_x87));
-        jump_gen->db(fxsave_code, sizeof(fxsave_code));
-
-        // GOTO callback(call)
-        jump_gen->jmp(reinterpret_cast<const void*>(&detail::naked_relay<kthook_naked>));
-        jump_gen->L(ret_addr);
+        gen.db(fxsave_code, sizeof(fxsave_code));
+
+        // ebx keeps the save area across the call, the arguments keep esp 16-byte aligned at it
+        gen.mov(ebx, esp);
+        gen.lea(eax, ptr[esp + naked_save_area::kReturnAddressOffset]);
+        gen.sub(esp, 2 * sizeof(std::uintptr_t));
+        gen.push(eax);
+        gen.push(reinterpret_cast<std::uintptr_t>(this));
+        gen.call(reinterpret_cast<const void*>(&detail::naked_relay<basic_kthook_naked>));
+        gen.mov(esp, ebx);
+
+        // the relay returns how far into the trampoline copy to continue, or ~0 to go to return_address
+        gen.cmp(eax, ~0u);
+        gen.je(jump_out);
+        gen.cmp(eax, hook_size);
+        gen.jae(jump_out);
+        gen.mov(ecx, skip_bytes);
+        gen.add(ecx, eax);
+        gen.mov(ptr[esp + naked_save_area::kReturnAddressOffset], ecx);
+
+        gen.L(jump_out);
+        // [eax] == eax, [eax + 0x04] == eflags, [eax + 0x08] == return_address, ret leaves esp at context.esp
+        gen.mov(eax, ptr[esp + context + offsetof(cpu_ctx, esp)]);
+        gen.sub(eax, 3 * sizeof(std::uintptr_t));
+        gen.mov(ecx, ptr[esp + context + offsetof(cpu_ctx, eax)]);
+        gen.mov(ptr[eax], ecx);
+        gen.mov(ecx, ptr[esp + context + offsetof(cpu_ctx, flags)]);
+        gen.mov(ecx, ptr[ecx]);
+        gen.mov(ptr[eax + sizeof(std::uintptr_t)], ecx);
+        gen.mov(ecx, ptr[esp + naked_save_area::kReturnAddressOffset]);
+        gen.mov(ptr[eax + 2 * sizeof(std::uintptr_t)], ecx);
 
         // restoring x87 registers
-        jump_gen->mov(edx, reinterpret_cast<std::uintptr_t>(&context_x87));
-        jump_gen->db(fxrstor_code, sizeof(fxrstor_code));
-
-        // restore stack
-        jump_gen->add(esp, 0x04);
-
-        // if need to skip trampoline
-        jump_gen->cmp(eax, ~0u);
-        jump_gen->je(jump_out);
-
-        // if need to jump inside trampoline
-        jump_gen->cmp(eax, hook_size);
-        jump_gen->jl(jump_in_trampoline);
-
-        jump_gen->L(jump_out);
-
-        // esp -> &context.top
-        // context.registers -> popad
-        // context.esp -> esp
-        // stack -> popfd
-        // goto RETURN_ADDR
-        jump_gen->mov(esp, reinterpret_cast<std::uintptr_t>(&context.edi));
-        jump_gen->popad();
-        jump_gen->mov(esp, ptr[reinterpret_cast<std::uintptr_t>(&context.esp)]);
-        jump_gen->sub(esp, sizeof(cpu_ctx::eflags));
-        jump_gen->popfd();
-        jump_gen->jmp(ptr[&last_return_address]);
-
-        jump_gen->L(jump_in_trampoline);
-        // eax -> esp
-        // &label skip_bytes -> eax
-        // eax += esp
-        // so eax is address inside trampoline
-        jump_gen->mov(esp, eax);
-        jump_gen->mov(eax, skip_bytes);
-        jump_gen->add(eax, esp);
-
-        // eax -> RETURN_ADDR
-        // esp -> &context.top
-        // popad
-        // context.esp -> esp
-        // stack -> popfd
-        // goto RETURN_ADDR
-        jump_gen->mov(dword[reinterpret_cast<std::uintptr_t>(&last_return_address)], eax);
-        jump_gen->mov(esp, reinterpret_cast<std::uintptr_t>(&context.edi));
-        jump_gen->popad();
-        jump_gen->mov(esp, ptr[reinterpret_cast<std::uintptr_t>(&context.esp)]);
-        jump_gen->sub(esp, sizeof(cpu_ctx::eflags));
-        jump_gen->popfd();
-        jump_gen->jmp(ptr[&last_return_address]);
-        jump_gen->L(skip_bytes);
-        detail::create_trampoline(info.hook_address, jump_gen);
-
-        detail::flush_intruction_cache(jump_gen->getCode(), jump_gen->getSize());
-        return jump_gen->getCode();
+        gen.db(fxrstor_code, sizeof(fxrstor_code));
+        for (auto& [field, reg] : saved_registers) gen.mov(reg, ptr[esp + context + field]);
+
+        gen.mov(esp, eax);
+        gen.pop(eax);
+        gen.popfd();
+        gen.ret();
+
+        gen.L(skip_bytes);
+        if (!detail::create_trampoline(info.hook_address, gen)) return false;
+
+        return true;
+    }
+
+    // generates the relay stub, the hooked function is left untouched
+    bool prepare_patch() {
+        if (jump_stub) return true;
+        this->hook_size = detail::detect_hook_size(info.hook_address);
+        jump_stub = detail::generate_near(
+            info.hook_address, [this](detail::stub_generator& gen) { return generate_relay_jump(gen); });
+        if (!jump_stub) return false;
+        std::memcpy(&original, jump_stub.code, sizeof(original));
+        detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
+        return true;
+    }
+
+    void set_relay_enabled(bool enable) {
+        if (!installed) return;
+        detail::write_stub_head(jump_stub, enable ? original : detail::kStubFallthrough);
+        detail::flush_intruction_cache(jump_stub.code, sizeof(original));
     }
 
     bool patch_hook(bool enable) {
@@ -1114,44 +1327,33 @@ private:
                 std::uint32_t operand;
             } patch;
 #pragma pack(pop)
-            if (!this->relay_jump) {
-                this->hook_size = detail::detect_hook_size(info.hook_address);
-                this->relay_jump = generate_relay_jump();
-
-                detail::frozen_threads threads;
-
-                if (!detail::freeze_threads(threads))
-                    return false;
-
-                if (!set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                     detail::MemoryProt::PROTECT_RWE))
-                    return false;
+            if (!info.original_code) {
                 info.original_code = std::make_unique<unsigned char[]>(this->hook_size);
                 std::memcpy(info.original_code.get(), reinterpret_cast<void*>(info.hook_address), this->hook_size);
-                uintptr_t relative =
-                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(this->relay_jump), info.hook_address);
-                std::memcpy(&patch, reinterpret_cast<void*>(info.hook_address), sizeof(patch));
+                std::uintptr_t relative =
+                    detail::get_relative_address(reinterpret_cast<std::uintptr_t>(jump_stub.code), info.hook_address);
+                std::memcpy(&patch, info.original_code.get(), sizeof(patch));
                 if (patch.opcode != 0xE8) {
                     patch.opcode = 0xE9;
                 }
-                patch.operand = relative;
-                std::memcpy(reinterpret_cast<void*>(info.hook_address), &patch, sizeof(patch));
-                memset(reinterpret_cast<void*>(info.hook_address + sizeof(patch)), 0x90,
-                       this->hook_size - sizeof(patch));
-                if (!detail::set_memory_prot(reinterpret_cast<void*>(info.hook_address), this->hook_size,
-                                             detail::MemoryProt::PROTECT_RE))
-                    return false;
-
-                if (!detail::unfreeze_threads(threads))
+                patch.operand = static_cast<std::uint32_t>(relative);
+                std::array<std::uint8_t, detail::kMaxHookSize> code;
+                std::memcpy(code.data(), &patch, sizeof(patch));
+                std::memset(code.data() + sizeof(patch), 0x90, this->hook_size - sizeof(patch));
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
+                detail::relocate_frozen_threads(info.hook_address, this->hook_size, trampoline_stub.code, ip_map);
+                if (!detail::patch_code(info.hook_address, code.data(), this->hook_size, false,
+                                        trampoline_stub.code)) {
+                    info.original_code.reset();
                     return false;
+                }
             } else {
-                jump_gen->rewrite(0, original, 8);
+                detail::write_stub_head(jump_stub, callback ? original : detail::kStubFallthrough);
             }
-        } else if (relay_jump) {
-            std::memcpy(reinterpret_cast<void*>(&original), relay_jump, sizeof(original));
-            jump_gen->rewrite(0, 0x9090909090909090, 8);
+        } else if (jump_stub) {
+            detail::write_stub_head(jump_stub, detail::kStubFallthrough);
         }
-        detail::flush_intruction_cache(relay_jump, jump_gen->getSize());
+        if (jump_stub) detail::flush_intruction_cache(jump_stub.code, jump_stub.size);
         return true;
     }
 
@@ -1160,18 +1362,15 @@ private:
     std::size_t hook_size{0};
     std::uint64_t original{0};
 
-    mutable std::uintptr_t last_return_address{0};
-    mutable cpu_ctx context{};
-    mutable cpu_ctx_x87 context_x87{};
-
-    std::unique_ptr<Xbyak::CodeGenerator> jump_gen{
-        std::make_unique<Xbyak::CodeGenerator>(Xbyak::DEFAULT_MAX_CODE_SIZE, nullptr, &detail::default_jmp_allocator)};
-    std::unique_ptr<Xbyak::CodeGenerator> trampoline_gen{std::make_unique<Xbyak::CodeGenerator>()};
+    detail::code_block jump_stub;
+    detail::code_block trampoline_stub;
+    detail::trampoline_ip_map ip_map;
 
-    const std::uint8_t* relay_jump{nullptr};
 
     bool installed = false;
 };
+
+using kthook_naked = basic_kthook_naked<>;
 } // namespace kthook
 
 #endif  // KTHOOK_IMPL_HPP_
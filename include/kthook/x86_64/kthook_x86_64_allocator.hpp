@@ -0,0 +1,504 @@
+#ifndef KTHOOK_ALLOCATOR_X86_64_HPP_
+#define KTHOOK_ALLOCATOR_X86_64_HPP_
+
+namespace kthook {
+struct code_memory_stats {
+    std::size_t regions = 0;     // near regions reserved from the OS
+    std::size_t pages = 0;       // pages carved into slots
+    std::size_t slots = 0;       // live relay stubs and trampolines
+    std::size_t retired = 0;     // slots of destroyed hooks waiting to be reclaimed
+    std::size_t data_slots = 0;  // stub data slots of live and retired hooks, see alloc_data
+    std::size_t used_bytes = 0;  // bytes occupied by live and retired slots
+    double fill_ratio = 0.0;     // used_bytes / carved page bytes
+};
+
+namespace detail {
+struct code_block {
+    std::uint8_t* code = nullptr;   // where the code runs
+    std::uint8_t* write = nullptr;  // where the code is written, see alloc_code_region
+    std::size_t size = 0;
+
+    explicit operator bool() const { return code != nullptr; }
+};
+
+// Process-wide slab allocator for generated code.
+// Regions of kRegionSize (kHugePageSize with set_huge_code_pages) are reserved near the hooked code
+// (see alloc_code_region), every page of a region is carved into equally sized slots of one power-of-two
+// size class, so hundreds of small relay stubs and trampolines share a handful of pages instead of taking a page each.
+//
+// Code of destroyed hooks is retired first and only reclaimed by collect(): other threads are stopped and
+// a retired slot is freed only if no instruction pointer, register or stack holds an address inside it or inside
+// its data slot. Where threads can't be stopped (anything but Windows and Linux) nothing is ever reclaimed.
+// Pages whose slots are all free go back to their region, regions whose pages are all free are unmapped.
+//
+// alloc_data hands out slots of pages that are switched to read-write: per-hook data the stubs address
+// RIP-relative, kept off the code pages so stores to it never hit a page the CPU is executing from.
+class code_allocator {
+public:
+    static constexpr std::size_t kMinSlotShift = 5;  // 32 bytes
+    static constexpr std::size_t kSizeClassCount = 8;  // 32 .. 4096 bytes
+    static constexpr std::size_t kRegionSize = 0x10000;
+    static constexpr std::size_t kCollectThreshold = 32;
+
+    static code_allocator& instance() {
+        static code_allocator allocator;
+        return allocator;
+    }
+
+    code_block alloc(std::uintptr_t near_address, std::size_t size) { return alloc_slot(near_address, size, false); }
+
+    // code is the read-write address near near_address, retire it together with the stub using it
+    code_block alloc_data(std::uintptr_t near_address, std::size_t size) {
+        return alloc_slot(near_address, size, true);
+    }
+
+    // immediately reuses the slot, only for code that was never reachable
+    void free(const void* code) {
+        std::lock_guard lock{mutex};
+        free_locked(reinterpret_cast<std::uintptr_t>(code));
+    }
+
+    // hands the slot over to the next collect(), size is the length of the code in it,
+    // data is a slot of alloc_data only the code uses, it is freed together with the code.
+    // collect lets this call run collect() once kCollectThreshold slots are retired, which stops every other
+    // thread while the allocator is locked, so only callers that freeze anyway pass it
+    void retire(const void* code, std::size_t size, const void* data = nullptr, bool collect = false) {
+        std::lock_guard lock{mutex};
+        retired.push_back({reinterpret_cast<std::uint8_t*>(const_cast<void*>(code)), size,
+                           reinterpret_cast<std::uint8_t*>(const_cast<void*>(data))});
+        if (collect && retired.size() >= kCollectThreshold) collect_locked();
+    }
+
+    // returns the number of reclaimed slots
+    std::size_t collect() {
+        std::lock_guard lock{mutex};
+        return collect_locked();
+    }
+
+    code_memory_stats stats() const {
+        std::lock_guard lock{mutex};
+        code_memory_stats result;
+        result.regions = regions.size();
+        result.pages = carved_pages;
+        result.slots = live_slots - live_data_slots - retired.size();
+        result.retired = retired.size();
+        result.data_slots = live_data_slots;
+        result.used_bytes = used_bytes;
+        if (carved_pages != 0) {
+            result.fill_ratio = static_cast<double>(used_bytes) / static_cast<double>(carved_pages * page_size);
+        }
+        return result;
+    }
+
+private:
+    static constexpr std::uint8_t kUnusedPage = 0xFF;
+    static constexpr std::uint8_t kInt3 = 0xCC;
+
+    struct page {
+        std::uint8_t size_class = kUnusedPage;
+        bool data = false;
+        std::uint16_t used = 0;
+        std::vector<std::uint16_t> free_slots;
+    };
+
+    struct region {
+        std::uintptr_t base = 0;
+        std::uintptr_t write_base = 0;
+        std::size_t size = 0;
+        std::size_t carved = 0;
+        std::vector<page> pages;
+        std::vector<std::size_t> free_pages;
+        std::array<std::vector<std::size_t>, kSizeClassCount> partial;
+        std::array<std::vector<std::size_t>, kSizeClassCount> data_partial;
+    };
+
+    struct retired_block {
+        std::uint8_t* code;
+        std::size_t size;
+        std::uint8_t* data;
+    };
+
+    code_allocator()
+        : page_size(Xbyak::inner::getPageSize()) {
+    }
+
+    code_block alloc_slot(std::uintptr_t near_address, std::size_t size, bool data) {
+        auto size_class = get_size_class(size);
+        if (size_class >= kSizeClassCount) return {};
+        std::lock_guard lock{mutex};
+
+        std::uintptr_t from = near_address > kMaxMemoryRange ? near_address - kMaxMemoryRange : 0;
+        for (auto it = regions.lower_bound(from); it != regions.end(); ++it) {
+            if (!is_in_near_range(near_address, it->first) ||
+                !is_in_near_range(near_address, it->first + it->second.size)) {
+                if (it->first > near_address) break;
+                continue;
+            }
+            if (auto block = alloc_in_region(it->second, size_class, data)) return block;
+        }
+
+        std::size_t region_size = get_region_size();
+        auto memory = alloc_code_region(near_address, region_size);
+        if (memory.exec == nullptr) return {};
+        auto base = reinterpret_cast<std::uintptr_t>(memory.exec);
+        auto& new_region = regions[base];
+        new_region.base = base;
+        new_region.write_base = reinterpret_cast<std::uintptr_t>(memory.write);
+        new_region.size = region_size;
+        new_region.pages.resize(region_size / page_size);
+        return alloc_in_region(new_region, size_class, data);
+    }
+
+    static std::size_t get_region_size() {
+#if defined(KTHOOK_64_GCC) && defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (huge_code_pages.load(std::memory_order_relaxed)) return kHugePageSize;
+#endif
+        return kRegionSize;
+    }
+
+    static std::size_t get_size_class(std::size_t size) {
+        std::size_t size_class = 0;
+        while ((std::size_t{1} << (size_class + kMinSlotShift)) < size) ++size_class;
+        return size_class;
+    }
+
+    static std::size_t get_slot_size(std::size_t size_class) { return std::size_t{1} << (size_class + kMinSlotShift); }
+
+    code_block alloc_in_region(region& r, std::size_t size_class, bool data) {
+        auto slot_size = get_slot_size(size_class);
+        auto& partial = data ? r.data_partial[size_class] : r.partial[size_class];
+        std::size_t page_idx;
+        std::uint16_t slot;
+        if (!partial.empty()) {
+            page_idx = partial.back();
+            auto& p = r.pages[page_idx];
+            slot = p.free_slots.back();
+            p.free_slots.pop_back();
+            ++p.used;
+            if (p.free_slots.empty()) partial.pop_back();
+        } else if ((!r.free_pages.empty() || r.carved < r.pages.size()) && slot_size <= page_size) {
+            page_idx = r.free_pages.empty() ? r.carved : r.free_pages.back();
+            if (data && !set_memory_prot(reinterpret_cast<void*>(r.base + page_idx * page_size), page_size,
+                                         MemoryProt::PROTECT_RW))
+                return {};
+            if (!r.free_pages.empty())
+                r.free_pages.pop_back();
+            else
+                ++r.carved;
+            ++carved_pages;
+            auto& p = r.pages[page_idx];
+            auto slot_count = static_cast<std::uint16_t>(page_size / slot_size);
+            p.size_class = static_cast<std::uint8_t>(size_class);
+            p.data = data;
+            p.used = 1;
+            // lowest slots are handed out first
+            for (std::uint16_t i = slot_count; i > 1; --i) p.free_slots.push_back(i - 1);
+            if (!p.free_slots.empty()) partial.push_back(page_idx);
+            slot = 0;
+        } else {
+            return {};
+        }
+        ++live_slots;
+        if (data) ++live_data_slots;
+        used_bytes += slot_size;
+        auto offset = page_idx * page_size + slot * slot_size;
+        return {reinterpret_cast<std::uint8_t*>(r.base + offset), reinterpret_cast<std::uint8_t*>(r.write_base + offset),
+                slot_size};
+    }
+
+    void free_locked(std::uintptr_t address) {
+        auto it = regions.upper_bound(address);
+        if (it == regions.begin()) return;
+        --it;
+        auto& r = it->second;
+        if (address >= r.base + r.size) return;
+
+        auto page_idx = (address - r.base) / page_size;
+        auto& p = r.pages[page_idx];
+        if (p.size_class == kUnusedPage) return;
+        auto slot_size = get_slot_size(p.size_class);
+        auto slot = static_cast<std::uint16_t>((address - r.base - page_idx * page_size) / slot_size);
+
+        // anything still jumping here traps instead of running stale code
+        std::memset(reinterpret_cast<void*>(r.write_base + page_idx * page_size + slot * slot_size), kInt3, slot_size);
+
+        auto& partial = p.data ? r.data_partial[p.size_class] : r.partial[p.size_class];
+        if (p.free_slots.empty()) partial.push_back(page_idx);
+        p.free_slots.push_back(slot);
+        --p.used;
+        --live_slots;
+        if (p.data) --live_data_slots;
+        used_bytes -= slot_size;
+        if (p.used != 0) return;
+
+        partial.erase(std::find(partial.begin(), partial.end(), page_idx));
+        // the page may be carved into code slots next
+        if (p.data) {
+            set_memory_prot(reinterpret_cast<void*>(r.base + page_idx * page_size), page_size,
+                            r.base == r.write_base ? MemoryProt::PROTECT_RWE : MemoryProt::PROTECT_RE);
+        }
+        p = page{};
+        r.free_pages.push_back(page_idx);
+        --carved_pages;
+        if (r.free_pages.size() == r.carved) {
+            free_code_region({reinterpret_cast<std::uint8_t*>(r.base), reinterpret_cast<std::uint8_t*>(r.write_base)},
+                             r.size);
+            regions.erase(it);
+        }
+    }
+
+#ifndef _WIN32
+    using stack_maps = std::vector<map_info>;
+#else
+    struct stack_maps {};
+#endif
+
+    // end of the stack sp points into, 0 if it can't be read
+    static std::uintptr_t get_stack_end(std::uintptr_t sp, const stack_maps& maps) {
+#ifdef _WIN32
+        MEMORY_BASIC_INFORMATION mbi;
+        if (VirtualQuery(reinterpret_cast<void*>(sp), &mbi, sizeof(mbi)) == 0) return 0;
+        if (mbi.State != MEM_COMMIT || (mbi.Protect & (PAGE_READWRITE | PAGE_EXECUTE_READWRITE)) == 0) return 0;
+        return reinterpret_cast<std::uintptr_t>(mbi.BaseAddress) + mbi.RegionSize;
+#else
+        auto it = std::upper_bound(maps.begin(), maps.end(), sp,
+                                   [](std::uintptr_t value, const map_info& mi) { return value < mi.start; });
+        if (it == maps.begin()) return 0;
+        --it;
+        if (sp >= it->end || !(it->prot & PROT_READ)) return 0;
+        return it->end;
+#endif
+    }
+
+    // code or data slot of the retired block index
+    struct retired_range {
+        std::uintptr_t start;
+        std::uintptr_t end;
+        std::size_t index;
+    };
+
+    // size of the slot address was handed out from
+    std::size_t get_slot_size_at(std::uintptr_t address) const {
+        auto it = regions.upper_bound(address);
+        if (it == regions.begin()) return 0;
+        --it;
+        auto& r = it->second;
+        if (address >= r.base + r.size) return 0;
+        auto& p = r.pages[(address - r.base) / page_size];
+        return p.size_class == kUnusedPage ? 0 : get_slot_size(p.size_class);
+    }
+
+    // ranges is sorted, marks the block whose code or data contains address
+    static void pin(std::uintptr_t address, const std::vector<retired_range>& ranges, std::vector<bool>& pinned) {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), address,
+                                   [](std::uintptr_t value, const auto& range) { return value < range.start; });
+        if (it == ranges.begin()) return;
+        --it;
+        if (address < it->end) pinned[it->index] = true;
+    }
+
+    static bool scan_stack(std::uintptr_t sp, const stack_maps& maps, const std::vector<retired_range>& ranges,
+                           std::vector<bool>& pinned) {
+        auto end = get_stack_end(sp, maps);
+        if (end == 0) return false;
+#ifdef KTHOOK_64_GCC
+        // leaf functions may keep data in the red zone below rsp
+        if (get_stack_end(sp - 128, maps) == end) sp -= 128;
+#endif
+        sp -= sp % sizeof(std::uintptr_t);
+        auto low = ranges.front().start;
+        auto high = ranges.back().end;
+        for (auto it = reinterpret_cast<const std::uintptr_t*>(sp); it < reinterpret_cast<const std::uintptr_t*>(end);
+             ++it) {
+            if (low <= *it && *it < high) pin(*it, ranges, pinned);
+        }
+        return true;
+    }
+
+    std::size_t collect_locked() {
+        if (retired.empty()) return 0;
+        std::vector<retired_range> ranges;
+        for (std::size_t i = 0; i < retired.size(); ++i) {
+            auto code = reinterpret_cast<std::uintptr_t>(retired[i].code);
+            ranges.push_back({code, code + retired[i].size, i});
+            // stubs keep their data slot's address in registers too, r11 in the shared relay stubs
+            if (auto data = reinterpret_cast<std::uintptr_t>(retired[i].data))
+                ranges.push_back({data, data + get_slot_size_at(data), i});
+        }
+        std::sort(ranges.begin(), ranges.end(), [](const auto& lhs, const auto& rhs) { return lhs.start < rhs.start; });
+        std::vector<bool> pinned(retired.size());
+
+        stack_maps maps;
+#ifndef _WIN32
+        // read before the freeze: stopped threads may hold locks that parsing needs
+        maps = parse_proc_maps();
+        std::sort(maps.begin(), maps.end(), [](const auto& lhs, const auto& rhs) { return lhs.start < rhs.start; });
+#endif
+        frozen_threads threads;
+        if (!freeze_threads(threads)) return 0;
+        bool proven = threads.all_stopped;
+        if (proven) {
+            for (auto& state : threads.states) {
+                if (!state.captured) continue;
+                pin(state.ip, ranges, pinned);
+                for (auto value : state.registers) pin(value, ranges, pinned);
+                if (!scan_stack(state.sp, maps, ranges, pinned)) proven = false;
+            }
+            // the hook may have been destroyed from a callback running on this very thread
+            volatile std::uintptr_t self_sp = 0;
+            if (!scan_stack(reinterpret_cast<std::uintptr_t>(&self_sp), maps, ranges, pinned)) proven = false;
+        }
+        unfreeze_threads(threads);
+        if (!proven) return 0;
+
+        std::size_t reclaimed = 0;
+        std::vector<retired_block> still_retired;
+        for (std::size_t i = 0; i < retired.size(); ++i) {
+            if (pinned[i]) {
+                still_retired.push_back(retired[i]);
+            } else {
+                free_locked(reinterpret_cast<std::uintptr_t>(retired[i].code));
+                if (retired[i].data) free_locked(reinterpret_cast<std::uintptr_t>(retired[i].data));
+                ++reclaimed;
+            }
+        }
+        retired = std::move(still_retired);
+        return reclaimed;
+    }
+
+    std::map<std::uintptr_t, region> regions;
+    std::vector<retired_block> retired;
+    std::size_t page_size;
+    std::size_t carved_pages = 0;
+    std::size_t live_slots = 0;
+    std::size_t live_data_slots = 0;
+    std::size_t used_bytes = 0;
+    mutable std::mutex mutex;
+};
+
+// Writes through the writable view of a slot while the code is addressed as the executable view it runs from.
+// Anything depending on the code address (RIP-relative fixups, labels) must go through get_exec_*,
+// absolute label addresses (mov reg, label) would point at the writable view, use lea reg, [rip + label] instead.
+class stub_generator : public Xbyak::CodeGenerator {
+public:
+    stub_generator(std::size_t size, std::uint8_t* write, const std::uint8_t* exec, bool measuring = false)
+        : Xbyak::CodeGenerator(size, write),
+          exec(exec),
+          measuring(measuring) {
+    }
+
+    const std::uint8_t* get_exec_code() const { return exec; }
+
+    std::uintptr_t get_exec_curr() const { return reinterpret_cast<std::uintptr_t>(exec) + getSize(); }
+
+    // the code is only emitted to learn its size, it won't run from here
+    bool is_measuring() const { return measuring; }
+
+private:
+    const std::uint8_t* exec;
+    bool measuring;
+};
+
+// Emits code twice: into a scratch buffer to learn its size, then into a slot of the matching size class
+// near near_address. Generate must not produce longer code in the slot than in the measuring pass.
+// The generator is dropped afterwards, hooks only keep the returned block (size is the length of the code).
+template <typename Generate>
+inline code_block generate_near(std::uintptr_t near_address, Generate&& generate) {
+    std::size_t size;
+    {
+        auto scratch = std::make_unique<std::uint8_t[]>(Xbyak::DEFAULT_MAX_CODE_SIZE);
+        stub_generator gen{Xbyak::DEFAULT_MAX_CODE_SIZE, scratch.get(), scratch.get(), true};
+        if (!generate(gen)) return {};
+        size = gen.getSize();
+    }
+    auto& allocator = code_allocator::instance();
+    auto block = allocator.alloc(near_address, size);
+    if (!block) return {};
+    stub_generator gen{block.size, block.write, block.code};
+    if (!generate(gen)) {
+        allocator.free(block.code);
+        return {};
+    }
+    block.size = gen.getSize();
+    return block;
+}
+
+// Head of a disabled relay stub: NOPs falling through to the trampoline copy that follows them
+constexpr std::uint64_t kStubFallthrough = 0x9090909090909090;
+
+// Enables or disables a relay stub by replacing its first 8 bytes with a single store through the writable view,
+// slots are at least 32 byte aligned so it is never torn.
+inline void write_stub_head(const code_block& stub, std::uint64_t value) {
+#ifdef _MSC_VER
+    InterlockedExchange64(reinterpret_cast<volatile LONG64*>(stub.write), static_cast<LONG64>(value));
+#else
+    __atomic_store_n(reinterpret_cast<std::uint64_t*>(stub.write), value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Used by hook destructors. Puts the original bytes back if the target still jumps into the relay stub
+// and retires the stub and the trampoline. Returns false if another hook was installed on top of ours:
+// its trampoline jumps into our stub, so the stub has to stay. jump_data is the stub's alloc_data slot, if any.
+// Only hooks that freeze (kFreezeThreads) collect retired code on their own.
+inline bool release_hook_code(std::uintptr_t hook_address, const unsigned char* original_code, std::size_t hook_size,
+                              code_block& jump_stub, code_block& trampoline_stub, bool freeze,
+                              code_block* jump_data = nullptr) {
+    // the hook object may live on a stack collect() scans, the stores must survive dead store elimination
+    auto forget = [](code_block& block) {
+        std::uint8_t* volatile* code = &block.code;
+        std::uint8_t* volatile* write = &block.write;
+        *code = nullptr;
+        *write = nullptr;
+        block.size = 0;
+    };
+    auto& allocator = code_allocator::instance();
+    if (jump_stub) {
+        auto target = reinterpret_cast<std::uint8_t*>(hook_address);
+        std::uint32_t operand;
+        std::memcpy(&operand, target + 1, sizeof(operand));
+        if ((target[0] != 0xE9 && target[0] != 0xE8) || original_code == nullptr ||
+            restore_absolute_address(hook_address, operand) != reinterpret_cast<std::uintptr_t>(jump_stub.code))
+            return false;
+
+        frozen_threads threads;
+        if (freeze && !freeze_threads(threads)) return false;
+        bool restored = set_memory_prot(target, hook_size, MemoryProt::PROTECT_RWE);
+        if (restored) {
+            std::memcpy(target, original_code, hook_size);
+            restored = set_memory_prot(target, hook_size, MemoryProt::PROTECT_RE);
+        }
+        if (freeze) unfreeze_threads(threads);
+        if (!restored) return false;
+        flush_intruction_cache(target, hook_size);
+
+        allocator.retire(jump_stub.code, jump_stub.size, jump_data ? jump_data->code : nullptr, freeze);
+        forget(jump_stub);
+        if (jump_data) forget(*jump_data);
+    } else if (jump_data && *jump_data) {
+        // the stub was never generated, nothing can have used the data
+        allocator.free(jump_data->code);
+        forget(*jump_data);
+    }
+    if (trampoline_stub) {
+        allocator.retire(trampoline_stub.code, trampoline_stub.size, nullptr, freeze);
+        forget(trampoline_stub);
+    }
+    return true;
+}
+} // namespace detail
+
+inline code_memory_stats get_code_memory_stats() { return detail::code_allocator::instance().stats(); }
+
+// Reclaims the code of destroyed hooks that no thread can still be running, returns the number of freed slots.
+// Stops every other thread while it scans them. Hooks with kFreezeThreads run it on their own every
+// code_allocator::kCollectThreshold retired stubs, code of other hooks waits for an explicit call.
+// Reclaims nothing where threads can't be stopped, anywhere but Windows and Linux.
+inline std::size_t collect_code_memory() { return detail::code_allocator::instance().collect(); }
+
+// Linux x64 only: code regions allocated from now on are 2mb, aligned and advised MADV_HUGEPAGE,
+// so all stubs of a module can sit behind a single iTLB entry. Costs 2mb of address space per region.
+// Does nothing on other platforms, regions keep their default size there.
+inline void set_huge_code_pages(bool enable) { detail::huge_code_pages.store(enable, std::memory_order_relaxed); }
+} // namespace kthook
+
+#endif  // KTHOOK_ALLOCATOR_X86_64_HPP_
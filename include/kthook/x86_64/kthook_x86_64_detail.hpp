@@ -9,12 +9,25 @@
 
 namespace kthook {
 
+// Stop-the-world bookkeeping, see kFreezeThreads
+struct freeze_stats {
+    std::size_t freezes = 0;
+    std::size_t timeouts = 0;   // freezes that failed because some thread did not stop within the timeout
+    std::size_t relocated = 0;  // threads moved off overwritten instructions into a trampoline
+    std::chrono::nanoseconds last_latency{0};  // from the first stop request until every thread stopped
+    std::chrono::nanoseconds max_latency{0};
+    std::chrono::nanoseconds total_latency{0};
+};
+
 template <std::size_t N>
 struct take {
     static constexpr auto size = N;
     using kthook_take_tag = void;
 };
 
+template <typename Signature>
+class hook_signal;
+
 namespace detail {
 #ifdef KTHOOK_32
 using hde = hde32s;
@@ -75,12 +88,12 @@ struct on_after_type;
 
 template <class HookT, class T, typename... Ts>
 struct on_after_type<HookT, T, std::tuple<Ts...>, typename std::enable_if<std::is_void_v<T>>::type> {
-    using type = ktsignal::ktsignal_threadsafe<void(const HookT&, std::add_lvalue_reference_t<Ts> ...)>;
+    using type = hook_signal<void(const HookT&, std::add_lvalue_reference_t<Ts> ...)>;
 };
 
 template <class HookT, class T, typename... Ts>
 struct on_after_type<HookT, T, std::tuple<Ts...>, typename std::enable_if<!std::is_void_v<T>>::type> {
-    using type = ktsignal::ktsignal_threadsafe<void(const HookT&, T&, std::add_lvalue_reference_t<Ts> ...)>;
+    using type = hook_signal<void(const HookT&, T&, std::add_lvalue_reference_t<Ts> ...)>;
 };
 
 template <class HookT, class T, typename Tuple, typename Enable = void>
@@ -88,12 +101,12 @@ struct on_before_type;
 
 template <class HookT, class T, typename... Ts>
 struct on_before_type<HookT, T, std::tuple<Ts...>, typename std::enable_if<std::is_void_v<T>>::type> {
-    using type = ktsignal::ktsignal_threadsafe<bool(const HookT&, std::add_lvalue_reference_t<Ts> ...)>;
+    using type = hook_signal<bool(const HookT&, std::add_lvalue_reference_t<Ts> ...)>;
 };
 
 template <class HookT, class T, typename... Ts>
 struct on_before_type<HookT, T, std::tuple<Ts...>, typename std::enable_if<!std::is_void_v<T>>::type> {
-    using type = ktsignal::ktsignal_threadsafe<std::optional<T>(const HookT&, std::add_lvalue_reference_t<Ts> ...)>;
+    using type = hook_signal<std::optional<T>(const HookT&, std::add_lvalue_reference_t<Ts> ...)>;
 };
 
 template <typename HookType, typename Ret, typename Args>
@@ -464,31 +477,23 @@ struct JCC_REL {
 };
 #pragma pack(pop)
 
+// one slot call of a compiled hook_signal dispatcher, see generate_signal_dispatcher
+struct dispatch_call {
+    const void* object;
+    std::uintptr_t thunk;
+};
+
 template <typename HookPtrType, typename Ret, typename... Args>
 inline Ret signal_relay(HookPtrType* this_hook, Args&... args) {
     if constexpr (std::is_void_v<Ret>) {
-        auto before_iterate = this_hook->before.emit_iterate(*this_hook, args...);
-        bool dont_skip_original = true;
-        for (auto return_value : before_iterate) {
-            dont_skip_original &= return_value;
-        }
-        if (dont_skip_original) {
+        if (!this_hook->before.emit_combined(nullptr, *this_hook, args...)) {
             this_hook->get_trampoline()(args...);
             this_hook->after.emit(*this_hook, args...);
         }
         return;
     } else {
-        auto before_iterate = this_hook->before.emit_iterate(*this_hook, args...);
-        bool dont_skip_original = true;
         std::optional<Ret> value;
-        for (std::optional<Ret> return_value : before_iterate) {
-            bool has_value = return_value.has_value();
-            dont_skip_original &= !has_value;
-            if (has_value) {
-                value = std::move(return_value.value());
-            }
-        }
-        if (dont_skip_original) {
+        if (!this_hook->before.emit_combined(&value, *this_hook, args...)) {
             value = std::move(this_hook->get_trampoline()(args...));
             this_hook->after.emit(*this_hook, value.value(), args...);
         }
@@ -496,6 +501,20 @@ inline Ret signal_relay(HookPtrType* this_hook, Args&... args) {
     }
 }
 
+// stands in for std::function in kthook_static: always set and calls Callback directly, so the relay can inline it
+template <auto Callback>
+struct static_callback {
+    constexpr explicit operator bool() const { return true; }
+
+    template <typename... Ts>
+    decltype(auto) operator()(Ts&&... args) const {
+        if constexpr (std::is_function_v<std::remove_pointer_t<decltype(Callback)>>)
+            return Callback(std::forward<Ts>(args)...);
+        else
+            return (*Callback)(std::forward<Ts>(args)...);
+    }
+};
+
 template <typename CallbackT, typename HookPtrType, typename Ret, typename... Args>
 inline Ret common_relay(CallbackT& cb, HookPtrType* this_hook, Args&... args) {
     if (cb)
@@ -504,6 +523,40 @@ inline Ret common_relay(CallbackT& cb, HookPtrType* this_hook, Args&... args) {
         return this_hook->get_trampoline()(args...);
 }
 
+// Slot holding the address a hooked call running on this thread returns to. Every relay links one into a
+// per-thread list for as long as it runs and get_return_address() takes the innermost one of its hook, so concurrent
+// and recursive calls of a hooked function each see their own caller without any lock.
+struct return_frame {
+    return_frame(const void* hook, std::uintptr_t* return_address)
+        : hook(hook), return_address(return_address), previous(top) {
+        top = this;
+    }
+
+    ~return_frame() { top = previous; }
+
+    return_frame(const return_frame&) = delete;
+    return_frame& operator=(const return_frame&) = delete;
+
+    const void* hook;
+    std::uintptr_t* return_address;
+    return_frame* previous;
+
+    static inline thread_local return_frame* top = nullptr;
+};
+
+// innermost relay frame of hook on this thread, nullptr outside of its relays
+inline const return_frame* find_frame(const void* hook) {
+    for (auto frame = return_frame::top; frame != nullptr; frame = frame->previous) {
+        if (frame->hook == hook) return frame;
+    }
+    return nullptr;
+}
+
+inline std::uintptr_t* find_return_address(const void* hook) {
+    auto frame = find_frame(hook);
+    return (frame != nullptr) ? frame->return_address : nullptr;
+}
+
 template <typename HookType>
 #ifdef KTHOOK_32
 #ifndef __GNUC__
@@ -514,7 +567,8 @@ __attribute__((cdecl))  std::uintptr_t
 #else
 std::uintptr_t
 #endif
-naked_relay(HookType* this_hook) {
+naked_relay(HookType* this_hook, std::uintptr_t* return_address) {
+    return_frame frame{this_hook, return_address};
     auto ret_addr = this_hook->get_return_address();
 
     auto& cb = this_hook->get_callback();
@@ -637,6 +691,73 @@ inline std::vector<map_info> parse_proc_maps() {
     }
     return result;
 }
+
+// Process-wide snapshot of the memory mappings sorted by address, looked up with binary search.
+// The snapshot is re-read only when a lookup misses, mappings created by kthook itself are inserted in place.
+class memory_map_index {
+public:
+    static memory_map_index& instance() {
+        static memory_map_index index;
+        return index;
+    }
+
+    // mapping containing address, the snapshot is refreshed once if it is not known (or forced)
+    std::optional<map_info> find(std::uintptr_t address, bool force_refresh = false) {
+        std::lock_guard lock{mutex};
+        if (force_refresh || !loaded) {
+            refresh_locked();
+            return lookup(address);
+        }
+        if (auto result = lookup(address)) return result;
+        refresh_locked();
+        return lookup(address);
+    }
+
+    // lowest mapping intersecting [start, end) in the current snapshot
+    std::optional<map_info> find_overlapping(std::uintptr_t start, std::uintptr_t end) {
+        std::lock_guard lock{mutex};
+        if (!loaded) refresh_locked();
+        auto it = upper_bound(start);
+        if (it != maps.begin() && start < std::prev(it)->end) return *std::prev(it);
+        if (it != maps.end() && it->start < end) return *it;
+        return std::nullopt;
+    }
+
+    void insert(const map_info& mi) {
+        std::lock_guard lock{mutex};
+        if (!loaded) return;
+        maps.insert(upper_bound(mi.start), mi);
+    }
+
+    void refresh() {
+        std::lock_guard lock{mutex};
+        refresh_locked();
+    }
+
+private:
+    void refresh_locked() {
+        maps = parse_proc_maps();
+        std::sort(maps.begin(), maps.end(), [](const auto& lhs, const auto& rhs) { return lhs.start < rhs.start; });
+        loaded = true;
+    }
+
+    std::vector<map_info>::iterator upper_bound(std::uintptr_t address) {
+        return std::upper_bound(maps.begin(), maps.end(), address,
+                                [](std::uintptr_t value, const map_info& mi) { return value < mi.start; });
+    }
+
+    std::optional<map_info> lookup(std::uintptr_t address) {
+        auto it = upper_bound(address);
+        if (it == maps.begin()) return std::nullopt;
+        --it;
+        if (address < it->end) return *it;
+        return std::nullopt;
+    }
+
+    std::vector<map_info> maps;
+    bool loaded = false;
+    std::mutex mutex;
+};
 #endif
 
 inline bool check_is_executable(const void* addr) {
@@ -646,23 +767,27 @@ inline bool check_is_executable(const void* addr) {
     return buffer.Protect == PAGE_EXECUTE || buffer.Protect == PAGE_EXECUTE_READ ||
            buffer.Protect == PAGE_EXECUTE_READWRITE || buffer.Protect == PAGE_EXECUTE_WRITECOPY;
 #else
-
-    auto map_infos = parse_proc_maps();
-
+    auto& index = memory_map_index::instance();
     std::uintptr_t iaddr = reinterpret_cast<std::uintptr_t>(addr);
 
-    for (auto& mi : map_infos) {
-        if (mi.start <= iaddr && iaddr < mi.end) {
-            if (mi.prot & PROT_EXEC) {
-                return true;
-            }
-        }
-    }
-
-    return false;
+    auto mi = index.find(iaddr);
+    // protection could have changed since the snapshot was taken
+    if (mi && !(mi->prot & PROT_EXEC)) mi = index.find(iaddr, true);
+    return mi && (mi->prot & PROT_EXEC);
 #endif
 }
 
+// executable view of generated code and the view it is written through, the same address without a dual mapping
+struct code_region_memory {
+    std::uint8_t* exec;
+    std::uint8_t* write;
+};
+
+constexpr std::size_t kHugePageSize = 0x200000;
+
+// code regions are kHugePageSize and backed by transparent huge pages where possible, see set_huge_code_pages
+inline std::atomic<bool> huge_code_pages{false};
+
 enum class MemoryProt {
     PROTECT_RW,
     PROTECT_RWE,
@@ -707,20 +832,190 @@ inline bool set_memory_prot(const void* addr, std::size_t size, MemoryProt prote
 #endif
 }
 
+// Registers of a stopped thread, needed to prove that no thread still runs in (or returns into) stub memory.
+// Where each instruction copied into a trampoline went: offsets from the hooked address to offsets
+// into the trampoline. A thread stopped on one of these instructions is moved to its copy.
+struct trampoline_ip_map {
+    static constexpr std::size_t kMaxInstructions = 8;  // a 5 byte patch can't cover more
+
+    std::uint8_t count = 0;
+    std::array<std::pair<std::uint8_t, std::uint8_t>, kMaxInstructions> offsets{};
+
+    void add(std::size_t from, std::size_t to) {
+        if (count == kMaxInstructions) return;
+        offsets[count++] = {static_cast<std::uint8_t>(from), static_cast<std::uint8_t>(to)};
+    }
+};
+
+struct thread_state {
+    std::uintptr_t ip = 0;
+    std::uintptr_t sp = 0;
+    // general purpose registers, a stub or its data may only be referenced from one of them
+    std::array<std::uintptr_t, sizeof(void*) == 8 ? 16 : 8> registers{};
+    bool captured = false;
+    bool relocated = false;  // ip was changed while the thread was stopped and is written back on resume
+};
+
+// only one stop-the-world may be active, two freezing threads would stop each other
+inline std::mutex freeze_mutex;
+
+// guarded by freeze_mutex
+inline freeze_stats freeze_statistics;
+
 #if defined(_WIN32)
 struct frozen_threads {
+    std::unique_lock<std::mutex> lock;
     std::vector<DWORD> thread_ids;
+    std::vector<thread_state> states;
+    bool all_stopped = false;
 };
 #elif defined(__linux__)
 struct frozen_threads {
-    struct sigaction oldact1, oldact2;
+    std::unique_lock<std::mutex> lock;
     std::vector<int> thread_ids;
+    std::vector<thread_state> states;
+    bool all_stopped = false;
+    // futex words, see freeze_threads
+    std::atomic<std::int32_t> acked{0};
+    std::atomic<std::int32_t> released{0};
 };
+
+static_assert(sizeof(std::atomic<std::int32_t>) == sizeof(std::int32_t), "futex words must be plain integers");
+
+inline void futex_wait(std::atomic<std::int32_t>& word, std::int32_t expected, const timespec* timeout) {
+    syscall(SYS_futex, reinterpret_cast<std::int32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<std::int32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<std::int32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// sleeps until word reaches target or the deadline passes, returns whether it was reached
+inline bool futex_wait_for(std::atomic<std::int32_t>& word, std::int32_t target,
+                           std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        auto value = word.load(std::memory_order_acquire);
+        if (value >= target) return true;
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) return false;
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+        timespec timeout{static_cast<time_t>(remaining / 1000000000), static_cast<long>(remaining % 1000000000)};
+        futex_wait(word, value, &timeout);
+    }
+}
 #else
 struct frozen_threads {
+    std::vector<thread_state> states;
+    bool all_stopped = false;
 };
 #endif
 
+// the freeze in progress, read by the SIGUSR1 handlers and relocate_frozen_threads
+inline std::atomic<frozen_threads*> active_freeze{nullptr};
+
+constexpr auto kFreezeTimeout = std::chrono::milliseconds{500};
+
+#if defined(__linux__)
+// SIGUSR1 handlers that may be looking at active_freeze, a futex word. unfreeze_threads waits for it to drop
+// to 0 before the frozen_threads it cleared from active_freeze goes away.
+inline std::atomic<std::int32_t> freeze_handlers{0};
+inline struct sigaction freeze_oldact;
+
+// Every thread records where it was stopped, acks and sleeps on the released futex.
+// The freezer sleeps on the acked futex until all of them have answered, both waits are futex waits
+// instead of spinning and the freezer's is bounded by kFreezeTimeout.
+inline void stop_frozen_thread(frozen_threads& threads, void* context) {
+    auto uc = static_cast<ucontext_t*>(context);
+#if defined(__x86_64__)
+    constexpr int kIpReg = REG_RIP;
+    constexpr int kSpReg = REG_RSP;
+    constexpr int kFirstReg = REG_R8;  // r8 to rsp
+#else
+    constexpr int kIpReg = REG_EIP;
+    constexpr int kSpReg = REG_ESP;
+    constexpr int kFirstReg = REG_EDI;  // edi to eax
+#endif
+    thread_state* state = nullptr;
+    auto self_tid = static_cast<int>(syscall(SYS_gettid));
+    for (std::size_t i = 0; i < threads.thread_ids.size(); ++i) {
+        if (threads.thread_ids[i] == self_tid) {
+            state = &threads.states[i];
+            break;
+        }
+    }
+    // a thread started after the enumeration wasn't asked to stop
+    if (state == nullptr) return;
+    state->ip = static_cast<std::uintptr_t>(uc->uc_mcontext.gregs[kIpReg]);
+    state->sp = static_cast<std::uintptr_t>(uc->uc_mcontext.gregs[kSpReg]);
+    for (std::size_t i = 0; i < state->registers.size(); ++i) {
+        state->registers[i] = static_cast<std::uintptr_t>(uc->uc_mcontext.gregs[kFirstReg + i]);
+    }
+    state->captured = true;
+    threads.acked.fetch_add(1, std::memory_order_acq_rel);
+    futex_wake(threads.acked);
+    while (threads.released.load(std::memory_order_acquire) == 0) {
+        futex_wait(threads.released, 0, nullptr);
+    }
+    if (state->relocated) uc->uc_mcontext.gregs[kIpReg] = static_cast<greg_t>(state->ip);
+}
+
+// SIGUSR1s sent by freezes that no handler has taken yet. A freeze that timed out leaves them pending in the
+// threads that blocked the signal, they arrive long after the freeze and are dropped instead of being passed on.
+inline std::atomic<std::int32_t> freeze_signals{0};
+
+inline bool is_freeze_signal(const siginfo_t* info) {
+    if (info == nullptr || info->si_code != SI_TKILL || info->si_pid != getpid()) return false;
+    auto pending = freeze_signals.load();
+    while (pending > 0) {
+        if (freeze_signals.compare_exchange_weak(pending, pending - 1)) return true;
+    }
+    return false;
+}
+
+inline void freeze_signal_handler(int sig, siginfo_t* info, void* context) {
+    auto saved_errno = errno;
+    freeze_handlers.fetch_add(1);
+    auto threads = active_freeze.load();
+    if (threads != nullptr) stop_frozen_thread(*threads, context);
+    if (freeze_handlers.fetch_sub(1) == 1) futex_wake(freeze_handlers);
+    auto ours = is_freeze_signal(info);
+    errno = saved_errno;
+    if (threads != nullptr || ours) return;
+
+    const auto& old = freeze_oldact;
+    if (old.sa_flags & SA_SIGINFO) {
+        if (old.sa_sigaction != nullptr) old.sa_sigaction(sig, info, context);
+    } else if (old.sa_handler == SIG_DFL) {
+        // the default action terminates the process, it happens once the handler returns and unblocks the signal
+        struct sigaction dfl {};
+        dfl.sa_handler = SIG_DFL;
+        sigaction(sig, &dfl, nullptr);
+        raise(sig);
+    } else if (old.sa_handler != SIG_IGN) {
+        old.sa_handler(sig);
+    }
+}
+
+// Left in place after the freeze: a thread that blocked SIGUSR1 through a freeze that timed out gets the signal
+// when it unblocks. Every freeze checks that the handler is still ours and installs it again if someone replaced
+// it. Outside of a freeze any other SIGUSR1 goes to the handler that was there before.
+// Called with freeze_mutex held.
+inline bool install_freeze_handler() {
+    struct sigaction current;
+    if (sigaction(SIGUSR1, nullptr, &current) != 0) return false;
+    if ((current.sa_flags & SA_SIGINFO) && current.sa_sigaction == &freeze_signal_handler) return true;
+
+    struct sigaction act;
+    if (sigemptyset(&act.sa_mask) != 0) return false;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    act.sa_sigaction = &freeze_signal_handler;
+    freeze_oldact = current;
+    return sigaction(SIGUSR1, &act, nullptr) == 0;
+}
+#endif
+
+inline bool unfreeze_threads(frozen_threads& threads);
+
 inline bool freeze_threads(frozen_threads& threads) {
 #if defined(_WIN32)
     auto enumerate_threads = [](frozen_threads& threads) {
@@ -748,45 +1043,49 @@ inline bool freeze_threads(frozen_threads& threads) {
         return true;
     };
 
+    threads.lock = std::unique_lock{freeze_mutex};
     if (!enumerate_threads(threads)) {
+        threads.lock.unlock();
         return false;
     }
-    for (auto tid : threads.thread_ids) {
-        HANDLE hThread = OpenThread(
-            THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION | THREAD_SET_CONTEXT, FALSE, tid);
+    threads.states.resize(threads.thread_ids.size());
+    threads.all_stopped = true;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < threads.thread_ids.size(); ++i) {
+        HANDLE hThread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION |
+                                        THREAD_SET_CONTEXT, FALSE, threads.thread_ids[i]);
         if (hThread != NULL) {
-            SuspendThread(hThread);
+            if (SuspendThread(hThread) != static_cast<DWORD>(-1)) {
+                // GetThreadContext also waits until the suspension has actually happened
+                CONTEXT context;
+                context.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+                if (GetThreadContext(hThread, &context)) {
+                    auto& state = threads.states[i];
+#ifdef _WIN64
+                    state.ip = context.Rip;
+                    state.sp = context.Rsp;
+                    state.registers = {context.Rax, context.Rcx, context.Rdx, context.Rbx, context.Rsp, context.Rbp,
+                                       context.Rsi, context.Rdi, context.R8,  context.R9,  context.R10, context.R11,
+                                       context.R12, context.R13, context.R14, context.R15};
+#else
+                    state.ip = context.Eip;
+                    state.sp = context.Esp;
+                    state.registers = {context.Eax, context.Ecx, context.Edx, context.Ebx,
+                                       context.Esp, context.Ebp, context.Esi, context.Edi};
+#endif
+                    state.captured = true;
+                }
+            }
             CloseHandle(hThread);
         }
+        if (!threads.states[i].captured) threads.all_stopped = false;
     }
 #elif defined(__linux__)
-    auto signal_callback = [](int signal) {
-        switch (signal) {
-            case SIGUSR1:
-                pause();
-            break;
-            case SIGUSR2:
-                break;
-        }
-    };
-
-    struct sigaction act;
-    if (sigemptyset(&act.sa_mask) != 0) {
-        return false;
-    }
-    act.sa_flags = 0;
-    act.sa_handler = signal_callback;
-
-    if (sigaction(SIGUSR1, &act, &threads.oldact1) != 0) {
-        return false;
-    }
-    if (sigaction(SIGUSR2, &act, &threads.oldact2) != 0) {
-        return false;
-    }
-
     auto self_pid = getpid();
-    auto self_tid = syscall(sys_gettid);
+    auto self_tid = static_cast<int>(syscall(SYS_gettid));
 
+    threads.lock = std::unique_lock{freeze_mutex};
+    // nothing may allocate once the first thread is stopped, it could hold the allocator lock
     for (const auto& dir_entry : std::filesystem::directory_iterator{"/proc/self/task"}) {
         if (dir_entry.is_directory()) {
             auto tid_str = dir_entry.path().stem().string();
@@ -794,68 +1093,266 @@ inline bool freeze_threads(frozen_threads& threads) {
             std::from_chars(tid_str.c_str(), tid_str.c_str() + tid_str.size(), tid);
 
             if (tid != self_tid) {
-                syscall(sys_tgkill, self_pid, tid, SIGUSR1);
                 threads.thread_ids.push_back(tid);
             }
         }
     }
+    threads.states.resize(threads.thread_ids.size());
+
+    if (!install_freeze_handler()) {
+        threads.lock.unlock();
+        return false;
+    }
+    active_freeze.store(&threads);
+
+    auto start = std::chrono::steady_clock::now();
+    std::int32_t signaled = 0;
+    for (auto tid : threads.thread_ids) {
+        // a thread that has exited since the enumeration can't run anything anymore
+        freeze_signals.fetch_add(1);
+        if (syscall(SYS_tgkill, self_pid, tid, SIGUSR1) == 0) {
+            ++signaled;
+        } else {
+            freeze_signals.fetch_sub(1);
+        }
+    }
+
+    // threads blocking SIGUSR1 never answer, so the wait is bounded
+    threads.all_stopped = futex_wait_for(threads.acked, signaled, start + kFreezeTimeout);
 #else
-    struct frozen_threads {
-    };
+    auto start = std::chrono::steady_clock::now();
+#endif
+#ifdef _WIN32
+    active_freeze.store(&threads, std::memory_order_release);
+#endif
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    auto& stats = freeze_statistics;
+    ++stats.freezes;
+    if (!threads.all_stopped) ++stats.timeouts;
+    stats.last_latency = latency;
+    stats.total_latency += latency;
+    if (stats.max_latency < latency) stats.max_latency = latency;
+#if defined(_WIN32) || defined(__linux__)
+    // patching with a thread still running is what the freeze is there to prevent
+    if (!threads.all_stopped) {
+        unfreeze_threads(threads);
+        return false;
+    }
 #endif
     return true;
 }
 
+// Moves every stopped thread whose instruction pointer is on one of the first size bytes at address,
+// which are about to be overwritten, to the copy of its instruction in the trampoline.
+// Does nothing outside of a freeze.
+inline void relocate_frozen_threads(std::uintptr_t address, std::size_t size, const std::uint8_t* trampoline,
+                                    const trampoline_ip_map& map) {
+    auto threads = active_freeze.load(std::memory_order_acquire);
+    if (threads == nullptr || trampoline == nullptr) return;
+    for (auto& state : threads->states) {
+        if (!state.captured || state.ip < address || address + size <= state.ip) continue;
+        // the first instruction stays where it is, the jump written over it leads to the same code
+        if (state.ip == address) continue;
+        for (std::size_t i = 0; i < map.count; ++i) {
+            if (address + map.offsets[i].first == state.ip) {
+                state.ip = reinterpret_cast<std::uintptr_t>(trampoline) + map.offsets[i].second;
+                state.relocated = true;
+                ++freeze_statistics.relocated;
+                break;
+            }
+        }
+    }
+}
+
 inline bool unfreeze_threads(frozen_threads& threads) {
 #if defined(_WIN32)
-    for (auto tid : threads.thread_ids) {
-        HANDLE hThread = OpenThread(
-            THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION | THREAD_SET_CONTEXT, FALSE, tid);
+    active_freeze.store(nullptr, std::memory_order_release);
+    for (std::size_t i = 0; i < threads.thread_ids.size(); ++i) {
+        HANDLE hThread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION |
+                                        THREAD_SET_CONTEXT, FALSE, threads.thread_ids[i]);
         if (hThread != NULL) {
+            if (threads.states[i].relocated) {
+                CONTEXT context;
+                context.ContextFlags = CONTEXT_CONTROL;
+                if (GetThreadContext(hThread, &context)) {
+#ifdef _WIN64
+                    context.Rip = threads.states[i].ip;
+#else
+                    context.Eip = static_cast<DWORD>(threads.states[i].ip);
+#endif
+                    SetThreadContext(hThread, &context);
+                }
+            }
             ResumeThread(hThread);
             CloseHandle(hThread);
         }
     }
+    threads.lock.unlock();
 #elif defined(__linux__)
-    auto self_pid = getpid();
-
-    for (auto tid : threads.thread_ids) {
-        syscall(sys_tgkill, self_pid, tid, SIGUSR2);
+    active_freeze.store(nullptr);
+    threads.released.store(1, std::memory_order_release);
+    futex_wake(threads.released);
+
+    // a handler that loaded active_freeze before it was cleared may still reference threads, acked or not
+    while (true) {
+        auto inside = freeze_handlers.load();
+        if (inside == 0) break;
+        futex_wait(freeze_handlers, inside, nullptr);
     }
+    threads.lock.unlock();
+#endif
+    return true;
+}
 
-    sigaction(SIGUSR1, &threads.oldact1, nullptr);
-    sigaction(SIGUSR2, &threads.oldact2, nullptr);
+// upper bound of detect_hook_size: a 5 byte jump can end inside an instruction of at most 15 bytes
+constexpr std::size_t kMaxHookSize = 32;
+
+#if defined(__linux__) && defined(SYS_membarrier)
+// int3 text_poke currently has in place, guarded by freeze_mutex. 0 between pokes, a thread trapping late
+// finds the int3 gone and runs the patched instruction instead.
+struct text_poke_state {
+    std::atomic<std::uintptr_t> address{0};
+    std::atomic<std::uint32_t> finished{0};  // pokes done, tells the handler a poke ended while it looked
+    std::atomic<std::uintptr_t> redirect{0};
+    struct sigaction oldact;
+};
+
+inline text_poke_state poke_state;
+
+inline void sync_cores() { syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0); }
+#endif
+
+// the process registered for core serializing membarriers, needs linux 4.16
+inline bool text_poke_supported() {
+#if defined(__linux__) && defined(SYS_membarrier)
+    static const bool supported =
+        syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0) == 0;
+    return supported;
 #else
-    struct frozen_threads {
-    };
+    return false;
 #endif
-    return true;
 }
 
-inline struct JumpAllocator : Xbyak::Allocator {
-    uint8_t* alloc(size_t size) override {
-        void* ptr = Xbyak::AlignedMalloc(size, Xbyak::inner::getPageSize());
-        set_memory_prot(ptr, size, MemoryProt::PROTECT_RWE);
-        return reinterpret_cast<uint8_t*>(ptr);
-    }
+#if defined(__linux__) && defined(SYS_membarrier)
+// SIGTRAP handler sending threads that hit the int3 of text_poke to redirect, other traps go to the previous handler.
+// An int3 trap whose int3 is gone by the time the handler runs came from a poke that has finished since, the
+// thread goes back and runs whatever is there now.
+inline bool install_text_poke_handler() {
+    static const bool installed = [] {
+        struct sigaction act;
+        if (sigemptyset(&act.sa_mask) != 0) return false;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
+        act.sa_sigaction = [](int sig, siginfo_t* info, void* context) {
+            auto uc = static_cast<ucontext_t*>(context);
+#if defined(__x86_64__)
+            constexpr int kIpReg = REG_RIP;
+#else
+            constexpr int kIpReg = REG_EIP;
+#endif
+            // int3 traps with the instruction pointer after it, signals sent by other threads have other codes
+            auto ip = static_cast<std::uintptr_t>(uc->uc_mcontext.gregs[kIpReg]);
+            if (info->si_code == SI_KERNEL) {
+                auto finished = poke_state.finished.load();
+                bool int3 = *reinterpret_cast<const volatile std::uint8_t*>(ip - 1) == 0xCC;
+                auto address = poke_state.address.load();
+                if (int3 && address == ip - 1) {
+                    uc->uc_mcontext.gregs[kIpReg] = static_cast<greg_t>(poke_state.redirect.load());
+                    return;
+                }
+                // the int3 is gone or may have been, rerunning the instruction traps again if it isn't
+                if (!int3 || poke_state.finished.load() != finished) {
+                    uc->uc_mcontext.gregs[kIpReg] = static_cast<greg_t>(ip - 1);
+                    return;
+                }
+            }
 
-    void free(uint8_t* p) override {
-    }
+            const auto& old = poke_state.oldact;
+            if (old.sa_flags & SA_SIGINFO) {
+                if (old.sa_sigaction != nullptr) old.sa_sigaction(sig, info, context);
+            } else if (old.sa_handler == SIG_DFL) {
+                signal(sig, SIG_DFL);
+                raise(sig);
+            } else if (old.sa_handler != SIG_IGN) {
+                old.sa_handler(sig);
+            }
+        };
+        return sigaction(SIGTRAP, &act, &poke_state.oldact) == 0;
+    }();
+    return installed;
+}
+#endif
 
-    bool useProtect() const override { return false; }
-} default_jmp_allocator;
+// length of the instruction at address
+inline std::size_t instruction_length(std::uintptr_t address) {
+    hde op;
+    hde_disasm(reinterpret_cast<void*>(address), &op);
+    return op.len;
+}
+
+// whether a hook's size byte jump at address can go in with text_poke instead of a freeze: it must only
+// change the first instruction, a thread already past it would run half of the old and half of the new code
+inline bool can_text_poke(std::uintptr_t address, std::size_t size) {
+    return text_poke_supported() && instruction_length(address) >= size;
+}
 
-inline struct TrampolineAllocator : Xbyak::Allocator {
-    uint8_t* alloc(size_t size) override {
-        void* ptr = Xbyak::AlignedMalloc(size, Xbyak::inner::getPageSize());
-        set_memory_prot(ptr, size, MemoryProt::PROTECT_RWE);
-        return reinterpret_cast<uint8_t*>(ptr);
+// Replaces size bytes of code other threads may be running without stopping them, following the kernel's
+// text_poke_bp: an int3 goes over the first byte, then the rest is written, then the first byte.
+// Every step is made visible to all cores with a core serializing membarrier, a thread reaching the int3
+// in between continues at redirect, which has to behave like the original code (the trampoline).
+// Threads that were already past the first byte when the patch started are not handled, so a patch that
+// changes more than the first instruction is refused and has to be written under a freeze.
+inline bool text_poke(std::uintptr_t address, const std::uint8_t* bytes, std::size_t size,
+                      const std::uint8_t* redirect) {
+#if defined(__linux__) && defined(SYS_membarrier)
+    if (!text_poke_supported()) return false;
+    auto code = reinterpret_cast<const std::uint8_t*>(address);
+    for (auto i = instruction_length(address); i < size; ++i) {
+        if (code[i] != bytes[i]) return false;
     }
+    if (!install_text_poke_handler()) return false;
+    std::lock_guard lock{freeze_mutex};
+    poke_state.redirect.store(reinterpret_cast<std::uintptr_t>(redirect), std::memory_order_release);
+    poke_state.address.store(address, std::memory_order_release);
+
+    auto target = reinterpret_cast<volatile std::uint8_t*>(address);
+    target[0] = 0xCC;
+    sync_cores();
+    if (size > 1) {
+        for (std::size_t i = 1; i < size; ++i) target[i] = bytes[i];
+        sync_cores();
+    }
+    target[0] = bytes[0];
+    sync_cores();
+    poke_state.finished.fetch_add(1);
+    poke_state.address.store(0);
+    return true;
+#else
+    return false;
+#endif
+}
 
-    void free(uint8_t* p) override { Xbyak::AlignedFree(p); }
-    bool useProtect() const override { return false; }
-} default_trampoline_allocator;
+// Writes a patch over the code at address. poke goes through text_poke when not frozen, nothing is written
+// if that fails and the caller has to freeze and try again. Otherwise the bytes are simply copied and the
+// caller is expected to hold a freeze.
+inline bool patch_code(std::uintptr_t address, const std::uint8_t* bytes, std::size_t size, bool poke,
+                       const std::uint8_t* redirect) {
+    auto target = reinterpret_cast<void*>(address);
+    if (!set_memory_prot(target, size, MemoryProt::PROTECT_RWE)) return false;
+    bool written = true;
+    if (poke && active_freeze.load(std::memory_order_acquire) == nullptr) {
+        written = text_poke(address, bytes, size, redirect);
+    } else {
+        std::memcpy(target, bytes, size);
+    }
+    if (!set_memory_prot(target, size, MemoryProt::PROTECT_RE)) return false;
+    return written && flush_intruction_cache(target, size);
+}
 } // namespace detail
+
+inline freeze_stats get_freeze_stats() {
+    std::lock_guard lock{detail::freeze_mutex};
+    return detail::freeze_statistics;
+}
 } // namespace kthook
 
 #endif  // KTHOOK_DETAIL_X86_64_HPP_
@@ -0,0 +1,136 @@
+#ifndef KTHOOK_FUNCTION_X86_64_HPP_
+#define KTHOOK_FUNCTION_X86_64_HPP_
+
+namespace kthook {
+namespace detail {
+// default callback storage of kthook_simple and kthook_naked, fits a lambda capturing 8 pointers
+constexpr std::size_t kCallbackCapacity = 8 * sizeof(void*);
+
+template <typename Signature, std::size_t Capacity = kCallbackCapacity>
+class inplace_function;
+
+// std::function replacement for hook callbacks. The callable is always stored inside the object, a callable
+// that doesn't fit is a compile error instead of a heap allocation. Calling doesn't check for emptiness,
+// relays test operator bool before calling anyway.
+template <typename Ret, typename... Args, std::size_t Capacity>
+class inplace_function<Ret(Args...), Capacity> {
+    using invoke_type = Ret (*)(void*, Args&&...);
+    enum class operation { copy, move, destroy };
+    // nullptr for trivially copyable callables, those are copied with the storage and need no destructor
+    using manage_type = void (*)(operation, void*, void*);
+
+    template <typename F>
+    static constexpr bool is_callable_v =
+        !std::is_same_v<std::decay_t<F>, inplace_function> && std::is_invocable_v<std::decay_t<F>&, Args...>;
+
+public:
+    inplace_function() = default;
+
+    inplace_function(std::nullptr_t) {}
+
+    template <typename F, typename = std::enable_if_t<is_callable_v<F>>>
+    inplace_function(F&& f) {
+        using callable = std::decay_t<F>;
+        static_assert(sizeof(callable) <= Capacity, "callback doesn't fit, raise the hook's CallbackCapacity");
+        static_assert(alignof(callable) <= alignof(std::max_align_t), "callback is overaligned");
+        static_assert(std::is_copy_constructible_v<callable>, "callback must be copy constructible");
+
+        if constexpr (std::is_pointer_v<callable> || std::is_member_pointer_v<callable>) {
+            if (f == nullptr) return;
+        }
+        new (&storage) callable(std::forward<F>(f));
+        invoke = &invoke_impl<callable>;
+        if constexpr (!std::is_trivially_copyable_v<callable>) manage = &manage_impl<callable>;
+    }
+
+    inplace_function(const inplace_function& other) { assign(other, operation::copy); }
+
+    inplace_function(inplace_function&& other) noexcept { assign(other, operation::move); }
+
+    ~inplace_function() { reset(); }
+
+    inplace_function& operator=(const inplace_function& other) {
+        if (this != &other) {
+            reset();
+            assign(other, operation::copy);
+        }
+        return *this;
+    }
+
+    inplace_function& operator=(inplace_function&& other) noexcept {
+        if (this != &other) {
+            reset();
+            assign(other, operation::move);
+        }
+        return *this;
+    }
+
+    inplace_function& operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    explicit operator bool() const { return invoke != nullptr; }
+
+    Ret operator()(Args... args) const { return invoke(&storage, std::forward<Args>(args)...); }
+
+private:
+    template <typename F>
+    static Ret invoke_impl(void* storage, Args&&... args) {
+        auto& f = *static_cast<F*>(storage);
+        if constexpr (std::is_void_v<Ret>)
+            std::invoke(f, std::forward<Args>(args)...);
+        else
+            return std::invoke(f, std::forward<Args>(args)...);
+    }
+
+    template <typename F>
+    static void manage_impl(operation op, void* dst, void* src) {
+        switch (op) {
+            case operation::copy:
+                new (dst) F(*static_cast<const F*>(src));
+                break;
+            case operation::move:
+                new (dst) F(std::move(*static_cast<F*>(src)));
+                break;
+            case operation::destroy:
+                static_cast<F*>(dst)->~F();
+                break;
+        }
+    }
+
+    void assign(const inplace_function& other, operation op) {
+        invoke = other.invoke;
+        manage = other.manage;
+        if (manage)
+            manage(op, &storage, &other.storage);
+        else if (invoke)
+            std::memcpy(&storage, &other.storage, Capacity);
+    }
+
+    void reset() {
+        if (manage) manage(operation::destroy, &storage, nullptr);
+        invoke = nullptr;
+        manage = nullptr;
+    }
+
+    invoke_type invoke = nullptr;
+    manage_type manage = nullptr;
+    alignas(std::max_align_t) mutable unsigned char storage[Capacity];
+};
+
+// callable set_cb_wrapped stores: hands the hook arguments over to the wrapped callback regrouped into the
+// kthook::take<> packs and types it asks for
+template <typename Callback, typename Output>
+struct wrapped_callback {
+    Callback cb;
+
+    template <typename... Ts>
+    decltype(auto) operator()(Ts&&... args) {
+        return std::apply(cb, bind_values<Output>(std::forward_as_tuple(std::forward<Ts>(args)...)));
+    }
+};
+}  // namespace detail
+}  // namespace kthook
+
+#endif  // KTHOOK_FUNCTION_X86_64_HPP_
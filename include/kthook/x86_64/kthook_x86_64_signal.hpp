@@ -0,0 +1,457 @@
+#ifndef KTHOOK_SIGNAL_X86_64_HPP_
+#define KTHOOK_SIGNAL_X86_64_HPP_
+
+namespace kthook {
+namespace detail {
+// Epoch based reclamation of hook_signal slot lists. A thread inside emit only publishes the epoch it entered in
+// through a record of its own, no lock and no atomic read-modify-write on that path. Writers unlink the old list,
+// advance the epoch and free the list once no thread inside emit entered in an epoch up to the one it was
+// unlinked in.
+class signal_epochs {
+    struct reader {
+        std::atomic<std::uint64_t> epoch{0};  // 0 while the thread isn't emitting
+        std::atomic<bool> in_use{true};
+        std::uint32_t depth = 0;  // emits nest when a slot calls a hooked function
+        reader* next = nullptr;
+    };
+
+    // records are never freed, a thread that exits leaves its record for the next new thread
+    struct reader_handle {
+        explicit reader_handle(signal_epochs& epochs)
+            : record(epochs.acquire_reader()) {
+        }
+
+        ~reader_handle() { record->in_use.store(false, std::memory_order_release); }
+
+        reader* record;
+    };
+
+public:
+    static signal_epochs& instance() {
+        static signal_epochs epochs;
+        return epochs;
+    }
+
+    void enter() {
+        auto& record = local();
+        if (record.depth++ == 0) {
+            record.epoch.store(current.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void leave() {
+        auto& record = local();
+        if (--record.depth == 0) record.epoch.store(0, std::memory_order_release);
+    }
+
+    // call after unlinking, returns the epoch the unlinked data has to be kept for
+    std::uint64_t advance() { return current.fetch_add(1, std::memory_order_seq_cst); }
+
+    // data retired in retire_epoch can be freed once this returns true
+    bool is_quiescent(std::uint64_t retire_epoch) const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (auto record = readers.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            auto epoch = record->epoch.load(std::memory_order_acquire);
+            if (epoch != 0 && epoch <= retire_epoch) return false;
+        }
+        return true;
+    }
+
+private:
+    reader& local() {
+        thread_local reader_handle handle{*this};
+        return *handle.record;
+    }
+
+    reader* acquire_reader() {
+        for (auto record = readers.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            bool expected = false;
+            if (record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) return record;
+        }
+        auto record = new reader;
+        record->next = readers.load(std::memory_order_relaxed);
+        while (!readers.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+        }
+        return record;
+    }
+
+    std::atomic<std::uint64_t> current{1};
+    std::atomic<reader*> readers{nullptr};
+};
+
+// keeps the calling thread inside emit for its lifetime
+class signal_read_guard {
+public:
+    signal_read_guard() { signal_epochs::instance().enter(); }
+
+    ~signal_read_guard() { signal_epochs::instance().leave(); }
+
+    signal_read_guard(const signal_read_guard&) = delete;
+    signal_read_guard& operator=(const signal_read_guard&) = delete;
+};
+
+// what a connection disconnects through, connections only hold it weakly so they may outlive their signal
+class signal_link {
+public:
+    virtual ~signal_link() = default;
+
+    virtual void disconnect(std::uint64_t id) = 0;
+};
+}  // namespace detail
+
+class connection {
+public:
+    connection() = default;
+
+    connection(std::weak_ptr<detail::signal_link> link, std::uint64_t id)
+        : link(std::move(link)),
+          id(id) {
+    }
+
+    void disconnect() {
+        if (auto signal = link.lock()) signal->disconnect(id);
+        link.reset();
+    }
+
+    bool connected() const { return !link.expired(); }
+
+private:
+    std::weak_ptr<detail::signal_link> link;
+    std::uint64_t id = 0;
+};
+
+// disconnects when it goes out of scope
+class scoped_connection {
+public:
+    scoped_connection() = default;
+
+    scoped_connection(connection&& c)
+        : conn(std::move(c)) {
+    }
+
+    scoped_connection(scoped_connection&& other) noexcept
+        : conn(std::exchange(other.conn, {})) {
+    }
+
+    scoped_connection& operator=(scoped_connection&& other) noexcept {
+        if (this != &other) {
+            conn.disconnect();
+            conn = std::exchange(other.conn, {});
+        }
+        return *this;
+    }
+
+    scoped_connection(const scoped_connection&) = delete;
+    scoped_connection& operator=(const scoped_connection&) = delete;
+
+    ~scoped_connection() { conn.disconnect(); }
+
+    void disconnect() { conn.disconnect(); }
+
+    bool connected() const { return conn.connected(); }
+
+    connection release() { return std::exchange(conn, {}); }
+
+private:
+    connection conn;
+};
+
+#ifdef KTHOOK_32
+#define KTHOOK_DISPATCH_CC CCDECL
+#else
+#define KTHOOK_DISPATCH_CC
+#endif
+
+// Signal of kthook_signal's before/after callbacks. Slots are called in connection order. Emitting walks an
+// immutable snapshot of the slot list without locks, connect and disconnect publish a new one and retire the
+// old one after a grace period (see signal_epochs), slots may connect and disconnect from inside a callback.
+// The number of connected slots is kept in an atomic, kthook_signal passes an observer which is told whenever it
+// drops to or rises from zero, and lets its relay stub skip the relay entirely while nothing is connected.
+//
+// Every slot keeps its callable with a thunk instantiated for the callable's type, so a call is a direct call
+// into the callable. After compile() every snapshot also gets a generated dispatcher calling the thunks one
+// after another, emitting then runs no loop at all (see generate_signal_dispatcher).
+template <typename R, typename... Args>
+class hook_signal<R(Args...)> {
+    using args_type = std::tuple<Args...>;
+    // returns true if the slot asks to skip the original, see emit_combined
+    using invoke_type = bool(KTHOOK_DISPATCH_CC*)(const void* object, void* args, void* result);
+    using dispatch_type = bool(KTHOOK_DISPATCH_CC*)(void* args, void* result);
+
+    template <typename T>
+    struct is_optional : std::false_type {};
+
+    template <typename T>
+    struct is_optional<std::optional<T>> : std::true_type {};
+
+    struct slot {
+        std::uint64_t id;
+        std::shared_ptr<void> object;  // the callable, shared by every snapshot the slot is in
+        R (*call)(void* object, args_type& args);
+        invoke_type invoke;
+    };
+
+    struct slot_list {
+        slot_list() = default;
+
+        explicit slot_list(std::vector<slot> slots)
+            : slots(std::move(slots)) {
+        }
+
+        slot_list(const slot_list&) = delete;
+        slot_list& operator=(const slot_list&) = delete;
+
+        // lists are only deleted after their grace period, no thread is inside the dispatcher anymore
+        ~slot_list() {
+            if (code) detail::code_allocator::instance().free(code.code);
+        }
+
+        std::vector<slot> slots;
+        dispatch_type dispatch = nullptr;
+        detail::code_block code;
+    };
+
+    struct state : detail::signal_link {
+        ~state() {
+            delete slots.load(std::memory_order_relaxed);
+            for (auto& [list, epoch] : retired) delete list;
+        }
+
+        void disconnect(std::uint64_t id) override {
+            std::lock_guard lock{mutex};
+            auto& current = slots.load(std::memory_order_relaxed)->slots;
+            auto found = std::find_if(current.begin(), current.end(), [id](const slot& s) { return s.id == id; });
+            if (found == current.end()) return;
+            std::vector<slot> updated;
+            updated.reserve(current.size() - 1);
+            for (auto& s : current) {
+                if (s.id != id) updated.push_back(s);
+            }
+            publish(std::move(updated));
+        }
+
+        std::uint64_t connect(slot new_slot) {
+            std::lock_guard lock{mutex};
+            auto updated = slots.load(std::memory_order_relaxed)->slots;
+            auto id = next_id++;
+            new_slot.id = id;
+            updated.push_back(std::move(new_slot));
+            publish(std::move(updated));
+            return id;
+        }
+
+        void clear() {
+            std::lock_guard lock{mutex};
+            publish({});
+        }
+
+        void compile() {
+            std::lock_guard lock{mutex};
+            if (compiled) return;
+            compiled = true;
+            publish(slots.load(std::memory_order_relaxed)->slots);
+        }
+
+        // called with mutex held
+        void publish(std::vector<slot> updated) {
+            auto list = std::make_unique<slot_list>(std::move(updated));
+            if (compiled) generate_dispatcher(*list);
+
+            bool was_empty = count.load(std::memory_order_relaxed) == 0;
+            count.store(list->slots.size(), std::memory_order_release);
+            auto old = slots.exchange(list.release(), std::memory_order_seq_cst);
+
+            auto& epochs = detail::signal_epochs::instance();
+            retired.emplace_back(old, epochs.advance());
+            auto still_used = std::remove_if(retired.begin(), retired.end(), [&epochs](const auto& entry) {
+                if (!epochs.is_quiescent(entry.second)) return false;
+                delete entry.first;
+                return true;
+            });
+            retired.erase(still_used, retired.end());
+
+            if (observer && was_empty != (count.load(std::memory_order_relaxed) == 0)) observer(observer_data);
+        }
+
+        // emitting falls back to calling the thunks in a loop if the code can't be generated
+        static void generate_dispatcher(slot_list& list) {
+            if (list.slots.empty()) return;
+            std::vector<detail::dispatch_call> calls;
+            calls.reserve(list.slots.size());
+            for (auto& s : list.slots) calls.push_back({s.object.get(), reinterpret_cast<std::uintptr_t>(s.invoke)});
+            // near the thunks so the calls are rel32
+            list.code = detail::generate_near(calls.front().thunk, [&calls](detail::stub_generator& gen) {
+                return detail::generate_signal_dispatcher(gen, calls);
+            });
+            if (!list.code) return;
+            detail::flush_intruction_cache(list.code.code, list.code.size);
+            list.dispatch = reinterpret_cast<dispatch_type>(list.code.code);
+        }
+
+        std::mutex mutex;
+        std::atomic<const slot_list*> slots{new slot_list};
+        // unlinked lists with the epoch they were unlinked in, freed after a grace period
+        std::vector<std::pair<const slot_list*, std::uint64_t>> retired;
+        std::uint64_t next_id = 1;
+        std::atomic<std::size_t> count{0};
+        bool compiled = false;
+        void (*observer)(void*) = nullptr;
+        void* observer_data = nullptr;
+    };
+
+    template <typename F>
+    static R call_slot(void* object, args_type& args) {
+        return static_cast<R>(std::apply(*static_cast<F*>(object), args));
+    }
+
+    template <typename F>
+    static bool KTHOOK_DISPATCH_CC invoke_slot(const void* object, void* args, void* result) {
+        auto& f = *static_cast<F*>(const_cast<void*>(object));
+        auto& packed = *static_cast<args_type*>(args);
+        if constexpr (std::is_void_v<R>) {
+            std::apply(f, packed);
+            return false;
+        } else if constexpr (std::is_same_v<R, bool>) {
+            bool value = std::apply(f, packed);
+            if (result) *static_cast<R*>(result) = value;
+            return !value;
+        } else if constexpr (is_optional<R>::value) {
+            R value = std::apply(f, packed);
+            if (!value.has_value()) return false;
+            if (result) *static_cast<R*>(result) = std::move(value);
+            return true;
+        } else {
+            R value = std::apply(f, packed);
+            if (result) *static_cast<R*>(result) = std::move(value);
+            return false;
+        }
+    }
+
+public:
+    // yields the result of each slot as the range is walked, slots are called when their result is read
+    class iterate_range {
+    public:
+        class iterator {
+        public:
+            iterator(const iterate_range* range, std::size_t index)
+                : range(range),
+                  index(index) {
+            }
+
+            R operator*() const {
+                auto& s = range->slots->slots[index];
+                return s.call(s.object.get(), range->args);
+            }
+
+            iterator& operator++() {
+                ++index;
+                return *this;
+            }
+
+            bool operator!=(const iterator& other) const { return index != other.index; }
+
+        private:
+            const iterate_range* range;
+            std::size_t index;
+        };
+
+        iterate_range(const state& shared, Args... args)
+            : slots(shared.slots.load(std::memory_order_acquire)),
+              args(std::forward<Args>(args)...) {
+        }
+
+        iterate_range(const iterate_range&) = delete;
+        iterate_range& operator=(const iterate_range&) = delete;
+
+        iterator begin() const { return {this, 0}; }
+
+        iterator end() const { return {this, slots->slots.size()}; }
+
+    private:
+        // declared first, the thread has to be inside emit before the list is loaded
+        detail::signal_read_guard guard;
+        const slot_list* slots;
+        mutable args_type args;
+    };
+
+    hook_signal(void (*observer)(void*) = nullptr, void* observer_data = nullptr)
+        : shared(std::make_shared<state>()) {
+        shared->observer = observer;
+        shared->observer_data = observer_data;
+    }
+
+    hook_signal(const hook_signal&) = delete;
+    hook_signal& operator=(const hook_signal&) = delete;
+
+    ~hook_signal() {
+        // a connection disconnecting on another thread may still hold the state, don't call back into the hook
+        std::lock_guard lock{shared->mutex};
+        shared->observer = nullptr;
+    }
+
+    template <typename F>
+    connection connect(F&& function) {
+        using callable = std::decay_t<F>;
+        static_assert(std::is_invocable_v<callable&, Args...>, "slot isn't callable with the signal's arguments");
+        slot new_slot{0, std::make_shared<callable>(std::forward<F>(function)), &call_slot<callable>,
+                      &invoke_slot<callable>};
+        auto id = shared->connect(std::move(new_slot));
+        return {shared, id};
+    }
+
+    template <typename F>
+    scoped_connection scoped_connect(F&& function) {
+        return connect(std::forward<F>(function));
+    }
+
+    template <typename F>
+    hook_signal& operator+=(F&& function) {
+        connect(std::forward<F>(function));
+        return *this;
+    }
+
+    void disconnect(connection& c) { c.disconnect(); }
+
+    void disconnect_all() { shared->clear(); }
+
+    // From now on generates a dispatcher for the connected slots whenever they change.
+    // Worth it for signals whose slots rarely change and are emitted often.
+    void compile() { shared->compile(); }
+
+    // true if emitting currently goes through a generated dispatcher
+    bool is_compiled() const {
+        detail::signal_read_guard guard;
+        return shared->slots.load(std::memory_order_acquire)->dispatch != nullptr;
+    }
+
+    std::size_t size() const { return shared->count.load(std::memory_order_acquire); }
+
+    bool empty() const { return size() == 0; }
+
+    void emit(Args... args) const { emit_combined(nullptr, std::forward<Args>(args)...); }
+
+    // Calls every slot like emit and returns true if one of them asked to skip the original: a bool slot
+    // returned false or a std::optional slot returned a value. The last such value is stored into result,
+    // for other return types the last result is, result may be nullptr.
+    bool emit_combined(R* result, Args... args) const {
+        detail::signal_read_guard guard;
+        auto list = shared->slots.load(std::memory_order_acquire);
+        args_type packed{std::forward<Args>(args)...};
+        if (list->dispatch) return list->dispatch(&packed, result);
+        bool skip = false;
+        for (auto& s : list->slots) skip |= s.invoke(s.object.get(), &packed, result);
+        return skip;
+    }
+
+    iterate_range emit_iterate(Args... args) const { return {*shared, std::forward<Args>(args)...}; }
+
+private:
+    std::shared_ptr<state> shared;
+};
+
+#undef KTHOOK_DISPATCH_CC
+}  // namespace kthook
+
+#endif  // KTHOOK_SIGNAL_X86_64_HPP_
@@ -0,0 +1,60 @@
+#ifndef KTHOOK_TRANSACTION_X86_64_HPP_
+#define KTHOOK_TRANSACTION_X86_64_HPP_
+
+namespace kthook {
+// Installs and removes any number of hooks of any type with a single thread freeze.
+// commit() generates every stub and trampoline while other threads keep running, then stops them once,
+// writes all patches and resumes them, instead of a freeze per kFreezeThreads hook.
+//
+//     kthook::transaction tr;
+//     tr.install(hook_a).install(hook_b).remove(hook_c);
+//     tr.commit();
+class transaction {
+public:
+    template <typename Hook>
+    transaction& install(Hook& hook) {
+        operations.push_back({&hook, [](void* h) { return static_cast<Hook*>(h)->prepare_install(); },
+                              [](void* h) { return static_cast<Hook*>(h)->apply_install(); }});
+        return *this;
+    }
+
+    template <typename Hook>
+    transaction& remove(Hook& hook) {
+        operations.push_back({&hook, nullptr, [](void* h) { return static_cast<Hook*>(h)->remove(); }});
+        return *this;
+    }
+
+    // Nothing is patched if a hook can't be prepared (already installed, not executable, out of code memory).
+    // Returns false if that happened or some patch failed to apply, the others are applied anyway.
+    // The transaction is empty afterwards either way.
+    bool commit() {
+        auto pending = std::move(operations);
+        operations.clear();
+        for (auto& op : pending) {
+            if (op.prepare && !op.prepare(op.hook)) return false;
+        }
+
+        detail::frozen_threads threads;
+        if (!detail::freeze_threads(threads)) return false;
+        bool result = true;
+        for (auto& op : pending) {
+            if (!op.apply(op.hook)) result = false;
+        }
+        detail::unfreeze_threads(threads);
+        return result;
+    }
+
+    std::size_t size() const { return operations.size(); }
+
+private:
+    struct operation {
+        void* hook;
+        bool (*prepare)(void*);
+        bool (*apply)(void*);
+    };
+
+    std::vector<operation> operations;
+};
+} // namespace kthook
+
+#endif  // KTHOOK_TRANSACTION_X86_64_HPP_
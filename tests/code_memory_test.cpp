@@ -0,0 +1,242 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "kthook/kthook.hpp"
+#include "test_common.hpp"
+
+constexpr int return_default = 10;
+constexpr int test_val = 5;
+
+DECLARE_SIZE_ENLARGER();
+
+class A {
+public:
+    NO_OPTIMIZE static int CCONV
+    test_func(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+};
+
+class B {
+public:
+    NO_OPTIMIZE static int CCONV
+    test_func(int value) {
+        SIZE_ENLARGER();
+        return value + 1;
+    }
+};
+
+TEST(code_allocator, reuses_freed_slots) {
+    auto& allocator = kthook::detail::code_allocator::instance();
+    auto near_address = reinterpret_cast<std::uintptr_t>(&A::test_func);
+
+    auto first = allocator.alloc(near_address, 40);
+    auto second = allocator.alloc(near_address, 40);
+    ASSERT_TRUE(first);
+    ASSERT_TRUE(second);
+    EXPECT_EQ(first.size, 64u);
+    EXPECT_NE(first.code, second.code);
+
+    allocator.free(first.code);
+    auto third = allocator.alloc(near_address, 64);
+    EXPECT_EQ(third.code, first.code);
+
+    allocator.free(second.code);
+    allocator.free(third.code);
+}
+
+// retiring doesn't freeze the process behind the caller's back, the slots wait for collect_code_memory
+TEST(code_allocator, retire_only_collects_when_asked) {
+    auto& allocator = kthook::detail::code_allocator::instance();
+    auto near_address = reinterpret_cast<std::uintptr_t>(&A::test_func);
+    auto before = kthook::get_code_memory_stats();
+    auto freezes = kthook::get_freeze_stats().freezes;
+
+    for (std::size_t i = 0; i < kthook::detail::code_allocator::kCollectThreshold; ++i) {
+        auto block = allocator.alloc(near_address, 40);
+        ASSERT_TRUE(block);
+        allocator.retire(block.code, block.size);
+    }
+    EXPECT_EQ(kthook::get_freeze_stats().freezes, freezes);
+    EXPECT_EQ(kthook::get_code_memory_stats().retired,
+              before.retired + kthook::detail::code_allocator::kCollectThreshold);
+    kthook::collect_code_memory();
+}
+
+#if defined(__linux__) && defined(KTHOOK_64)
+TEST(code_allocator, code_is_never_writable_and_executable) {
+    auto& allocator = kthook::detail::code_allocator::instance();
+    auto block = allocator.alloc(reinterpret_cast<std::uintptr_t>(&A::test_func), 16);
+    ASSERT_TRUE(block);
+    EXPECT_NE(block.code, block.write);
+
+    auto mi = kthook::detail::memory_map_index::instance().find(reinterpret_cast<std::uintptr_t>(block.code), true);
+    ASSERT_TRUE(mi);
+    EXPECT_TRUE(mi->prot & PROT_EXEC);
+    EXPECT_FALSE(mi->prot & PROT_WRITE);
+    allocator.free(block.code);
+}
+
+TEST(code_allocator, data_slots_are_writable_and_not_executable) {
+    auto& allocator = kthook::detail::code_allocator::instance();
+    auto near_address = reinterpret_cast<std::uintptr_t>(&A::test_func);
+    auto block = allocator.alloc_data(near_address, 64);
+    ASSERT_TRUE(block);
+    EXPECT_TRUE(kthook::detail::is_in_near_range(near_address, reinterpret_cast<std::uintptr_t>(block.code)));
+
+    auto mi = kthook::detail::memory_map_index::instance().find(reinterpret_cast<std::uintptr_t>(block.code), true);
+    ASSERT_TRUE(mi);
+    EXPECT_TRUE(mi->prot & PROT_WRITE);
+    EXPECT_FALSE(mi->prot & PROT_EXEC);
+    std::memset(block.code, 0, block.size);
+    allocator.free(block.code);
+}
+
+TEST(code_allocator, regions_are_committed_inside_a_reservation) {
+    auto near_address = reinterpret_cast<std::uintptr_t>(&A::test_func);
+    auto first = kthook::detail::alloc_code_region(near_address, 0x10000);
+    ASSERT_NE(first.exec, nullptr);
+    EXPECT_TRUE(kthook::detail::is_in_near_range(near_address, reinterpret_cast<std::uintptr_t>(first.exec)));
+
+    // freed regions go back to the reservation and are handed out again
+    kthook::detail::free_code_region(first, 0x10000);
+    auto second = kthook::detail::alloc_code_region(near_address, 0x10000);
+    EXPECT_EQ(second.exec, first.exec);
+    kthook::detail::free_code_region(second, 0x10000);
+}
+
+TEST(code_allocator, module_stubs_share_an_arena) {
+    auto near_a = reinterpret_cast<std::uintptr_t>(&A::test_func);
+    auto near_b = reinterpret_cast<std::uintptr_t>(&B::test_func);
+    auto first = kthook::detail::alloc_code_region(near_a, 0x10000);
+    auto second = kthook::detail::alloc_code_region(near_b, 0x10000);
+    ASSERT_NE(first.exec, nullptr);
+    ASSERT_NE(second.exec, nullptr);
+
+    auto distance = first.exec < second.exec ? second.exec - first.exec : first.exec - second.exec;
+    EXPECT_LT(static_cast<std::size_t>(distance), kthook::detail::near_reservations::kReservationSize);
+    kthook::detail::free_code_region(first, 0x10000);
+    kthook::detail::free_code_region(second, 0x10000);
+}
+#endif
+
+TEST(kthook_simple, hooks_share_code_pages) {
+    auto before = kthook::get_code_memory_stats();
+    kthook::kthook_simple<decltype(&A::test_func)> hook_a{&A::test_func};
+    kthook::kthook_simple<decltype(&B::test_func)> hook_b{&B::test_func};
+    EXPECT_TRUE(hook_a.install());
+    EXPECT_TRUE(hook_b.install());
+
+    hook_a.set_cb([](const auto& hook, int& value) { return return_default; });
+    hook_b.set_cb([](const auto& hook, int& value) { return hook.get_trampoline()(value); });
+
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    EXPECT_EQ(B::test_func(test_val), test_val + 1);
+
+    auto after = kthook::get_code_memory_stats();
+    // a relay stub and a trampoline per hook
+    EXPECT_EQ(after.slots - before.slots, 4u);
+    EXPECT_LT(after.pages - before.pages, 4u);
+    EXPECT_GT(after.fill_ratio, 0.0);
+}
+
+// collect_code_memory needs to stop the other threads
+#if defined(_WIN32) || defined(__linux__)
+TEST(kthook_simple, destroyed_hooks_release_code) {
+    auto before = kthook::get_code_memory_stats();
+    {
+        kthook::kthook_simple<decltype(&A::test_func)> hook{&A::test_func};
+        EXPECT_TRUE(hook.install());
+        hook.set_cb([](const auto& hook, int& value) { return return_default; });
+        EXPECT_EQ(A::test_func(test_val), return_default);
+    }
+    // original bytes are back
+    EXPECT_EQ(A::test_func(test_val), test_val);
+
+    EXPECT_EQ(kthook::get_code_memory_stats().retired, before.retired + 2);
+    EXPECT_GE(kthook::collect_code_memory(), 2u);
+    auto after = kthook::get_code_memory_stats();
+    EXPECT_EQ(after.slots, before.slots);
+    EXPECT_EQ(after.retired, 0u);
+}
+
+#ifdef KTHOOK_64
+TEST(kthook_simple, stub_data_is_released_with_the_stub) {
+    auto before = kthook::get_code_memory_stats();
+    {
+        kthook::kthook_simple<decltype(&A::test_func)> hook{&A::test_func};
+        EXPECT_TRUE(hook.install());
+        hook.set_cb([](const auto& hook, int& value) { return return_default; });
+        EXPECT_EQ(A::test_func(test_val), return_default);
+        EXPECT_EQ(kthook::get_code_memory_stats().data_slots, before.data_slots + 1);
+    }
+    kthook::collect_code_memory();
+    EXPECT_EQ(kthook::get_code_memory_stats().data_slots, before.data_slots);
+}
+#endif
+#endif
+
+#if defined(KTHOOK_64_GCC) && defined(__linux__)
+// spinner_main keeps a retired stub's data slot in r11 and nowhere else
+volatile std::uintptr_t held_data = 0;
+volatile bool stop_holding = false;
+
+void spinner_main() {
+    asm volatile(
+        "1: mov %[held], %%r11\n"
+        "test %%r11, %%r11\n"
+        "je 1b\n"
+        "movq $0, %[held]\n"
+        "2: pause\n"
+        "cmpb $0, %[stop]\n"
+        "je 2b\n"
+        : [held] "+m"(held_data)
+        : [stop] "m"(stop_holding)
+        : "r11", "memory");
+}
+
+NO_OPTIMIZE void retire_held_block() {
+    auto& allocator = kthook::detail::code_allocator::instance();
+    auto near_address = reinterpret_cast<std::uintptr_t>(&A::test_func);
+    auto code = allocator.alloc(near_address, 32);
+    auto data = allocator.alloc_data(near_address, 32);
+    allocator.retire(code.code, 32, data.code);
+    held_data = reinterpret_cast<std::uintptr_t>(data.code);
+}
+
+// the stack collect() scans must not keep a stale copy of the address
+NO_OPTIMIZE void clear_stack() {
+    volatile std::uint8_t buffer[4096];
+    for (auto& byte : buffer) byte = 0;
+}
+
+TEST(code_allocator, registers_pin_retired_data) {
+    kthook::collect_code_memory();
+    std::thread spinner{spinner_main};
+    retire_held_block();
+    while (held_data != 0) std::this_thread::yield();
+    clear_stack();
+
+    EXPECT_EQ(kthook::collect_code_memory(), 0u);
+    EXPECT_EQ(kthook::get_code_memory_stats().retired, 1u);
+
+    stop_holding = true;
+    spinner.join();
+    EXPECT_EQ(kthook::collect_code_memory(), 1u);
+    EXPECT_EQ(kthook::get_code_memory_stats().retired, 0u);
+}
+#endif
+
+TEST(kthook_simple, remove_and_reinstall) {
+    kthook::kthook_simple<decltype(&A::test_func)> hook{&A::test_func};
+    hook.set_cb([](const auto& hook, int& value) { return return_default; });
+    EXPECT_TRUE(hook.install());
+    EXPECT_EQ(A::test_func(test_val), return_default);
+
+    EXPECT_TRUE(hook.remove());
+    EXPECT_EQ(A::test_func(test_val), test_val);
+
+    EXPECT_TRUE(hook.install());
+    EXPECT_EQ(A::test_func(test_val), return_default);
+}
@@ -4,6 +4,10 @@
 
 #include "xbyak/xbyak.h"
 
+#ifdef __linux__
+#include <sys/time.h>
+#endif
+
 #define EQUALITY_CHECK(x)                                           \
     if (lhs.x != rhs.x) {               \
         return testing::AssertionFailure() << "lhs." << #x << "(" << lhs.x << ") != " << "rhs." << #x << "(" << rhs.x << ")"; \
@@ -180,3 +184,73 @@ TEST(kthook_naked, function) {
     std::memset(&ctx, 0, sizeof(ctx) - sizeof(ctx.flags));
     generate_code()();
 }
+
+#ifdef KTHOOK_64_TLS
+class B {
+public:
+    NO_OPTIMIZE static int test_func(int depth) {
+        SIZE_ENLARGER();
+        return depth;
+    }
+};
+
+TEST(kthook_simple, recursive_context) {
+    kthook::kthook_simple<decltype(&B::test_func), kthook::kthook_option::kCreateContext> hook{&B::test_func};
+    EXPECT_TRUE(hook.install());
+
+    hook.set_cb([](const auto& hook, int& depth) {
+        auto rsp = hook.get_context().rsp;
+        EXPECT_EQ(static_cast<int>(hook.get_context().rdi), depth);
+        if (depth > 0) B::test_func(depth - 1);
+        // the nested call captured into its own frame
+        EXPECT_EQ(hook.get_context().rsp, rsp);
+        EXPECT_EQ(static_cast<int>(hook.get_context().rdi), depth);
+        return depth;
+    });
+
+    EXPECT_EQ(B::test_func(2), 2);
+}
+
+#ifdef __linux__
+class C {
+public:
+    NO_OPTIMIZE static int test_func(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+};
+
+volatile int context_signal_calls = 0;
+volatile int context_mismatches = 0;
+
+TEST(kthook_simple, context_in_signal_handlers) {
+    // a handler running between a stub's capture and its relay captures and reads a context of its own
+    kthook::kthook_simple<decltype(&C::test_func), kthook::kthook_option::kCreateContext> hook{&C::test_func};
+    EXPECT_TRUE(hook.install());
+    hook.set_cb([](const auto& hook, int& value) {
+        if (static_cast<int>(hook.get_context().rdi) != value) ++context_mismatches;
+        return value;
+    });
+
+    struct sigaction action {};
+    struct sigaction old_action {};
+    action.sa_handler = [](int) {
+        ++context_signal_calls;
+        C::test_func(-1);
+    };
+    sigemptyset(&action.sa_mask);
+    ASSERT_EQ(sigaction(SIGALRM, &action, &old_action), 0);
+    itimerval timer{{0, 20}, {0, 20}};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+
+    for (int i = 0; i < 2'000'000; ++i) C::test_func(i);
+
+    timer = {};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+    sigaction(SIGALRM, &old_action, nullptr);
+
+    EXPECT_GT(context_signal_calls, 0);
+    EXPECT_EQ(context_mismatches, 0);
+}
+#endif
+#endif
@@ -0,0 +1,121 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "kthook/kthook.hpp"
+#include "test_common.hpp"
+
+// freeze_threads does nothing on other platforms
+#if defined(_WIN32) || defined(__linux__)
+TEST(freeze_threads, waits_for_every_thread) {
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&done] {
+            while (!done) std::this_thread::yield();
+        });
+    }
+
+    auto before = kthook::get_freeze_stats();
+    kthook::detail::frozen_threads frozen;
+    ASSERT_TRUE(kthook::detail::freeze_threads(frozen));
+    EXPECT_TRUE(frozen.all_stopped);
+    kthook::detail::unfreeze_threads(frozen);
+
+    auto after = kthook::get_freeze_stats();
+    EXPECT_EQ(after.freezes, before.freezes + 1);
+    EXPECT_LE(after.last_latency, after.max_latency);
+
+    done = true;
+    for (auto& thread : threads) thread.join();
+}
+#endif
+
+#ifdef __linux__
+TEST(freeze_threads, relocates_threads_out_of_patched_bytes) {
+    auto code = static_cast<std::uint8_t*>(
+        mmap(nullptr, 4096, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(code, MAP_FAILED);
+    // nops into jmp $, a thread calling it spins on offset 5 until it is moved to the ret at offset 64
+    const std::uint8_t spin[] = {0x90, 0x90, 0x90, 0x90, 0x90, 0xEB, 0xFE};
+    std::memcpy(code, spin, sizeof(spin));
+    code[64] = 0xC3;
+
+    std::atomic<bool> returned{false};
+    std::thread spinner{[&] {
+        reinterpret_cast<void (*)()>(code)();
+        returned = true;
+    }};
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+
+    kthook::detail::trampoline_ip_map map;
+    map.add(0, 0);
+    map.add(5, 0);
+    auto before = kthook::get_freeze_stats();
+    kthook::detail::frozen_threads frozen;
+    ASSERT_TRUE(kthook::detail::freeze_threads(frozen));
+    kthook::detail::relocate_frozen_threads(reinterpret_cast<std::uintptr_t>(code), sizeof(spin), code + 64, map);
+    kthook::detail::unfreeze_threads(frozen);
+
+    spinner.join();
+    EXPECT_TRUE(returned);
+    EXPECT_EQ(kthook::get_freeze_stats().relocated, before.relocated + 1);
+    munmap(code, 4096);
+}
+
+// a thread blocking SIGUSR1 never stops, the freeze fails and the signal it gets later is dropped
+// instead of reaching the default action, which would terminate the process
+TEST(freeze_threads, fails_when_a_thread_does_not_stop) {
+    std::atomic<bool> blocked{false};
+    std::atomic<bool> unblock{false};
+    std::atomic<bool> survived{false};
+    std::thread blocker{[&] {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        blocked = true;
+        while (!unblock) std::this_thread::yield();
+        pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+        survived = true;
+    }};
+    while (!blocked) std::this_thread::yield();
+
+    auto before = kthook::get_freeze_stats();
+    kthook::detail::frozen_threads frozen;
+    EXPECT_FALSE(kthook::detail::freeze_threads(frozen));
+    EXPECT_EQ(kthook::get_freeze_stats().timeouts, before.timeouts + 1);
+    EXPECT_EQ(kthook::detail::active_freeze.load(), nullptr);
+
+    unblock = true;
+    blocker.join();
+    EXPECT_TRUE(survived);
+}
+
+// a handler installed over kthook's is replaced again by the next freeze and gets the SIGUSR1s that aren't kthook's
+TEST(freeze_threads, reinstalls_a_replaced_handler) {
+    static std::atomic<int> forwarded{0};
+    kthook::detail::frozen_threads first;
+    ASSERT_TRUE(kthook::detail::freeze_threads(first));
+    kthook::detail::unfreeze_threads(first);
+
+    struct sigaction act {}, old;
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = [](int) { ++forwarded; };
+    ASSERT_EQ(sigaction(SIGUSR1, &act, &old), 0);
+
+    std::atomic<bool> done{false};
+    std::thread worker{[&done] {
+        while (!done) std::this_thread::yield();
+    }};
+    kthook::detail::frozen_threads second;
+    EXPECT_TRUE(kthook::detail::freeze_threads(second));
+    EXPECT_TRUE(second.all_stopped);
+    kthook::detail::unfreeze_threads(second);
+    done = true;
+    worker.join();
+
+    raise(SIGUSR1);
+    EXPECT_EQ(forwarded, 1);
+    sigaction(SIGUSR1, &old, nullptr);
+}
+#endif
@@ -18,4 +18,17 @@ TEST(kthook_signal, null_func) {
 TEST(kthook_naked, null_func) {
     kthook::kthook_naked hook{null_mem};
     EXPECT_FALSE(hook.install());
-}
\ No newline at end of file
+}
+
+#ifndef _WIN32
+TEST(check_is_executable, sees_protection_changes) {
+    auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    void* page = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(page, MAP_FAILED);
+    EXPECT_FALSE(kthook::detail::check_is_executable(page));
+
+    ASSERT_EQ(mprotect(page, page_size, PROT_READ | PROT_EXEC), 0);
+    EXPECT_TRUE(kthook::detail::check_is_executable(page));
+    munmap(page, page_size);
+}
+#endif
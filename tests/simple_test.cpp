@@ -2,6 +2,10 @@
 #include "kthook/kthook.hpp"
 #include "test_common.hpp"
 
+#ifdef __linux__
+#include <sys/time.h>
+#endif
+
 constexpr int return_default = 10;
 constexpr int test_val = 5;
 
@@ -50,6 +54,134 @@ TEST(kthook_simple, function) {
     EXPECT_EQ(A::test_func(test_val), return_default);
 }
 
+TEST(kthook_simple, idle) {
+    kthook::kthook_simple<decltype(&A::test_func)> hook{&A::test_func};
+    hook.install();
+
+    // no callback, the relay stub goes straight to the trampoline
+    EXPECT_EQ(A::test_func(test_val), test_val);
+
+    hook.set_cb([](const auto& hook, int& value) { return return_default; });
+    EXPECT_EQ(A::test_func(test_val), return_default);
+
+    hook.remove();
+    hook.install();
+    EXPECT_EQ(A::test_func(test_val), return_default);
+
+    hook.set_cb(nullptr);
+    EXPECT_EQ(A::test_func(test_val), test_val);
+}
+
+TEST(kthook_simple, large_capture) {
+    std::array<int, 24> values{};
+    values.back() = return_default;
+
+    // default capacity is 8 pointers, 24 ints only fit in a larger one
+    kthook::kthook_simple<decltype(&A::test_func), kthook::kthook_option::kNone, sizeof(values)> hook{&A::test_func};
+    hook.install();
+
+    hook.set_cb([values](const auto& hook, int& value) { return values.back(); });
+    auto copy = hook.get_callback();
+
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    EXPECT_TRUE(copy);
+
+    hook.set_cb(nullptr);
+    EXPECT_EQ(A::test_func(test_val), test_val);
+}
+
+#ifdef KTHOOK_64
+TEST(kthook_simple, recursive_return_address) {
+    kthook::kthook_simple<decltype(&A::test_func)> hook{&A::test_func};
+    hook.install();
+
+    std::array<std::uintptr_t, 3> entered{};
+    hook.set_cb([&entered](const auto& hook, int& value) {
+        auto return_address = hook.get_return_address();
+        entered[value] = return_address;
+        if (value > 0) A::test_func(value - 1);
+        // the nested call must not have clobbered this call's return address
+        EXPECT_EQ(hook.get_return_address(), return_address);
+        return hook.get_trampoline()(value);
+    });
+
+    EXPECT_EQ(A::test_func(2), 2);
+    EXPECT_NE(entered[2], 0u);
+    EXPECT_NE(entered[2], entered[1]);
+    EXPECT_EQ(entered[1], entered[0]);
+    EXPECT_EQ(hook.get_return_address(), 0u);
+}
+#endif
+
+#ifdef KTHOOK_64_TLS
+TEST(kthook_simple, no_reentry) {
+    kthook::kthook_simple<decltype(&A::test_func), kthook::kthook_option::kNoReentry> hook{&A::test_func};
+    hook.install();
+
+    int calls = 0;
+    hook.set_cb([&calls](const auto& hook, int& value) {
+        ++calls;
+        // goes straight to the original function instead of back into this callback
+        EXPECT_EQ(A::test_func(value), value);
+        return return_default;
+    });
+
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    EXPECT_EQ(calls, 2);
+}
+#endif
+
+#if defined(KTHOOK_64_TLS) && defined(__linux__)
+class AS {
+public:
+    NO_OPTIMIZE static int test_func(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+};
+
+volatile int signal_calls = 0;
+volatile int signal_failures = 0;
+
+void call_hooked_from_signal(int) {
+    ++signal_calls;
+    if (AS::test_func(test_val) != test_val + 2) ++signal_failures;
+}
+
+TEST(kthook_simple, hooked_calls_from_signal_handlers) {
+    // both hooks share one relay, a handler running between the outer stub and its relay must not swap them
+    using hook_type = kthook::kthook_simple<decltype(&A::test_func)>;
+    hook_type outer{&A::test_func};
+    hook_type inner{&AS::test_func};
+    outer.install();
+    inner.install();
+    outer.set_cb([](const auto& hook, int& value) { return hook.get_trampoline()(value) + 1; });
+    inner.set_cb([](const auto& hook, int& value) { return hook.get_trampoline()(value) + 2; });
+
+    struct sigaction action {};
+    struct sigaction old_action {};
+    action.sa_handler = &call_hooked_from_signal;
+    sigemptyset(&action.sa_mask);
+    ASSERT_EQ(sigaction(SIGALRM, &action, &old_action), 0);
+    itimerval timer{{0, 20}, {0, 20}};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+
+    int failures = 0;
+    for (int i = 0; i < 2'000'000; ++i) {
+        if (A::test_func(i) != i + 1) ++failures;
+    }
+
+    timer = {};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+    sigaction(SIGALRM, &old_action, nullptr);
+
+    EXPECT_EQ(failures, 0);
+    EXPECT_GT(signal_calls, 0);
+    EXPECT_EQ(signal_failures, 0);
+}
+#endif
+
 TEST(kthook_naked, thiscall_function) {
     kthook::kthook_naked hook{reinterpret_cast<std::uintptr_t>(&AT::test_func)};
     hook.install();
@@ -78,6 +210,49 @@ TEST(kthook_naked, fastcall_function) {
     AF::test_func(test_val);
 }
 
+TEST(kthook_naked, recursive_function) {
+    kthook::kthook_naked hook{reinterpret_cast<std::uintptr_t>(&AF::test_func)};
+    hook.install();
+
+    hook.set_cb([](const kthook::kthook_naked& hook) {
+        auto& ctx = hook.get_context();
+        auto arg1 = static_cast<int>(ctx.IARG1);
+        if (arg1 > 0) AF::test_func(arg1 - 1);
+        // the nested call saved its registers in a save area of its own
+        EXPECT_EQ(&hook.get_context(), &ctx);
+        EXPECT_EQ(static_cast<int>(ctx.IARG1), arg1);
+    });
+
+    EXPECT_EQ(AF::test_func(2), 2);
+}
+
+#ifdef KTHOOK_64
+TEST(kthook_naked, extended_state) {
+    kthook::kthook_naked_extended hook{reinterpret_cast<std::uintptr_t>(&AF::test_func)};
+    hook.install();
+    EXPECT_FALSE(hook.get_extended_context().has_ymm());
+
+    bool called = false;
+    hook.set_cb([&](const kthook::kthook_naked_extended& hook) {
+        called = true;
+        EXPECT_EQ(static_cast<int>(hook.get_context().IARG1), test_val);
+        auto ctx = hook.get_extended_context();
+        if (!ctx.has_ymm()) return;
+        // writes go to the saved images, the stub loads them back into the registers on the way out
+        kthook::ymm_value value;
+        std::memset(&value, 0x5A, sizeof(value));
+        ctx.set_reg<kthook::YMM::YMM1>(value);
+        auto saved = ctx.reg<kthook::YMM::YMM1>();
+        EXPECT_EQ(std::memcmp(&saved, &value, sizeof(value)), 0);
+        auto low = hook.get_x87_context().reg<kthook::XMM::XMM1>();
+        EXPECT_EQ(std::memcmp(&low, &value[0], sizeof(low)), 0);
+    });
+
+    EXPECT_EQ(AF::test_func(test_val), test_val);
+    EXPECT_TRUE(called);
+}
+#endif
+
 TEST(kthook_signal, function) {
     kthook::kthook_signal<decltype(&A::test_func)> hook{&A::test_func};
 
@@ -106,3 +281,47 @@ TEST(kthook_signal, function) {
         EXPECT_EQ(A::test_func(test_val), return_default);
     }
 }
+
+TEST(kthook_signal, no_subscribers) {
+    kthook::kthook_signal<decltype(&A::test_func)> hook{&A::test_func};
+
+    EXPECT_TRUE(hook.before.empty());
+    EXPECT_EQ(A::test_func(test_val), test_val);
+
+    {
+        auto connection = hook.after.scoped_connect(
+            [](const auto& hook, int& return_value, int& value) { return_value = return_default; });
+        EXPECT_EQ(hook.after.size(), 1u);
+        EXPECT_EQ(A::test_func(test_val), return_default);
+    }
+
+    EXPECT_TRUE(hook.after.empty());
+    EXPECT_EQ(A::test_func(test_val), test_val);
+}
+
+TEST(kthook_signal, compiled) {
+    kthook::kthook_signal<decltype(&A::test_func)> hook{&A::test_func};
+    hook.compile();
+
+    std::vector<int> order;
+    auto first = hook.before.scoped_connect([&](const auto& hook, int& value) {
+        order.push_back(1);
+        value = return_default;
+        return std::nullopt;
+    });
+    auto second = hook.before.scoped_connect([&](const auto& hook, int& value) {
+        order.push_back(2);
+        return std::nullopt;
+    });
+    EXPECT_TRUE(hook.before.is_compiled());
+
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    EXPECT_EQ(order, (std::vector<int>{1, 2}));
+
+    // regenerated for the remaining slot
+    first.disconnect();
+    auto skip =
+        hook.before.scoped_connect([](const auto& hook, int& value) { return std::make_optional(test_val + 1); });
+    EXPECT_TRUE(hook.before.is_compiled());
+    EXPECT_EQ(A::test_func(test_val), test_val + 1);
+}
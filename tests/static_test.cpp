@@ -0,0 +1,43 @@
+#include "gtest/gtest.h"
+#include "kthook/kthook.hpp"
+#include "test_common.hpp"
+
+constexpr int return_default = 10;
+constexpr int test_val = 5;
+
+DECLARE_SIZE_ENLARGER();
+
+class A {
+public:
+    NO_OPTIMIZE static int CCONV
+    test_func(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+
+    NO_OPTIMIZE static int CCONV
+    test_func2(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+};
+
+constexpr auto replace_value = [](const auto& hook, int& value) { return hook.get_trampoline()(return_default); };
+constexpr auto skip_original = [](const auto& hook, int& value) { return value * 2; };
+
+TEST(kthook_static, function) {
+    kthook::kthook_static<decltype(&A::test_func), &replace_value> hook{&A::test_func};
+    EXPECT_TRUE(hook.install());
+
+    EXPECT_EQ(A::test_func(test_val), return_default);
+
+    EXPECT_TRUE(hook.remove());
+    EXPECT_EQ(A::test_func(test_val), test_val);
+}
+
+TEST(kthook_static, skip_original) {
+    kthook::kthook_static<decltype(&A::test_func2), &skip_original> hook{&A::test_func2};
+    EXPECT_TRUE(hook.install());
+
+    EXPECT_EQ(A::test_func2(test_val), test_val * 2);
+}
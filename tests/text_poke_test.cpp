@@ -0,0 +1,130 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "kthook/kthook.hpp"
+#include "test_common.hpp"
+
+constexpr int return_default = 10;
+constexpr int test_val = 5;
+
+DECLARE_SIZE_ENLARGER();
+
+class A {
+public:
+    NO_OPTIMIZE static int CCONV
+    test_func(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+};
+
+TEST(kthook_simple, text_poke_install) {
+    kthook::kthook_simple<decltype(&A::test_func), kthook::kTextPoke> hook{&A::test_func};
+    hook.set_cb([](const auto& hook, int& value) { return return_default; });
+    auto freezes = kthook::get_freeze_stats().freezes;
+    EXPECT_TRUE(hook.install());
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    // the jump usually covers several instructions of a compiled function, those are patched under a freeze
+    auto address = reinterpret_cast<std::uintptr_t>(&A::test_func);
+    if (kthook::detail::can_text_poke(address, kthook::detail::detect_hook_size(address))) {
+        EXPECT_EQ(kthook::get_freeze_stats().freezes, freezes);
+    } else {
+        EXPECT_EQ(kthook::get_freeze_stats().freezes, freezes + 1);
+    }
+}
+
+#ifndef _WIN32
+TEST(text_poke, patches_code_other_threads_run) {
+    if (!kthook::detail::text_poke_supported()) GTEST_SKIP() << "no core serializing membarrier";
+
+    auto code = static_cast<std::uint8_t*>(
+        mmap(nullptr, 4096, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(code, MAP_FAILED);
+    // mov eax, imm32; ret
+    const std::uint8_t one[] = {0xB8, 1, 0, 0, 0, 0xC3};
+    const std::uint8_t two[] = {0xB8, 2, 0, 0, 0, 0xC3};
+    std::memcpy(code, one, sizeof(one));
+    std::memcpy(code + 64, one, sizeof(one));
+
+    std::atomic<bool> done{false};
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&] {
+            while (!done) {
+                auto result = reinterpret_cast<int (*)()>(code)();
+                if (result != 1 && result != 2) ++wrong;
+            }
+        });
+    }
+    for (int i = 0; i < 200; ++i) {
+        EXPECT_TRUE(kthook::detail::patch_code(reinterpret_cast<std::uintptr_t>(code), i % 2 ? one : two,
+                                               sizeof(one), true, code + 64));
+    }
+    done = true;
+    for (auto& thread : threads) thread.join();
+
+    EXPECT_EQ(wrong, 0);
+    EXPECT_EQ(reinterpret_cast<int (*)()>(code)(), 1);
+    munmap(code, 4096);
+}
+
+TEST(text_poke, refuses_patches_past_the_first_instruction) {
+    if (!kthook::detail::text_poke_supported()) GTEST_SKIP() << "no core serializing membarrier";
+
+    auto code = static_cast<std::uint8_t*>(
+        mmap(nullptr, 4096, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(code, MAP_FAILED);
+    // xor eax, eax; inc eax; inc eax; ret
+    const std::uint8_t original[] = {0x31, 0xC0, 0xFF, 0xC0, 0xFF, 0xC0, 0xC3};
+    const std::uint8_t patch[] = {0xB8, 7, 0, 0, 0, 0x90, 0xC3};
+    std::memcpy(code, original, sizeof(original));
+
+    EXPECT_FALSE(kthook::detail::can_text_poke(reinterpret_cast<std::uintptr_t>(code), 6));
+    EXPECT_FALSE(kthook::detail::text_poke(reinterpret_cast<std::uintptr_t>(code), patch, sizeof(patch), code));
+    EXPECT_EQ(std::memcmp(code, original, sizeof(original)), 0);
+    munmap(code, 4096);
+}
+
+#ifdef __linux__
+// a kTextPoke hook whose jump covers several instructions goes in under a freeze, threads running them
+// are moved to the trampoline and never see half of the jump. Only Linux can stop the threads.
+TEST(kthook_simple, text_poke_multi_instruction_install) {
+    auto code = static_cast<std::uint8_t*>(
+        mmap(nullptr, 4096, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(code, MAP_FAILED);
+    // xor eax, eax; inc eax; inc eax; ret
+    const std::uint8_t original[] = {0x31, 0xC0, 0xFF, 0xC0, 0xFF, 0xC0, 0xC3};
+    std::memcpy(code, original, sizeof(original));
+    using function_type = int (*)();
+    auto function = reinterpret_cast<function_type>(code);
+
+    std::atomic<bool> done{false};
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&] {
+            while (!done) {
+                auto result = function();
+                if (result != 2 && result != return_default) ++wrong;
+            }
+        });
+    }
+
+    auto freezes = kthook::get_freeze_stats().freezes;
+    {
+        kthook::kthook_simple<function_type, kthook::kTextPoke> hook{function};
+        hook.set_cb([](const auto& hook) { return return_default; });
+        EXPECT_TRUE(hook.install());
+        EXPECT_EQ(kthook::get_freeze_stats().freezes, freezes + 1);
+        EXPECT_EQ(function(), return_default);
+        done = true;
+        for (auto& thread : threads) thread.join();
+    }
+
+    EXPECT_EQ(wrong, 0);
+    EXPECT_EQ(function(), 2);
+    munmap(code, 4096);
+}
+#endif
+#endif
@@ -0,0 +1,55 @@
+#include "gtest/gtest.h"
+#include "kthook/kthook.hpp"
+#include "test_common.hpp"
+
+constexpr int return_default = 10;
+constexpr int test_val = 5;
+
+DECLARE_SIZE_ENLARGER();
+
+class A {
+public:
+    NO_OPTIMIZE static int CCONV
+    test_func(int value) {
+        SIZE_ENLARGER();
+        return value;
+    }
+};
+
+class B {
+public:
+    NO_OPTIMIZE static int CCONV
+    test_func(int value) {
+        SIZE_ENLARGER();
+        return value + 1;
+    }
+};
+
+TEST(transaction, installs_and_removes_hooks_of_any_type) {
+    kthook::kthook_simple<decltype(&A::test_func), kthook::kFreezeThreads> hook_a{&A::test_func};
+    kthook::kthook_signal<decltype(&B::test_func)> hook_b{&B::test_func, false};
+    hook_a.set_cb([](const auto& hook, int& value) { return return_default; });
+    hook_b.before.connect([](const auto& hook, int& value) { return std::make_optional(return_default + 1); });
+
+    kthook::transaction tr;
+    tr.install(hook_a).install(hook_b);
+    EXPECT_EQ(tr.size(), 2u);
+    EXPECT_TRUE(tr.commit());
+    EXPECT_EQ(tr.size(), 0u);
+    EXPECT_EQ(A::test_func(test_val), return_default);
+    EXPECT_EQ(B::test_func(test_val), return_default + 1);
+
+    EXPECT_TRUE(tr.remove(hook_a).remove(hook_b).commit());
+    EXPECT_EQ(A::test_func(test_val), test_val);
+    EXPECT_EQ(B::test_func(test_val), test_val + 1);
+}
+
+TEST(transaction, nothing_is_applied_if_a_hook_fails) {
+    kthook::kthook_simple<decltype(&A::test_func)> hook_a{&A::test_func};
+    kthook::kthook_simple<decltype(&B::test_func)> hook_b{};
+    hook_a.set_cb([](const auto& hook, int& value) { return return_default; });
+
+    kthook::transaction tr;
+    EXPECT_FALSE(tr.install(hook_a).install(hook_b).commit());
+    EXPECT_EQ(A::test_func(test_val), test_val);
+}